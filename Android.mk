@@ -23,19 +23,31 @@ endif
 
 enc_srcs := \
         src/api.cc \
+        src/arena.cc \
+        src/batch.cc \
         src/bit_writer.cc \
+        src/coeffs.cc \
         src/colors_rgb.$(NEON) \
+        src/colors_rgb_avx2.cc \
+        src/colors_rgb_ssse3.cc \
+        src/context.cc \
         src/enc.cc \
         src/encoders.cc \
         src/entropy.cc \
         src/fdct.$(NEON) \
+        src/fdct_avx2.cc \
+        src/file_sinks.cc \
         src/headers.cc \
         src/histogram.$(NEON) \
+        src/histogram_avx2.cc \
         src/dichotomy.cc \
         src/jpeg_tools.cc \
         src/quantize.$(NEON) \
+        src/quantize_avx2.cc \
         src/yuv_convert.$(NEON) \
         src/score_7.cc \
+        src/stream.cc \
+        src/thread_pool.cc \
 
 ################################################################################
 
@@ -115,3 +115,62 @@ foreach(I_SIMD RANGE ${SJPEG_SIMD_DEFINES_RANGE})
     endif()
   endif()
 endforeach()
+
+## AVX2 is only enabled in the *_avx2.cc files, and picked at runtime: the
+## rest of the library keeps the baseline flags.
+
+set(SJPEG_HAVE_AVX2 0)
+if(SJPEG_ENABLE_SIMD AND SJPEG_HAVE___SSE2__)
+  if(MSVC)
+    set(SJPEG_AVX2_FLAGS "/arch:AVX2")
+  else()
+    set(SJPEG_AVX2_FLAGS "-mavx2")
+  endif()
+  set(CMAKE_REQUIRED_FLAGS_INI ${CMAKE_REQUIRED_FLAGS})
+  set(CMAKE_REQUIRED_FLAGS ${SJPEG_AVX2_FLAGS})
+  unset(SJPEG_HAVE_FLAG_AVX2 CACHE)
+  check_cxx_source_compiles("
+      #include <immintrin.h>
+      int main(void) {
+        #if !defined(__AVX2__)
+        this is not valid code
+        #endif
+        const __m256i v = _mm256_set1_epi16(1);
+        return _mm256_movemask_epi8(_mm256_add_epi16(v, v));
+      }
+    " SJPEG_HAVE_FLAG_AVX2
+  )
+  set(CMAKE_REQUIRED_FLAGS ${CMAKE_REQUIRED_FLAGS_INI})
+  if(SJPEG_HAVE_FLAG_AVX2)
+    set(SJPEG_HAVE_AVX2 1)
+  else()
+    message(STATUS "Disabling AVX2 optimization.")
+  endif()
+endif()
+
+## Same for SSSE3 and the *_ssse3.cc files. MSVC has no flag for it.
+
+set(SJPEG_HAVE_SSSE3 0)
+if(SJPEG_ENABLE_SIMD AND SJPEG_HAVE___SSE2__ AND NOT MSVC)
+  set(SJPEG_SSSE3_FLAGS "-mssse3")
+  set(CMAKE_REQUIRED_FLAGS_INI ${CMAKE_REQUIRED_FLAGS})
+  set(CMAKE_REQUIRED_FLAGS ${SJPEG_SSSE3_FLAGS})
+  unset(SJPEG_HAVE_FLAG_SSSE3 CACHE)
+  check_cxx_source_compiles("
+      #include <tmmintrin.h>
+      int main(void) {
+        #if !defined(__SSSE3__)
+        this is not valid code
+        #endif
+        const __m128i v = _mm_set1_epi8(1);
+        return _mm_movemask_epi8(_mm_shuffle_epi8(v, v));
+      }
+    " SJPEG_HAVE_FLAG_SSSE3
+  )
+  set(CMAKE_REQUIRED_FLAGS ${CMAKE_REQUIRED_FLAGS_INI})
+  if(SJPEG_HAVE_FLAG_SSSE3)
+    set(SJPEG_HAVE_SSSE3 1)
+  else()
+    message(STATUS "Disabling SSSE3 optimization.")
+  endif()
+endif()
@@ -132,6 +132,10 @@ int main(int argc, char * argv[]) {
     "  -qmin <float> ...... minimum acceptable quality factor during search\n"
     "  -qmax <float> ...... maximum acceptable quality factor during search\n"
     "  -tolerance <float> . tolerance for convergence during search\n"
+    "  -compact ........... keep the DCT coefficients packed (=less memory)\n"
+    "  -threads <int> ..... number of threads (and restart intervals) to use\n"
+    "  -pipelined ......... with -threads, don't use restart intervals\n"
+    "  -max_memory <int> .. memory budget in kilobytes (=slower if tight)\n"
     "\n"
     "  -gray .............. shortcut for '-yuv_mode 4'\n"
     "  -444 ............... shortcut for '-yuv_mode 3'\n"
@@ -205,6 +209,14 @@ int main(int argc, char * argv[]) {
       param.target_value = atof(argv[++c]);
     } else if (!strcmp(argv[c], "-pass") && c + 1 < argc) {
       param.passes = atoi(argv[++c]);
+    } else if (!strcmp(argv[c], "-threads") && c + 1 < argc) {
+      param.num_threads = atoi(argv[++c]);
+    } else if (!strcmp(argv[c], "-pipelined")) {
+      param.pipelined = true;
+    } else if (!strcmp(argv[c], "-compact")) {
+      param.compact_coeffs = true;
+    } else if (!strcmp(argv[c], "-max_memory") && c + 1 < argc) {
+      param.max_memory_bytes = (size_t)atoi(argv[++c]) << 10;
     } else if (!strcmp(argv[c], "-no_metadata")) {
       no_metadata = true;
     } else if (!strcmp(argv[c], "-yuv_mode") && c + 1 < argc) {
@@ -285,6 +297,8 @@ int main(int argc, char * argv[]) {
     }
   }
 
+  hook.num_candidates = param.num_threads;
+
   if (estimate) {
     const int q = is_jpeg ? SjpegEstimateQuality(quant_matrices[0], 0) : 100;
     fprintf(stdout, "%d\n", q);
@@ -328,13 +342,36 @@ int main(int argc, char * argv[]) {
 
   if (no_metadata) param.ResetMetadata();
 
+  // Unless the bitstream is needed in memory, it goes straight to the file.
+  FILE* file = nullptr;
+  std::shared_ptr<sjpeg::ByteSink> file_sink;
+  if (output_file != nullptr && !print_crc && !print_md5) {
+    file = fopen(output_file, "wb");
+    if (file != nullptr) file_sink = sjpeg::MakeFdSink(fileno(file));
+    if (file_sink == nullptr && file != nullptr) {
+      fclose(file);   // not available: SaveFile() below will do
+      file = nullptr;
+    }
+  }
+
   const double start = GetStopwatchTime();
   std::string out;
-  const bool ok = sjpeg::Encode(&in_bytes[0], W, H, 3 * W, param, &out);
+  size_t out_size = 0;
+  bool ok;
+  if (file_sink != nullptr) {
+    ok = sjpeg::Encode(&in_bytes[0], W, H, 3 * W, param, file_sink.get());
+    ok = ok && (fseek(file, 0, SEEK_END) == 0);
+    if (ok) out_size = static_cast<size_t>(ftell(file));
+  } else {
+    ok = sjpeg::Encode(&in_bytes[0], W, H, 3 * W, param, &out);
+    out_size = out.size();
+  }
   const double encode_time = GetStopwatchTime() - start;
+  if (file != nullptr) fclose(file);
 
   if (!ok) {
     fprintf(stderr, "ERROR: call to sjpeg::Encode() failed.\n");
+    if (file_sink != nullptr) remove(output_file);   // no partial file left
     return -1;
   }
 
@@ -354,9 +391,9 @@ int main(int argc, char * argv[]) {
                     "%s%.1f (adaptive: %s, Huffman: %s)\n"
                     "yuv mode:    %s (riskiness: %.1lf%%)\n"
                     "elapsed:     %d ms\n",
-                    static_cast<uint32_t>(out.size()),
-                    8.f * out.size() / (W * H),
-                    100. * out.size() / input.size(),
+                    static_cast<uint32_t>(out_size),
+                    8.f * out_size / (W * H),
+                    100. * out_size / input.size(),
                     show_reduction ? "reduction:   r=" : "quality:     q=",
                     show_reduction ? reduction : quality,
                     kNoYes[param.adaptive_quantization],
@@ -372,12 +409,16 @@ int main(int argc, char * argv[]) {
   } else if (!quiet) {
     fprintf(stdout, "%u %u %.2lf %%\n",
             static_cast<uint32_t>(input.size()),
-            static_cast<uint32_t>(out.size()),
-            100. * out.size() / input.size());
+            static_cast<uint32_t>(out_size),
+            100. * out_size / input.size());
   }
 
   // Save the result.
-  if (output_file != nullptr && !SaveFile(output_file, out, quiet)) return 1;
+  if (file_sink != nullptr) {
+    if (!quiet) fprintf(stdout, "Saved file: %s\n", output_file);
+  } else if (output_file != nullptr && !SaveFile(output_file, out, quiet)) {
+    return 1;
+  }
 
   return 0;     // ok.
 }
@@ -16,7 +16,6 @@
 //
 // Author: Skal (pascal.massimino@gmail.com)
 
-#include <assert.h>
 #include <stdint.h>
 
 #include <cstdlib>
@@ -60,6 +59,29 @@ void SjpegFreeBuffer(const uint8_t* buffer) {
   delete[] buffer;
 }
 
+size_t SjpegMaxOutputSize(int width, int height, SjpegYUVMode yuv_mode,
+                          size_t metadata_size) {
+  if (width <= 0 || height <= 0 ||
+      width > sjpeg::kMaxDimension || height > sjpeg::kMaxDimension) {
+    return 0;
+  }
+  // 8x8 blocks to code. SJPEG_YUV_AUTO can pick 4:4:4, which has the most.
+  const size_t w8 = (width + 7) / 8, h8 = (height + 7) / 8;
+  const size_t w16 = (width + 15) / 16, h16 = (height + 15) / 16;
+  const size_t nb_blocks = (yuv_mode == SJPEG_YUV_400) ? w8 * h8
+                         : (yuv_mode == SJPEG_YUV_420 ||
+                            yuv_mode == SJPEG_YUV_SHARP) ? 6 * w16 * h16
+                         : 3 * w8 * h8;
+  // Encoder::ReserveMCU() wants 2560 bytes of room for any MCU (of up to 6
+  // blocks), the last one included. Restart markers and byte-alignment take
+  // at most 4 bytes per band, so per row of 8x8 blocks.
+  const size_t scan_size = nb_blocks * ((2560 + 5) / 6) + 2560 + 4 * h8;
+  // Headers and tables (2kB is plenty), then the metadata, split in chunks
+  // of less than 64kB with their own headers.
+  const size_t metadata_chunks = metadata_size / 65000 + 4;
+  return scan_size + 2048 + metadata_size + 128 * metadata_chunks;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 uint32_t SjpegVersion() {
@@ -71,12 +93,15 @@ uint32_t SjpegVersion() {
 
 namespace sjpeg {
 
-EncoderParam::EncoderParam() : search_hook(nullptr), memory(nullptr) {
+EncoderParam::EncoderParam()
+    : search_hook(nullptr), executor(nullptr), memory(nullptr),
+      stats(nullptr) {
   Init(kDefaultQuality);
 }
 
 EncoderParam::EncoderParam(float quality_factor)
-    : search_hook(nullptr), memory(nullptr) {
+    : search_hook(nullptr), executor(nullptr), memory(nullptr),
+      stats(nullptr) {
   Init(quality_factor);
 }
 
@@ -98,6 +123,11 @@ void EncoderParam::Init(float quality_factor) {
   tolerance = 1.;
   qmin = 0.;
   qmax = 100.;
+  compact_coeffs = false;
+  num_threads = 1;
+  pipelined = false;
+  flush_rows = false;
+  max_memory_bytes = 0;
 }
 
 void EncoderParam::SetQuality(float quality_factor) {
@@ -166,17 +196,40 @@ bool Encoder::InitFromParam(const EncoderParam& param) {
   SetMetadata(param.xmp, Encoder::XMP);
   xmp_split_ = param.xmp_split_point;
 
+  num_threads_ = (param.num_threads < 1) ? 1
+               : (param.num_threads > kMaxThreads) ? kMaxThreads
+               : param.num_threads;
+  pipelined_ = param.pipelined;
+  compact_coeffs_ = param.compact_coeffs;
+  flush_rows_ = param.flush_rows;
+  max_memory_ = param.max_memory_bytes;
+  executor_ = param.executor;
+  if (executor_ == nullptr && num_threads_ > 1) {
+    own_executor_ = MakeThreadPool(num_threads_);
+    executor_ = own_executor_.get();   // if null, bands are coded serially
+  }
+
   passes_ = (param.passes < 1) ? 1 : (param.passes > 20) ? 20 : param.passes;
   if (passes_ > 1) {
     use_extra_memory_ = true;
     reuse_run_levels_ = true;
-    search_hook_ = (param.search_hook == nullptr) ? &default_hook_
-                                                  : param.search_hook;
+    if (param.search_hook == nullptr) {
+      default_hook_.num_candidates = num_threads_;
+      search_hook_ = &default_hook_;
+    } else {
+      search_hook_ = param.search_hook;
+    }
     if (!search_hook_->Setup(param)) return false;
   }
 
-  assert(memory_hook_ == (param.memory == nullptr ? GetDefaultMemoryManager()
-                                                  : param.memory));
+  // memory_hook_ was set at construction, usually from param.memory (but
+  // EncoderContext substitutes its own).
+  stats_out_ = param.stats;
+  if (stats_out_ != nullptr) {
+    counting_memory_.reset(new (std::nothrow) CountingMemory(memory_hook_));
+    if (counting_memory_ == nullptr) return false;
+    memory_hook_ = counting_memory_.get();
+  }
   return true;
 }
 
@@ -303,5 +356,11 @@ bool EncodeGray(const uint8_t* gray, int width, int height, int stride,
   return EncodeGray(gray, width, height, stride, param, &sink);
 }
 
+size_t MaxOutputSize(int width, int height, const EncoderParam& param) {
+  const size_t metadata_size = param.iccp.size() + param.exif.size() +
+                               param.xmp.size() + param.app_markers.size();
+  return SjpegMaxOutputSize(width, height, param.yuv_mode, metadata_size);
+}
+
 }  // namespace sjpeg
 
@@ -0,0 +1,124 @@
+// Copyright 2026 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//  Bump-pointer memory manager: ArenaMemoryManager
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "sjpegi.h"
+
+namespace sjpeg {
+
+namespace {
+
+const size_t kAlign = 16;                // same as malloc() on 64b platforms
+const size_t kMinChunkSize = 64 << 10;
+
+}   // namespace
+
+struct alignas(kAlign) ArenaMemoryManager::Chunk {
+  Chunk* prev;
+  size_t size;   // number of bytes following the header
+};
+
+ArenaMemoryManager::ArenaMemoryManager(size_t initial_size,
+                                       MemoryManager* const base)
+    : base_((base == nullptr) ? GetDefaultMemoryManager() : base),
+      next_size_(std::max(initial_size, kMinChunkSize)) {}
+
+ArenaMemoryManager::~ArenaMemoryManager() { ReleaseChunks(); }
+
+void ArenaMemoryManager::ReleaseChunks() {
+  while (chunk_ != nullptr) {
+    Chunk* const prev = chunk_->prev;
+    base_->Free(chunk_);
+    chunk_ = prev;
+  }
+  top_ = end_ = last_ = nullptr;
+  capacity_ = 0;
+}
+
+bool ArenaMemoryManager::AddChunk(size_t size) {
+  const size_t chunk_size = std::max(size, next_size_);
+  if (chunk_size > SIZE_MAX - sizeof(Chunk)) return false;
+  Chunk* const chunk =
+      static_cast<Chunk*>(base_->Alloc(sizeof(Chunk) + chunk_size));
+  if (chunk == nullptr) return false;
+  chunk->prev = chunk_;
+  chunk->size = chunk_size;
+  chunk_ = chunk;
+  top_ = reinterpret_cast<uint8_t*>(chunk + 1);
+  end_ = top_ + chunk_size;
+  last_ = nullptr;   // can't be taken back from another chunk
+  capacity_ += chunk_size;
+  next_size_ = (chunk_size <= SIZE_MAX / 2) ? 2 * chunk_size : chunk_size;
+  return true;
+}
+
+void* ArenaMemoryManager::Alloc(size_t size) {
+  if (size > SIZE_MAX - kAlign) return nullptr;
+  size = std::max((size + kAlign - 1) & ~(kAlign - 1), kAlign);
+  if (size > (size_t)(end_ - top_) && !AddChunk(size)) return nullptr;
+  last_ = top_;
+  top_ += size;
+  used_ += size;
+  high_water_mark_ = std::max(high_water_mark_, used_);
+  return last_;
+}
+
+void ArenaMemoryManager::Free(void* const ptr) {
+  if (ptr == nullptr || ptr != last_) return;   // released by Reset() only
+  used_ -= top_ - last_;
+  top_ = last_;
+  last_ = nullptr;
+}
+
+void* ArenaMemoryManager::Realloc(void* const ptr, size_t used_size,
+                                  size_t new_size) {
+  if (ptr != nullptr && ptr == last_ && new_size <= SIZE_MAX - kAlign) {
+    const size_t size = (new_size + kAlign - 1) & ~(kAlign - 1);
+    if (size <= (size_t)(end_ - last_)) {   // grow (or shrink) in place
+      used_ = used_ - (top_ - last_) + size;
+      high_water_mark_ = std::max(high_water_mark_, used_);
+      top_ = last_ + size;
+      return ptr;
+    }
+  }
+  // The previous block, even if it was the last one, stays where it is: the
+  // new one comes from a fresh chunk anyway.
+  void* const new_ptr = Alloc(new_size);
+  if (new_ptr != nullptr && ptr != nullptr) {
+    memcpy(new_ptr, ptr, std::min(used_size, new_size));
+  }
+  return new_ptr;
+}
+
+void ArenaMemoryManager::Reset() {
+  if (chunk_ != nullptr && chunk_->prev != nullptr) {
+    // Merge the chunks: the next encoding will be served by a single one.
+    const size_t total = capacity_;
+    ReleaseChunks();
+    next_size_ = total;
+  } else if (chunk_ != nullptr) {
+    top_ = reinterpret_cast<uint8_t*>(chunk_ + 1);
+    last_ = nullptr;
+  }
+  used_ = 0;
+}
+
+}   // namespace sjpeg
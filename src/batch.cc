@@ -0,0 +1,180 @@
+// Copyright 2026 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//  Batch encoding: EncodeBatch()
+//
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>  // NOLINT
+#include <new>
+#include <vector>
+
+#include "sjpegi.h"
+
+namespace sjpeg {
+
+namespace {
+
+// Pictures with at least this many pixels are split into bands.
+const size_t kMinBandedPixels = 1 << 20;
+
+// RecyclingMemory keeps at most kMaxCached blocks, and doesn't serve a
+// request with a block wasting more than its size plus kMinWaste bytes.
+const size_t kMaxCached = 32;
+const size_t kMinWaste = 4096;
+
+// Hands out one RecyclingMemory per running job. The last one released is
+// the first one reused: it's usually the one the calling thread just used.
+class RecyclingPool {
+ public:
+  explicit RecyclingPool(MemoryManager* const base) : base_(base) {}
+  // Returns null in case of allocation failure.
+  RecyclingMemory* Get() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!idle_.empty()) {
+      RecyclingMemory* const memory = idle_.back();
+      idle_.pop_back();
+      return memory;
+    }
+    RecyclingMemory* const memory = new (std::nothrow) RecyclingMemory(base_);
+    if (memory != nullptr) all_.emplace_back(memory);
+    return memory;
+  }
+  void Release(RecyclingMemory* const memory) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_.push_back(memory);
+  }
+
+ private:
+  MemoryManager* const base_;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<RecyclingMemory>> all_;
+  std::vector<RecyclingMemory*> idle_;
+};
+
+bool EncodeJobPixels(const EncodeJob& job, const EncoderParam& param) {
+  switch (job.format) {
+    case EncodeJob::RGB:
+      return Encode(job.pixels, job.width, job.height, job.stride,
+                    param, job.sink);
+    case EncodeJob::BGRA:
+      return EncodeBGRA(job.pixels, job.width, job.height, job.stride,
+                        param, job.sink);
+    case EncodeJob::RGBA:
+      return EncodeRGBA(job.pixels, job.width, job.height, job.stride,
+                        param, job.sink);
+    case EncodeJob::GRAY:
+      return EncodeGray(job.pixels, job.width, job.height, job.stride,
+                        param, job.sink);
+  }
+  return false;
+}
+
+size_t NumPixels(const EncodeJob& job) {
+  return (job.width > 0 && job.height > 0) ? (size_t)job.width * job.height
+                                           : 0;
+}
+
+}   // namespace
+
+RecyclingMemory::~RecyclingMemory() {
+  for (Block* const block : free_) base_->Free(block);
+}
+
+void* RecyclingMemory::Alloc(size_t size) {
+  // best fit among the cached blocks, unless too wasteful
+  size_t best = free_.size();
+  for (size_t i = 0; i < free_.size(); ++i) {
+    const size_t capacity = free_[i]->capacity;
+    if (capacity >= size && capacity <= 2 * size + kMinWaste &&
+        (best == free_.size() || capacity < free_[best]->capacity)) {
+      best = i;
+    }
+  }
+  Block* block;
+  if (best < free_.size()) {
+    block = free_[best];
+    free_[best] = free_.back();
+    free_.pop_back();
+  } else {
+    block = static_cast<Block*>(base_->Alloc(sizeof(Block) + size));
+    if (block == nullptr) return nullptr;
+    block->capacity = size;
+  }
+  return block + 1;
+}
+
+void RecyclingMemory::Free(void* const ptr) {
+  if (ptr == nullptr) return;
+  if (free_.size() >= kMaxCached) {   // drop the oldest
+    base_->Free(free_.front());
+    free_.erase(free_.begin());
+  }
+  free_.push_back(static_cast<Block*>(ptr) - 1);
+}
+
+bool EncodeBatch(const std::vector<EncodeJob>& jobs, int num_threads,
+                 Executor* executor, std::vector<bool>* const results) {
+  const int nb_jobs = static_cast<int>(jobs.size());
+  num_threads = (num_threads < 1) ? 1
+              : (num_threads > kMaxThreads) ? kMaxThreads
+              : num_threads;
+  std::shared_ptr<Executor> own_executor;
+  if (executor == nullptr && num_threads > 1) {
+    own_executor = MakeThreadPool(num_threads);
+    executor = own_executor.get();   // if null, jobs run serially
+  }
+
+  // Largest pictures first, so that the small ones fill the gaps at the end.
+  std::vector<int> order(nb_jobs);
+  for (int i = 0; i < nb_jobs; ++i) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&jobs](int a, int b) {
+    return NumPixels(jobs[a]) > NumPixels(jobs[b]);
+  });
+
+  RecyclingPool recycling(GetDefaultMemoryManager());
+  std::vector<char> oks(nb_jobs, false);   // not vector<bool>: shared writes
+  const std::function<void(int)> run = [&](int n) {
+    const int idx = order[n];
+    const EncodeJob& job = jobs[idx];
+    EncoderParam param = job.param;
+    if (param.executor == nullptr) param.executor = executor;
+    if (param.num_threads <= 1 && NumPixels(job) >= kMinBandedPixels) {
+      param.num_threads = num_threads;
+    }
+    RecyclingMemory* memory = nullptr;
+    if (param.memory == nullptr) {
+      memory = recycling.Get();
+      param.memory = memory;   // if still null, the default one is used
+    }
+    oks[idx] = EncodeJobPixels(job, param);
+    if (memory != nullptr) recycling.Release(memory);
+  };
+  if (executor != nullptr) {
+    executor->ParallelFor(0, nb_jobs, run);
+  } else {
+    for (int n = 0; n < nb_jobs; ++n) run(n);
+  }
+
+  bool ok = true;
+  for (int i = 0; i < nb_jobs; ++i) ok = ok && oks[i];
+  if (results != nullptr) results->assign(oks.begin(), oks.end());
+  return ok;
+}
+
+}   // namespace sjpeg
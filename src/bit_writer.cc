@@ -73,6 +73,88 @@ bool MemorySink::Commit(size_t used_size, size_t extra_size, uint8_t** data) {
   return true;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// ScratchSink
+
+ScratchSink::ScratchSink(MemoryManager* const memory)
+    : memory_(memory), buf_(nullptr), pos_(0), max_pos_(0) {}
+
+ScratchSink::~ScratchSink() { Reset(); }
+
+void ScratchSink::Reset() {
+  memory_->Free(buf_);
+  buf_ = nullptr;
+  pos_ = 0;
+  max_pos_ = 0;
+}
+
+bool ScratchSink::Commit(size_t used_size, size_t extra_size, uint8_t** data) {
+  pos_ += used_size;
+  assert(pos_ <= max_pos_);
+  size_t new_size = pos_ + extra_size;
+  if (new_size > max_pos_) {
+    new_size += 256;
+    if (new_size < 2 * max_pos_) {
+      new_size = 2 * max_pos_;
+    }
+    uint8_t* const new_buf =
+        static_cast<uint8_t*>(memory_->Realloc(buf_, pos_, new_size));
+    if (new_buf == nullptr) return false;
+    buf_ = new_buf;
+    max_pos_ = new_size;
+  }
+  *data = buf_ + pos_;
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CallbackSink
+
+CallbackSink::CallbackSink(
+    const std::function<bool(const uint8_t* data, size_t size)>& write)
+    : write_(write), buf_(nullptr), max_size_(0) {}
+
+CallbackSink::~CallbackSink() { Reset(); }
+
+void CallbackSink::Reset() {
+  delete[] buf_;
+  buf_ = nullptr;
+  max_size_ = 0;
+}
+
+bool CallbackSink::Commit(size_t used_size, size_t extra_size,
+                          uint8_t** data) {
+  assert(used_size <= max_size_);
+  if (used_size > 0 && !write_(buf_, used_size)) return false;
+  if (extra_size > max_size_) {   // the used bytes are gone: no copy
+    delete[] buf_;
+    buf_ = new (std::nothrow) uint8_t[extra_size];
+    max_size_ = (buf_ != nullptr) ? extra_size : 0;
+    if (buf_ == nullptr) return false;
+  }
+  *data = buf_;
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FixedBufferSink
+
+FixedBufferSink::FixedBufferSink(uint8_t* const buf, size_t capacity)
+    : buf_(buf), capacity_((buf != nullptr) ? capacity : 0), pos_(0) {}
+
+bool FixedBufferSink::Commit(size_t used_size, size_t extra_size,
+                             uint8_t** data) {
+  pos_ += used_size;
+  assert(pos_ <= capacity_);
+  if (extra_size > capacity_ - pos_) return false;
+  *data = buf_ + pos_;
+  return true;
+}
+
+size_t FixedBufferSink::MaxExtraSize(size_t used_size) const {
+  return capacity_ - std::min(capacity_, pos_ + used_size);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Sink factories
 
@@ -86,6 +168,11 @@ std::shared_ptr<ByteSink> MakeByteSink(std::vector<uint8_t>* const output) {
   return std::shared_ptr<ByteSink>(new (std::nothrow) VectorSink(output));
 }
 
+std::shared_ptr<ByteSink> MakeByteSink(
+    const std::function<bool(const uint8_t* data, size_t size)>& write) {
+  return std::shared_ptr<ByteSink>(new (std::nothrow) CallbackSink(write));
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // BitWriter
 
@@ -115,6 +202,49 @@ void BitWriter::Flush() {
   FlushBits();
 }
 
+bool BitWriter::CommitBytes() {
+  if (!ReserveMore(16, 16)) return false;   // FlushBits() needs some room
+  FlushBits();
+  return Reserve(0);
+}
+
+bool BitWriter::EndSegment(uint32_t* const bits, int* const nb_bits) {
+  if (!Reserve(16)) return false;   // enough for 7 escaped bytes
+  FlushBits();
+  assert(nb_bits_ < 8);
+  *nb_bits = nb_bits_;
+  *bits = nb_bits_ ? static_cast<uint32_t>(bits_ >> (8 * sizeof(bits_) -
+                                                     nb_bits_))
+                   : 0;
+  bits_ = 0;
+  nb_bits_ = 0;
+  return Finalize();
+}
+
+bool BitWriter::AppendSegment(const uint8_t* data, size_t size,
+                              uint32_t bits, int nb_bits) {
+  // Piece by piece, so that fixed-capacity sinks aren't asked for much more
+  // room than what is written. Worst case: every byte gets escaped.
+  const size_t kPieceSize = 4096;
+  size_t pos = 0;
+  do {
+    const size_t n = std::min(size - pos, kPieceSize);
+    if (!ReserveMore(2 * n + 16, 64 << 10)) return false;
+    FlushBits();
+    if (nb_bits_ == 0) {   // byte-aligned: the escapes don't change
+      if (n > 0) PutBytes(data + pos, n);
+      pos += n;
+    } else {
+      for (const size_t end = pos + n; pos < end; ++pos) {
+        PutBits(data[pos], 8);
+        if (data[pos] == 0xff) ++pos;   // skip the former escape
+      }
+    }
+  } while (pos < size);
+  if (nb_bits > 0) PutBits(bits, nb_bits);
+  return true;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
 #if !defined(SJPEG_HAVE_64BIT)
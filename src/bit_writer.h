@@ -23,6 +23,8 @@
 #include <stdint.h>
 #include <string.h>   // for memcpy
 
+#include <algorithm>
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -62,6 +64,45 @@ class MemorySink : public ByteSink {
   size_t pos_, max_pos_;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// Scratch-Sink: same growth as MemorySink, but the buffer comes from a
+// MemoryManager. Holds pieces of bitstream that are assembled later on.
+
+class ScratchSink : public ByteSink {
+ public:
+  explicit ScratchSink(MemoryManager* const memory);
+  ~ScratchSink() override;
+  bool Commit(size_t used_size, size_t extra_size, uint8_t** data) override;
+  bool Finalize() override { /* nothing to do */ return true; }
+  void Reset() override;
+  const uint8_t* data() const { return buf_; }
+  size_t size() const { return pos_; }
+
+ private:
+  MemoryManager* const memory_;
+  uint8_t* buf_;
+  size_t pos_, max_pos_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Callback-Sink: hands each committed piece of bitstream over to a function.
+// Only the buffer for the next piece is kept.
+
+class CallbackSink : public ByteSink {
+ public:
+  explicit CallbackSink(
+      const std::function<bool(const uint8_t* data, size_t size)>& write);
+  ~CallbackSink() override;
+  bool Commit(size_t used_size, size_t extra_size, uint8_t** data) override;
+  bool Finalize() override { /* nothing to do */ return true; }
+  void Reset() override;
+
+ private:
+  const std::function<bool(const uint8_t* data, size_t size)> write_;
+  uint8_t* buf_;
+  size_t max_size_;
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // Sink for generic container
 //   Container must supply .resize() and [], and be byte-based.
@@ -160,7 +201,9 @@ class BitWriter {
   bool ReserveMore(size_t size, size_t chunk) {
     assert(size <= chunk);
     if (byte_pos_ + size <= reserved_) return true;
-    return Reserve(chunk);
+    // fixed-capacity sinks may not have room for a whole chunk
+    const size_t max_size = sink_->MaxExtraSize(byte_pos_);
+    return Reserve((max_size < chunk) ? std::max(size, max_size) : chunk);
   }
 
 #if defined(SJPEG_HAVE_64BIT)
@@ -269,6 +312,22 @@ class BitWriter {
   // Write pending bits, and align bitstream with extra '1' bits.
   void Flush();
 
+  // Hands the whole bytes written so far over to the sink. Unlike Flush(),
+  // the bitstream isn't aligned: the bits left stay pending. Reserve() must
+  // be called again before writing. Returns false in case of error.
+  bool CommitBytes();
+
+  // Segments are pieces of bitstream coded separately, then appended to
+  // the main one at any bit position (no byte alignment, unlike Flush()).
+  // EndSegment() writes out the whole bytes of a segment, and returns the
+  // bits left (fewer than 8) in *bits / *nb_bits. The sink is finalized.
+  bool EndSegment(uint32_t* const bits, int* const nb_bits);
+  // Appends the 'size' bytes of a segment, escapes included, then its
+  // 'nb_bits' left-over bits. The 0xff escapes are redone to match the new
+  // bit position, so the result is that of a single writer.
+  bool AppendSegment(const uint8_t* data, size_t size,
+                     uint32_t bits, int nb_bits);
+
   // To be called last.
   bool Finalize() { return Reserve(0) && sink_->Finalize(); }
 
@@ -0,0 +1,137 @@
+// Copyright 2026 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//  Lossless compact storage of the unquantized coefficients
+//
+
+#include <stdint.h>
+
+#include "sjpegi.h"
+
+namespace sjpeg {
+
+namespace {
+
+// The values are zigzag-encoded (0, -1, 1, -2, 2...), so that small ones of
+// either sign need few bits.
+inline uint32_t Encode(int v) {
+  return static_cast<uint16_t>((v * 2) ^ (v >> 15));
+}
+inline int16_t Decode(uint32_t u) {
+  return static_cast<int16_t>((u >> 1) ^ (0u - (u & 1)));
+}
+
+inline int BitLength(uint32_t v) {   // for v < 1 << 16
+  int n = 0;
+  if (v >> 8) { n += 8; v >>= 8; }
+  if (v >> 4) { n += 4; v >>= 4; }
+  if (v >> 2) { n += 2; v >>= 2; }
+  if (v >> 1) { n += 1; v >>= 1; }
+  return n + v;
+}
+
+// Bit-width of a group, on 4 bits: 15 stands for 16.
+inline int WidthCode(uint32_t max) {
+  const int w = BitLength(max);
+  return (w > 14) ? 15 : w;
+}
+inline int Width(int code) { return (code == 15) ? 16 : code; }
+
+// little-endian
+inline uint64_t Load64(const uint8_t* const src) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; ++i) v |= static_cast<uint64_t>(src[i]) << (8 * i);
+  return v;
+}
+inline void Store64(uint64_t v, uint8_t* const dst) {
+  for (int i = 0; i < 8; ++i) dst[i] = static_cast<uint8_t>(v >> (8 * i));
+}
+
+}   // namespace
+
+// A group of width w <= 8 is one little-endian word of 8 * w bits, the value
+// #i at bit i * w. A wider one starts with the 8 low bytes of its values,
+// followed by their high bits, packed the same way on w - 8 bits.
+
+size_t PackCoeffs(const int16_t* in, int num_blocks, uint8_t* dst) {
+  uint8_t* const start = dst;
+  for (int n = 0; n < num_blocks; ++n, in += 64) {
+    uint8_t* const codes = dst;
+    dst += 4;
+    for (int g = 0; g < 8; ++g) {
+      const uint8_t* const zigzag = kZigzag + 8 * g;
+      uint32_t u[8];
+      uint32_t max = 0;
+      for (int i = 0; i < 8; ++i) {
+        u[i] = Encode(in[zigzag[i]]);
+        max |= u[i];
+      }
+      const int code = WidthCode(max);
+      const int w = Width(code);
+      if (g & 1) {
+        codes[g >> 1] |= code << 4;
+      } else {
+        codes[g >> 1] = code;
+      }
+      uint64_t bits = 0;
+      if (w <= 8) {
+        for (int i = 0; i < 8; ++i) {
+          bits |= static_cast<uint64_t>(u[i]) << (i * w);
+        }
+        Store64(bits, dst);
+      } else {
+        const int h = w - 8;
+        for (int i = 0; i < 8; ++i) {
+          dst[i] = u[i] & 0xff;
+          bits |= static_cast<uint64_t>(u[i] >> 8) << (i * h);
+        }
+        Store64(bits, dst + 8);
+      }
+      dst += w;
+    }
+  }
+  return dst - start;
+}
+
+const uint8_t* UnpackCoeffs(const uint8_t* src, int num_blocks,
+                            int16_t* out) {
+  for (int n = 0; n < num_blocks; ++n, out += 64) {
+    const uint8_t* const codes = src;
+    src += 4;
+    for (int g = 0; g < 8; ++g) {
+      const uint8_t* const zigzag = kZigzag + 8 * g;
+      const int w = Width((codes[g >> 1] >> (4 * (g & 1))) & 0x0f);
+      if (w <= 8) {
+        const uint64_t bits = Load64(src);
+        const uint32_t mask = (1u << w) - 1;
+        for (int i = 0; i < 8; ++i) {
+          const uint32_t u = static_cast<uint32_t>(bits >> (i * w)) & mask;
+          out[zigzag[i]] = Decode(u);
+        }
+      } else {
+        const int h = w - 8;
+        const uint64_t bits = Load64(src + 8);
+        const uint32_t mask = (1u << h) - 1;
+        for (int i = 0; i < 8; ++i) {
+          const uint32_t high = static_cast<uint32_t>(bits >> (i * h)) & mask;
+          out[zigzag[i]] = Decode(src[i] | (high << 8));
+        }
+      }
+      src += w;
+    }
+  }
+  return src;
+}
+
+}   // namespace sjpeg
@@ -24,20 +24,12 @@
 
 #define SJPEG_NEED_ASM_HEADERS
 #include "sjpegi.h"
+#include "colors_rgb_sse2.h"
 
 namespace sjpeg {
 
-// global fixed-point precision
-enum { FRAC = 16, HALF = 1 << FRAC >> 1,
-       ROUND_UV = (HALF << 2), ROUND_Y = HALF - (128 << FRAC) };
-
 #if defined(SJPEG_USE_SSE2)
 
-// Load eight 16b-words from *src.
-#define LOAD_16(src) _mm_loadu_si128(reinterpret_cast<const __m128i*>(src))
-// Store eight 16b-words into *dst
-#define STORE_16(V, dst) _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), (V))
-
 // Convert 8 packed RGB samples to r[], g[], b[]
 static inline void RGB24PackedToPlanar(const uint8_t* const rgb,
                                        __m128i* const r,
@@ -80,212 +72,6 @@ static inline void RGB24PackedToPlanar(const uint8_t* const rgb,
   *g = F2;
 }
 
-// This macro computes (RG * MULT_RG + GB * MULT_GB + ROUNDER) >> DESCALE_FIX
-// It's a macro and not a function because we need to use immediate values with
-// srai_epi32, e.g.
-#define TRANSFORM(RG_LO, RG_HI, GB_LO, GB_HI, MULT_RG, MULT_GB, \
-                  ROUNDER, DESCALE_FIX, ADD_OR_SUB, OUT) do {   \
-  const __m128i V0_lo = _mm_madd_epi16(RG_LO, MULT_RG);         \
-  const __m128i V0_hi = _mm_madd_epi16(RG_HI, MULT_RG);         \
-  const __m128i V1_lo = _mm_madd_epi16(GB_LO, MULT_GB);         \
-  const __m128i V1_hi = _mm_madd_epi16(GB_HI, MULT_GB);         \
-  const __m128i V2_lo = ADD_OR_SUB(V0_lo, V1_lo);               \
-  const __m128i V2_hi = ADD_OR_SUB(V0_hi, V1_hi);               \
-  const __m128i V3_lo = _mm_add_epi32(V2_lo, ROUNDER);          \
-  const __m128i V3_hi = _mm_add_epi32(V2_hi, ROUNDER);          \
-  const __m128i V5_lo = _mm_srai_epi32(V3_lo, DESCALE_FIX);     \
-  const __m128i V5_hi = _mm_srai_epi32(V3_hi, DESCALE_FIX);     \
-  (OUT) = _mm_packs_epi32(V5_lo, V5_hi);                        \
-} while (0)
-
-#define MK_CST_16(A, B) _mm_set_epi16((B), (A), (B), (A), (B), (A), (B), (A))
-
-inline void ConvertRGBToY(const __m128i* const R,
-                          const __m128i* const G,
-                          const __m128i* const B,
-                          int offset,
-                          __m128i* const Y) {
-  const __m128i kRG_y = MK_CST_16(19595, 38469 - 16384);
-  const __m128i kGB_y = MK_CST_16(16384, 7471);
-  const __m128i kROUND_Y = _mm_set1_epi32(HALF + (offset << FRAC));
-  const __m128i RG_lo = _mm_unpacklo_epi16(*R, *G);
-  const __m128i RG_hi = _mm_unpackhi_epi16(*R, *G);
-  const __m128i GB_lo = _mm_unpacklo_epi16(*G, *B);
-  const __m128i GB_hi = _mm_unpackhi_epi16(*G, *B);
-  TRANSFORM(RG_lo, RG_hi, GB_lo, GB_hi, kRG_y, kGB_y, kROUND_Y, FRAC,
-            _mm_add_epi32, *Y);
-}
-
-inline void ConvertRGBToUV(const __m128i* const R,
-                           const __m128i* const G,
-                           const __m128i* const B,
-                           int offset,
-                           __m128i* const U, __m128i* const V) {
-  // Warning! 32768 is overflowing int16, so we're actually multiplying
-  // by -32768 instead of 32768. We compensate by subtracting the result
-  // instead of adding, thus restoring the sign.
-  const __m128i kRG_u = MK_CST_16(-11059, -21709);
-  const __m128i kGB_u = MK_CST_16(0, -32768);
-  const __m128i kRG_v = MK_CST_16(-32768, 0);
-  const __m128i kGB_v = MK_CST_16(-27439, -5329);
-  const __m128i kRound = _mm_set1_epi32((offset << FRAC) + HALF);
-
-  const __m128i RG_lo = _mm_unpacklo_epi16(*R, *G);
-  const __m128i RG_hi = _mm_unpackhi_epi16(*R, *G);
-  const __m128i GB_lo = _mm_unpacklo_epi16(*G, *B);
-  const __m128i GB_hi = _mm_unpackhi_epi16(*G, *B);
-
-  // _mm_sub_epi32 -> sign restore!
-  TRANSFORM(RG_lo, RG_hi, GB_lo, GB_hi, kRG_u, kGB_u, kRound, FRAC,
-            _mm_sub_epi32, *U);
-  // note! GB and RG are inverted, for sign-restoration
-  TRANSFORM(GB_lo, GB_hi, RG_lo, RG_hi, kGB_v, kRG_v, kRound, FRAC,
-            _mm_sub_epi32, *V);
-}
-
-// This version takes four accumulated R/G/B samples. Hence, the
-// descaling factor is FRAC + 2.
-inline void ConvertRGBToUVAccumulated(const __m128i* const R,
-                                      const __m128i* const G,
-                                      const __m128i* const B,
-                                      __m128i* const U, __m128i* const V) {
-  // Warning! 32768 is overflowing int16, so we're actually multiplying
-  // by -32768 instead of 32768. We compensate by subtracting the result
-  // instead of adding, thus restoring the sign.
-  const __m128i kRG_u = MK_CST_16(-11059, -21709);
-  const __m128i kGB_u = MK_CST_16(0, -32768);
-  const __m128i kRG_v = MK_CST_16(-32768, 0);
-  const __m128i kGB_v = MK_CST_16(-27439, -5329);
-  const __m128i kRound = _mm_set1_epi32(ROUND_UV);
-
-  const __m128i RG_lo = _mm_unpacklo_epi16(*R, *G);
-  const __m128i RG_hi = _mm_unpackhi_epi16(*R, *G);
-  const __m128i GB_lo = _mm_unpacklo_epi16(*G, *B);
-  const __m128i GB_hi = _mm_unpackhi_epi16(*G, *B);
-
-  // _mm_sub_epi32 -> sign restore!
-  TRANSFORM(RG_lo, RG_hi, GB_lo, GB_hi, kRG_u, kGB_u,
-            kRound, FRAC + 2, _mm_sub_epi32, *U);
-  // note! GB and RG are inverted, for sign-restoration
-  TRANSFORM(GB_lo, GB_hi, RG_lo, RG_hi, kGB_v, kRG_v,
-            kRound, FRAC + 2, _mm_sub_epi32, *V);
-}
-
-#undef MK_CST_16
-#undef TRANSFORM
-
-// Convert 8 RGB samples to YUV. out[] points to a 3*64 data block.
-static inline void ToYUV_8(const __m128i* const r,
-                           const __m128i* const g,
-                           const __m128i* const b,
-                           int16_t* const out) {
-  __m128i Y, U, V;
-  ConvertRGBToY(r, g, b, -128, &Y);
-  ConvertRGBToUV(r, g, b, 0, &U, &V);
-  STORE_16(Y, out + 0 * 64);
-  STORE_16(U, out + 1 * 64);
-  STORE_16(V, out + 2 * 64);
-}
-
-static void Get8x8Block_SSE2(const uint8_t* data, int step, int16_t* out) {
-  for (int y = 8; y > 0; --y) {
-    __m128i r, g, b;
-    RGB24PackedToPlanar(data, &r, &g, &b);
-    ToYUV_8(&r, &g, &b, out);
-    out += 8;
-    data += step;
-  }
-}
-
-// Convert 8 RGB samples to Y only. out[] points to a 1*64 data block.
-static inline void ToY_8(const __m128i* const r,
-                         const __m128i* const g,
-                         const __m128i* const b,
-                         int16_t* const out) {
-  __m128i Y;
-  ConvertRGBToY(r, g, b, -128, &Y);
-  STORE_16(Y, out);
-}
-
-static void Get8x8Block_Y_SSE2(const uint8_t* data, int step, int16_t* out) {
-  for (int y = 8; y > 0; --y) {
-    __m128i r, g, b;
-    RGB24PackedToPlanar(data, &r, &g, &b);
-    ToY_8(&r, &g, &b, out);
-    out += 8;
-    data += step;
-  }
-}
-
-// Convert 16x16 RGB samples to YUV420
-static inline void ToY_16x16(const __m128i* const r,
-                             const __m128i* const g,
-                             const __m128i* const b,
-                             int16_t* const y_out,
-                             __m128i* const R_acc,
-                             __m128i* const G_acc,
-                             __m128i* const B_acc,
-                             bool do_add) {
-  __m128i Y;
-  ConvertRGBToY(r, g, b, -128, &Y);
-  STORE_16(Y, y_out);
-  if (do_add) {
-    *R_acc = _mm_add_epi16(*R_acc, *r);
-    *G_acc = _mm_add_epi16(*G_acc, *g);
-    *B_acc = _mm_add_epi16(*B_acc, *b);
-  } else {  // just store
-    *R_acc = *r;
-    *G_acc = *g;
-    *B_acc = *b;
-  }
-}
-
-static inline void ToUV_8x8(const __m128i* const R,
-                            const __m128i* const G,
-                            const __m128i* const B,
-                            int16_t* const uv_out) {
-  __m128i U, V;
-  ConvertRGBToUVAccumulated(R, G, B, &U, &V);
-  STORE_16(U, uv_out + 0 * 64);
-  STORE_16(V, uv_out + 1 * 64);
-}
-
-static void Condense16To8(const __m128i* const acc1, __m128i* const acc2) {
-  const __m128i one = _mm_set1_epi16(1);
-  const __m128i tmp1 = _mm_madd_epi16(*acc1, one);
-  const __m128i tmp2 = _mm_madd_epi16(*acc2, one);
-  *acc2 = _mm_packs_epi32(tmp1, tmp2);
-}
-
-// convert two 16x8 RGB blocks into two blocks of luma, and 2 blocks of U/V
-static void Get16x8_SSE2(const uint8_t* src1, int src_stride,
-                         int16_t y[4 * 64], int16_t uv[2 * 64]) {
-  for (int i = 4; i > 0; --i, src1 += 2 * src_stride) {
-    __m128i r_acc1, r_acc2, g_acc1, g_acc2, b_acc1, b_acc2;
-    __m128i r, g, b;
-    const uint8_t* const src2 = src1 + src_stride;
-    RGB24PackedToPlanar(src1 + 0 * 8, &r, &g, &b);
-    ToY_16x16(&r, &g, &b, y + 0 * 64 + 0, &r_acc1, &g_acc1, &b_acc1, false);
-    RGB24PackedToPlanar(src1 + 3 * 8, &r, &g, &b);
-    ToY_16x16(&r, &g, &b, y + 1 * 64 + 0, &r_acc2, &g_acc2, &b_acc2, false);
-    RGB24PackedToPlanar(src2 + 0 * 8, &r, &g, &b);
-    ToY_16x16(&r, &g, &b, y + 0 * 64 + 8, &r_acc1, &g_acc1, &b_acc1, true);
-    RGB24PackedToPlanar(src2 + 3 * 8, &r, &g, &b);
-    ToY_16x16(&r, &g, &b, y + 1 * 64 + 8, &r_acc2, &g_acc2, &b_acc2, true);
-    Condense16To8(&r_acc1, &r_acc2);
-    Condense16To8(&g_acc1, &g_acc2);
-    Condense16To8(&b_acc1, &b_acc2);
-    ToUV_8x8(&r_acc2, &g_acc2, &b_acc2, uv);
-    y += 2 * 8;
-    uv += 8;
-  }
-}
-
-static void Get16x16Block_SSE2(const uint8_t* data, int step, int16_t* blocks) {
-  Get16x8_SSE2(data + 0 * step, step, blocks + 0 * 64, blocks + 4 * 64 + 0 * 8);
-  Get16x8_SSE2(data + 8 * step, step, blocks + 2 * 64, blocks + 4 * 64 + 4 * 8);
-}
-
 // Convert 8 packed BGRA samples to r[], g[], b[] (alpha dropped, R/B swapped).
 // Produces exactly the same r/g/b registers as RGB24PackedToPlanar for the same
 // pixels, so all downstream YUV math is bit-identical.
@@ -1027,6 +813,9 @@ static void Get16x16Block_RGBA_C(const uint8_t* rgb, int step, int16_t* yuv) {
 ////////////////////////////////////////////////////////////////////////////////
 
 RGBToYUVBlockFunc GetBlockFunc(SjpegYUVMode yuv_mode, PixelFormat fmt) {
+#if defined(SJPEG_USE_AVX2)
+  if (SupportsAVX2()) return GetBlockFuncAVX2(yuv_mode, fmt);
+#endif
   if (fmt == kBGRAInput) {
 #if defined(SJPEG_USE_SSE2)
     if (SupportsSSE2())
@@ -1060,9 +849,14 @@ RGBToYUVBlockFunc GetBlockFunc(SjpegYUVMode yuv_mode, PixelFormat fmt) {
                                          : Get8x8Block_Y_RGBA_C;
   }
 #if defined(SJPEG_USE_SSE2)
-  if (SupportsSSE2()) return (yuv_mode == SJPEG_YUV_444) ? Get8x8Block_SSE2 :
-                             (yuv_mode == SJPEG_YUV_420) ? Get16x16Block_SSE2 :
-                                                           Get8x8Block_Y_SSE2;
+#if defined(SJPEG_USE_SSSE3)
+  if (SupportsSSSE3()) return GetBlockFuncSSSE3(yuv_mode);
+#endif
+  if (SupportsSSE2()) {
+    return (yuv_mode == SJPEG_YUV_444) ? Get8x8Block_T<RGB24PackedToPlanar> :
+           (yuv_mode == SJPEG_YUV_420) ? Get16x16Block_T<RGB24PackedToPlanar> :
+                                         Get8x8Block_Y_T<RGB24PackedToPlanar>;
+  }
 #elif defined(SJPEG_USE_NEON)
   if (SupportsNEON()) return (yuv_mode == SJPEG_YUV_444) ? Get8x8Block_NEON :
                              (yuv_mode == SJPEG_YUV_420) ? Get16x16Block_NEON :
@@ -1123,37 +917,9 @@ void RowToIndexC(const uint8_t* rgb, int width, uint16_t* dst) {
 
 #if defined(SJPEG_USE_SSE2)
 void RowToIndexSSE2(const uint8_t* rgb, int width, uint16_t* dst) {
-  const __m128i zero = _mm_setzero_si128();
-  const __m128i mult = _mm_set1_epi16(0x0101u * (sjpeg::kRGBSize - 1));
-  const __m128i mult1 = _mm_set1_epi16(sjpeg::kRGBSize);
-  const __m128i mult2 = _mm_set1_epi16(sjpeg::kRGBSize * sjpeg::kRGBSize);
-  const __m128i k255 = _mm_set1_epi16(255);
-  while (width >= 8) {
-    __m128i r, g, b;
-    __m128i Y, U, V;
-    RGB24PackedToPlanar(rgb, &r, &g, &b);
-    ConvertRGBToY(&r, &g, &b, 0, &Y);
-    ConvertRGBToUV(&r, &g, &b, 128, &U, &V);
-    // clamping to [0, 255]
-    const __m128i y1 = _mm_min_epi16(_mm_max_epi16(Y, zero), k255);
-    const __m128i u1 = _mm_min_epi16(_mm_max_epi16(U, zero), k255);
-    const __m128i v1 = _mm_min_epi16(_mm_max_epi16(V, zero), k255);
-    // convert to idx
-    const __m128i y2 = _mm_mulhi_epi16(y1, mult);
-    const __m128i u2 = _mm_mulhi_epi16(u1, mult);
-    const __m128i v2 = _mm_mulhi_epi16(v1, mult);
-    // store final idx
-    const __m128i u3 = _mm_mullo_epi16(u2, mult1);
-    const __m128i v3 = _mm_mullo_epi16(v2, mult2);
-    const __m128i tmp = _mm_add_epi16(y2, u3);
-    const __m128i idx = _mm_add_epi16(tmp, v3);
-    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), idx);
-
-    rgb += 3 * 8;
-    dst += 8;
-    width -= 8;
-  }
-  if (width > 0) RowToIndexC(rgb, width, dst);
+  const int left = RowToIndex_T<RGB24PackedToPlanar>(rgb, width, dst);
+  const int done = width - left;
+  if (left > 0) RowToIndexC(rgb + 3 * done, left, dst + done);
 }
 #elif defined(SJPEG_USE_NEON)
 void RowToIndexNEON(const uint8_t* rgb, int width, uint16_t* dst) {
@@ -1199,6 +965,9 @@ void RowToIndexNEON(const uint8_t* rgb, int width, uint16_t* dst) {
 
 RGBToIndexRowFunc GetRowFunc() {
 #if defined(SJPEG_USE_SSE2)
+#if defined(SJPEG_USE_SSSE3)
+  if (SupportsSSSE3()) return RowToIndexSSSE3;
+#endif
   if (SupportsSSE2()) return RowToIndexSSE2;
 #elif defined(SJPEG_USE_NEON)
   if (SupportsNEON()) return RowToIndexNEON;
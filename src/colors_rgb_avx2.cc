@@ -0,0 +1,279 @@
+// Copyright 2026 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//  RGB -> YUV conversion, AVX2 version
+//
+// Each register holds 16 samples: two rows of 8 pixels for the 8x8 blocks,
+// or a full 16-pixel row for the 4:2:0 macroblocks. The arithmetic is the
+// one of colors_rgb.cc, done per 128bit lane, so that the output is the same.
+
+#include <stdint.h>
+
+#define SJPEG_NEED_ASM_HEADERS
+#include "sjpegi.h"
+
+namespace sjpeg {
+
+#if defined(SJPEG_USE_AVX2)
+
+namespace {
+
+// global fixed-point precision, see colors_rgb.cc
+enum { FRAC = 16, HALF = 1 << FRAC >> 1, ROUND_UV = (HALF << 2) };
+
+#define LOAD_16(src) _mm_loadu_si128(reinterpret_cast<const __m128i*>(src))
+#define STORE_32(V, dst) \
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), (V))
+
+// Loads the 16 bytes at src0 in the low lane, and the ones at src1 in the
+// high lane.
+inline __m256i Load2x16(const uint8_t* const src0,
+                        const uint8_t* const src1) {
+  return _mm256_inserti128_si256(_mm256_castsi128_si256(LOAD_16(src0)),
+                                 LOAD_16(src1), 1);
+}
+
+// Mask for _mm256_shuffle_epi8(), for a register holding the bytes #base..
+// of each lane. Bytes #i + k * step (k = 0..7) go in the low byte of the
+// 16b word #k if they are within [first, last]. Other words are zeroed.
+#define SHUFFLE(i, step, first, last, base) _mm256_setr_epi8(              \
+    SEL((i) + 0 * (step), first, last, base), -128,                        \
+    SEL((i) + 1 * (step), first, last, base), -128,                        \
+    SEL((i) + 2 * (step), first, last, base), -128,                        \
+    SEL((i) + 3 * (step), first, last, base), -128,                        \
+    SEL((i) + 4 * (step), first, last, base), -128,                        \
+    SEL((i) + 5 * (step), first, last, base), -128,                        \
+    SEL((i) + 6 * (step), first, last, base), -128,                        \
+    SEL((i) + 7 * (step), first, last, base), -128,                        \
+    SEL((i) + 0 * (step), first, last, base), -128,                        \
+    SEL((i) + 1 * (step), first, last, base), -128,                        \
+    SEL((i) + 2 * (step), first, last, base), -128,                        \
+    SEL((i) + 3 * (step), first, last, base), -128,                        \
+    SEL((i) + 4 * (step), first, last, base), -128,                        \
+    SEL((i) + 5 * (step), first, last, base), -128,                        \
+    SEL((i) + 6 * (step), first, last, base), -128,                        \
+    SEL((i) + 7 * (step), first, last, base), -128)
+#define SEL(k, first, last, base) static_cast<char>(                       \
+    ((k) >= (first) && (k) <= (last)) ? (k) - (base) : -128)
+
+// Convert 8 packed RGB samples at src0 and 8 at src1 to r[], g[], b[] (the
+// first ones in the low lane). Each lane is assembled from two overlapping
+// loads: bytes 0..15 and bytes 8..23 of the 24 that make 8 pixels.
+inline void RGB24PackedToPlanar(const uint8_t* const src0,
+                                const uint8_t* const src1,
+                                __m256i* const r, __m256i* const g,
+                                __m256i* const b) {
+  const __m256i A = Load2x16(src0 + 0, src1 + 0);
+  const __m256i B = Load2x16(src0 + 8, src1 + 8);
+  *r = _mm256_or_si256(_mm256_shuffle_epi8(A, SHUFFLE(0, 3, 0, 15, 0)),
+                       _mm256_shuffle_epi8(B, SHUFFLE(0, 3, 16, 23, 8)));
+  *g = _mm256_or_si256(_mm256_shuffle_epi8(A, SHUFFLE(1, 3, 0, 15, 0)),
+                       _mm256_shuffle_epi8(B, SHUFFLE(1, 3, 16, 23, 8)));
+  *b = _mm256_or_si256(_mm256_shuffle_epi8(A, SHUFFLE(2, 3, 0, 15, 0)),
+                       _mm256_shuffle_epi8(B, SHUFFLE(2, 3, 16, 23, 8)));
+}
+
+// Same for 8 packed RGBA or BGRA samples: 'R' is the offset of the red
+// byte within a pixel (0 or 2), blue is at 2 - R, and alpha is dropped.
+template<int R>
+inline void RGB32PackedToPlanar(const uint8_t* const src0,
+                                const uint8_t* const src1,
+                                __m256i* const r, __m256i* const g,
+                                __m256i* const b) {
+  const __m256i A = Load2x16(src0 + 0, src1 + 0);
+  const __m256i B = Load2x16(src0 + 16, src1 + 16);
+  *r = _mm256_or_si256(_mm256_shuffle_epi8(A, SHUFFLE(R, 4, 0, 15, 0)),
+                       _mm256_shuffle_epi8(B, SHUFFLE(R, 4, 16, 31, 16)));
+  *g = _mm256_or_si256(_mm256_shuffle_epi8(A, SHUFFLE(1, 4, 0, 15, 0)),
+                       _mm256_shuffle_epi8(B, SHUFFLE(1, 4, 16, 31, 16)));
+  *b = _mm256_or_si256(_mm256_shuffle_epi8(A, SHUFFLE(2 - R, 4, 0, 15, 0)),
+                       _mm256_shuffle_epi8(B, SHUFFLE(2 - R, 4, 16, 31, 16)));
+}
+
+#undef SEL
+#undef SHUFFLE
+
+template<PixelFormat FMT>
+inline void PackedToPlanar(const uint8_t* const src0,
+                           const uint8_t* const src1,
+                           __m256i* const r, __m256i* const g,
+                           __m256i* const b) {
+  if (FMT == kRGBInput) {
+    RGB24PackedToPlanar(src0, src1, r, g, b);
+  } else {
+    RGB32PackedToPlanar<(FMT == kBGRAInput) ? 2 : 0>(src0, src1, r, g, b);
+  }
+}
+
+// This macro computes (RG * MULT_RG + GB * MULT_GB + ROUNDER) >> DESCALE_FIX
+#define TRANSFORM(RG_LO, RG_HI, GB_LO, GB_HI, MULT_RG, MULT_GB,   \
+                  ROUNDER, DESCALE_FIX, ADD_OR_SUB, OUT) do {     \
+  const __m256i V0_lo = _mm256_madd_epi16(RG_LO, MULT_RG);        \
+  const __m256i V0_hi = _mm256_madd_epi16(RG_HI, MULT_RG);        \
+  const __m256i V1_lo = _mm256_madd_epi16(GB_LO, MULT_GB);        \
+  const __m256i V1_hi = _mm256_madd_epi16(GB_HI, MULT_GB);        \
+  const __m256i V2_lo = ADD_OR_SUB(V0_lo, V1_lo);                 \
+  const __m256i V2_hi = ADD_OR_SUB(V0_hi, V1_hi);                 \
+  const __m256i V3_lo = _mm256_add_epi32(V2_lo, ROUNDER);         \
+  const __m256i V3_hi = _mm256_add_epi32(V2_hi, ROUNDER);         \
+  const __m256i V5_lo = _mm256_srai_epi32(V3_lo, DESCALE_FIX);    \
+  const __m256i V5_hi = _mm256_srai_epi32(V3_hi, DESCALE_FIX);    \
+  (OUT) = _mm256_packs_epi32(V5_lo, V5_hi);                       \
+} while (0)
+
+#define MK_CST_16(A, B) _mm256_set1_epi32(static_cast<int>(    \
+    (static_cast<uint32_t>(B) << 16) | static_cast<uint16_t>(A)))
+
+inline __m256i ConvertRGBToY(const __m256i R, const __m256i G,
+                             const __m256i B) {
+  const __m256i kRG_y = MK_CST_16(19595, 38469 - 16384);
+  const __m256i kGB_y = MK_CST_16(16384, 7471);
+  const __m256i kROUND_Y = _mm256_set1_epi32(HALF - (128 << FRAC));
+  const __m256i RG_lo = _mm256_unpacklo_epi16(R, G);
+  const __m256i RG_hi = _mm256_unpackhi_epi16(R, G);
+  const __m256i GB_lo = _mm256_unpacklo_epi16(G, B);
+  const __m256i GB_hi = _mm256_unpackhi_epi16(G, B);
+  __m256i Y;
+  TRANSFORM(RG_lo, RG_hi, GB_lo, GB_hi, kRG_y, kGB_y, kROUND_Y, FRAC,
+            _mm256_add_epi32, Y);
+  return Y;
+}
+
+// Warning! 32768 is overflowing int16, so we're actually multiplying
+// by -32768 instead of 32768. We compensate by subtracting the result
+// instead of adding, thus restoring the sign.
+// 'SHIFT' is 0 for plain samples, 2 for the sums of four.
+template<int SHIFT>
+inline void ConvertRGBToUV(const __m256i R, const __m256i G, const __m256i B,
+                           __m256i* const U, __m256i* const V) {
+  const __m256i kRG_u = MK_CST_16(-11059, -21709);
+  const __m256i kGB_u = MK_CST_16(0, -32768);
+  const __m256i kRG_v = MK_CST_16(-32768, 0);
+  const __m256i kGB_v = MK_CST_16(-27439, -5329);
+  const __m256i kRound = _mm256_set1_epi32(SHIFT ? ROUND_UV : HALF);
+
+  const __m256i RG_lo = _mm256_unpacklo_epi16(R, G);
+  const __m256i RG_hi = _mm256_unpackhi_epi16(R, G);
+  const __m256i GB_lo = _mm256_unpacklo_epi16(G, B);
+  const __m256i GB_hi = _mm256_unpackhi_epi16(G, B);
+
+  // _mm256_sub_epi32 -> sign restore!
+  TRANSFORM(RG_lo, RG_hi, GB_lo, GB_hi, kRG_u, kGB_u, kRound, FRAC + SHIFT,
+            _mm256_sub_epi32, *U);
+  // note! GB and RG are inverted, for sign-restoration
+  TRANSFORM(GB_lo, GB_hi, RG_lo, RG_hi, kGB_v, kRG_v, kRound, FRAC + SHIFT,
+            _mm256_sub_epi32, *V);
+}
+
+#undef MK_CST_16
+#undef TRANSFORM
+
+////////////////////////////////////////////////////////////////////////////////
+// 8x8 blocks, two rows at a time
+
+template<PixelFormat FMT>
+void Get8x8Block_AVX2(const uint8_t* data, int step, int16_t* out) {
+  for (int y = 0; y < 8; y += 2) {
+    __m256i r, g, b, U, V;
+    PackedToPlanar<FMT>(data, data + step, &r, &g, &b);
+    ConvertRGBToUV<0>(r, g, b, &U, &V);
+    STORE_32(ConvertRGBToY(r, g, b), out + 0 * 64);
+    STORE_32(U, out + 1 * 64);
+    STORE_32(V, out + 2 * 64);
+    out += 2 * 8;
+    data += 2 * step;
+  }
+}
+
+template<PixelFormat FMT>
+void Get8x8Block_Y_AVX2(const uint8_t* data, int step, int16_t* out) {
+  for (int y = 0; y < 8; y += 2) {
+    __m256i r, g, b;
+    PackedToPlanar<FMT>(data, data + step, &r, &g, &b);
+    STORE_32(ConvertRGBToY(r, g, b), out);
+    out += 2 * 8;
+    data += 2 * step;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// 16x16 macroblocks, in 4:2:0, one 16-pixel row at a time
+
+// Converts two rows to luma, the left half going to y[] and the right one
+// to y[64]. Returns the sums of their 2x2 samples, as 32b words: four for
+// the left half in the low lane, four for the right one in the high lane.
+template<PixelFormat FMT>
+inline void ToY_16x2(const uint8_t* const src, int step, int16_t* const y,
+                     __m256i* const r_sum, __m256i* const g_sum,
+                     __m256i* const b_sum) {
+  const int bpp = (FMT == kRGBInput) ? 3 : 4;
+  __m256i r0, g0, b0, r1, g1, b1;
+  PackedToPlanar<FMT>(src, src + 8 * bpp, &r0, &g0, &b0);
+  PackedToPlanar<FMT>(src + step, src + step + 8 * bpp, &r1, &g1, &b1);
+  const __m256i Y0 = ConvertRGBToY(r0, g0, b0);
+  const __m256i Y1 = ConvertRGBToY(r1, g1, b1);
+  STORE_32(_mm256_permute2x128_si256(Y0, Y1, 0x20), y + 0 * 64);
+  STORE_32(_mm256_permute2x128_si256(Y0, Y1, 0x31), y + 1 * 64);
+  const __m256i one = _mm256_set1_epi16(1);
+  *r_sum = _mm256_madd_epi16(_mm256_add_epi16(r0, r1), one);
+  *g_sum = _mm256_madd_epi16(_mm256_add_epi16(g0, g1), one);
+  *b_sum = _mm256_madd_epi16(_mm256_add_epi16(b0, b1), one);
+}
+
+// Packs the sums of two ToY_16x2() into two rows of 8, in order.
+inline __m256i Condense(const __m256i sum0, const __m256i sum1) {
+  return _mm256_permute4x64_epi64(_mm256_packs_epi32(sum0, sum1), 0xd8);
+}
+
+template<PixelFormat FMT>
+void Get16x16Block_AVX2(const uint8_t* data, int step, int16_t* blocks) {
+  int16_t* const uv = blocks + 4 * 64;
+  for (int j = 0; j < 16; j += 4) {
+    // four rows, for two rows of U/V
+    int16_t* const y = blocks + (j & 8) * 16 + (j & 7) * 8;
+    __m256i r0, g0, b0, r1, g1, b1, U, V;
+    ToY_16x2<FMT>(data + (j + 0) * step, step, y + 0 * 8, &r0, &g0, &b0);
+    ToY_16x2<FMT>(data + (j + 2) * step, step, y + 2 * 8, &r1, &g1, &b1);
+    ConvertRGBToUV<2>(Condense(r0, r1), Condense(g0, g1), Condense(b0, b1),
+                      &U, &V);
+    STORE_32(U, uv + 0 * 64 + (j / 2) * 8);
+    STORE_32(V, uv + 1 * 64 + (j / 2) * 8);
+  }
+}
+
+#undef LOAD_16
+#undef STORE_32
+
+}   // namespace
+
+RGBToYUVBlockFunc GetBlockFuncAVX2(SjpegYUVMode yuv_mode, PixelFormat fmt) {
+  switch (fmt) {
+    case kBGRAInput:
+      return (yuv_mode == SJPEG_YUV_444) ? Get8x8Block_AVX2<kBGRAInput> :
+             (yuv_mode == SJPEG_YUV_420) ? Get16x16Block_AVX2<kBGRAInput> :
+                                           Get8x8Block_Y_AVX2<kBGRAInput>;
+    case kRGBAInput:
+      return (yuv_mode == SJPEG_YUV_444) ? Get8x8Block_AVX2<kRGBAInput> :
+             (yuv_mode == SJPEG_YUV_420) ? Get16x16Block_AVX2<kRGBAInput> :
+                                           Get8x8Block_Y_AVX2<kRGBAInput>;
+    default:
+      return (yuv_mode == SJPEG_YUV_444) ? Get8x8Block_AVX2<kRGBInput> :
+             (yuv_mode == SJPEG_YUV_420) ? Get16x16Block_AVX2<kRGBInput> :
+                                           Get8x8Block_Y_AVX2<kRGBInput>;
+  }
+}
+
+#endif    // SJPEG_USE_AVX2
+
+}   // namespace sjpeg
@@ -0,0 +1,85 @@
+// Copyright 2026 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//  RGB -> YUV conversion, SSSE3 version
+//
+// Only the RGB24 deinterleaving changes: two _mm_shuffle_epi8() per plane
+// replace the unpack/shift sequence of the SSE2 version. The arithmetic is
+// the SSE2 one, hence the same output.
+
+#include <string.h>
+
+#define SJPEG_NEED_ASM_HEADERS
+#include "sjpegi.h"
+#include "colors_rgb_sse2.h"
+
+namespace sjpeg {
+
+#if defined(SJPEG_USE_SSSE3)
+
+// Mask for _mm_shuffle_epi8(), for a register holding the bytes #base.. of
+// the 24 that make 8 pixels. Bytes #i + 3 * k (k = 0..7) go in the low byte
+// of the 16b word #k if they are within [first, last]. Other words are zeroed.
+#define SHUFFLE(i, first, last, base) _mm_setr_epi8(                       \
+    SEL((i) + 0 * 3, first, last, base), -128,                             \
+    SEL((i) + 1 * 3, first, last, base), -128,                             \
+    SEL((i) + 2 * 3, first, last, base), -128,                             \
+    SEL((i) + 3 * 3, first, last, base), -128,                             \
+    SEL((i) + 4 * 3, first, last, base), -128,                             \
+    SEL((i) + 5 * 3, first, last, base), -128,                             \
+    SEL((i) + 6 * 3, first, last, base), -128,                             \
+    SEL((i) + 7 * 3, first, last, base), -128)
+#define SEL(k, first, last, base) static_cast<char>(                       \
+    ((k) >= (first) && (k) <= (last)) ? (k) - (base) : -128)
+
+// Convert 8 packed RGB samples to r[], g[], b[], from two overlapping loads:
+// bytes 0..15 and bytes 8..23.
+static inline void RGB24PackedToPlanar_SSSE3(const uint8_t* const rgb,
+                                             __m128i* const r,
+                                             __m128i* const g,
+                                             __m128i* const b) {
+  const __m128i A = LOAD_16(rgb + 0);
+  const __m128i B = LOAD_16(rgb + 8);
+  *r = _mm_or_si128(_mm_shuffle_epi8(A, SHUFFLE(0, 0, 15, 0)),
+                    _mm_shuffle_epi8(B, SHUFFLE(0, 16, 23, 8)));
+  *g = _mm_or_si128(_mm_shuffle_epi8(A, SHUFFLE(1, 0, 15, 0)),
+                    _mm_shuffle_epi8(B, SHUFFLE(1, 16, 23, 8)));
+  *b = _mm_or_si128(_mm_shuffle_epi8(A, SHUFFLE(2, 0, 15, 0)),
+                    _mm_shuffle_epi8(B, SHUFFLE(2, 16, 23, 8)));
+}
+
+#undef SEL
+#undef SHUFFLE
+
+RGBToYUVBlockFunc GetBlockFuncSSSE3(SjpegYUVMode mode) {
+  return (mode == SJPEG_YUV_444) ? Get8x8Block_T<RGB24PackedToPlanar_SSSE3> :
+         (mode == SJPEG_YUV_420) ? Get16x16Block_T<RGB24PackedToPlanar_SSSE3> :
+                                   Get8x8Block_Y_T<RGB24PackedToPlanar_SSSE3>;
+}
+
+void RowToIndexSSSE3(const uint8_t* rgb, int width, uint16_t* dst) {
+  const int left = RowToIndex_T<RGB24PackedToPlanar_SSSE3>(rgb, width, dst);
+  if (left > 0) {   // the last samples go through a zero-padded copy
+    const int done = width - left;
+    uint8_t tmp_rgb[3 * 8] = { 0 };
+    uint16_t tmp_dst[8];
+    memcpy(tmp_rgb, rgb + 3 * done, 3 * left);
+    RowToIndex_T<RGB24PackedToPlanar_SSSE3>(tmp_rgb, 8, tmp_dst);
+    memcpy(dst + done, tmp_dst, left * sizeof(*dst));
+  }
+}
+
+#endif    // SJPEG_USE_SSSE3
+
+}     // namespace sjpeg
@@ -0,0 +1,70 @@
+// Copyright 2026 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//  Encodings sharing their buffers and quantizers: EncoderContext
+//
+
+#include <stdint.h>
+
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include "sjpegi.h"
+
+namespace sjpeg {
+
+struct EncoderContext::Cache {
+  explicit Cache(MemoryManager* const base) : memory(base) {}
+  RecyclingMemory memory;
+  QuantizerCache quantizers;
+};
+
+EncoderContext::EncoderContext(MemoryManager* const memory)
+    : memory_((memory == nullptr) ? GetDefaultMemoryManager() : memory) {}
+
+EncoderContext::~EncoderContext() { delete cache_; }
+
+void EncoderContext::Clear() {
+  delete cache_;
+  cache_ = nullptr;
+}
+
+bool EncoderContext::Encode(const uint8_t* rgb, int width, int height,
+                            int stride, const EncoderParam& param,
+                            ByteSink* sink) {
+  if (rgb == nullptr || sink == nullptr) return false;
+  if (width <= 0 || height <= 0 || std::abs(stride) < 3 * width) return false;
+  if (cache_ == nullptr) {
+    cache_ = new (std::nothrow) Cache(memory_);
+    if (cache_ == nullptr) return false;
+  }
+  Encoder* const enc = EncoderFactory(rgb, width, height, stride,
+                                      param.yuv_mode, sink, kRGBInput,
+                                      &cache_->memory);
+  if (enc != nullptr) enc->SetQuantizerCache(&cache_->quantizers);
+  return FinishEncoding(enc, param);
+}
+
+bool EncoderContext::Encode(const uint8_t* rgb, int width, int height,
+                            int stride, const EncoderParam& param,
+                            std::string* output) {
+  if (output == nullptr) return false;
+  output->clear();
+  output->reserve((size_t)width * height / 4);
+  StringSink sink(output);
+  return Encode(rgb, width, height, stride, param, &sink);
+}
+
+}   // namespace sjpeg
@@ -21,6 +21,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
 
 #include "sjpegi.h"
 
@@ -70,6 +73,48 @@ bool SearchHook::Update(float result) {
   return done;
 }
 
+// The current bracket is split evenly in num + 1 parts. At first, we
+// don't know better than the estimated q, which is tried along.
+int SearchHook::NextCandidates(float qs[], int max_num) {
+  if (max_num <= 1) {
+    qs[0] = q;
+    return 1;
+  }
+  const int first = (pass == 0) ? 1 : 0;
+  if (first) qs[0] = q;
+  for (int k = first; k < max_num; ++k) {
+    qs[k] = qmin + (qmax - qmin) * (k + 1 - first) / (max_num + 1 - first);
+  }
+  return max_num;
+}
+
+bool SearchHook::UpdateCandidates(const float qs[], const float results[],
+                                  int num) {
+  if (num == 1) {
+    q = qs[0];
+    return Update(results[0]);
+  }
+  int best = 0;
+  float new_qmin = qmin, new_qmax = qmax;
+  for (int k = 0; k < num; ++k) {
+    if (fabs(results[k] - target) < fabs(results[best] - target)) best = k;
+    if (results[k] > target) {
+      if (qs[k] < new_qmax) new_qmax = qs[k];
+    } else {
+      if (qs[k] > new_qmin) new_qmin = qs[k];
+    }
+  }
+  q = qs[best];
+  value = results[best];
+  if (fabs(value - target) < tolerance * target) return true;
+  if (new_qmin > new_qmax) {   // not monotonic: zoom on the best one
+    new_qmin = new_qmax = q;
+  }
+  qmin = new_qmin;
+  qmax = new_qmax;
+  return ((qmax - qmin) / (num + 1) < kdQLimit);
+}
+
 void SearchHook::NextMatrix(int idx, uint8_t dst[64]) {
   SetQuantMatrix(kDefaultMatrices[idx], GetQFactor(q), dst);
 }
@@ -81,33 +126,13 @@ void Encoder::StoreRunLevels(DCTCoeffs* coeffs) {
   assert(use_extra_memory_);
   assert(reuse_run_levels_);
 
-  const QuantizeBlockFunc quantize_block = use_trellis_ ? TrellisQuantizeBlock
-                                                        : quantize_block_;
   if (use_trellis_) InitCodes(true);
 
   // run/levels are in registers here, so frequencies come for free. Whoever
   // needs the tables afterwards only has to CompileEntropyStats().
   const bool collect_stats = optimize_size_;
   if (collect_stats) ResetEntropyStats();
-
-  ResetDCs();
-  nb_run_levels_ = 0;
-  int16_t* in = in_blocks_;
-  for (int n = 0; n < mb_w_ * mb_h_; ++n) {
-    if (!CheckBuffers()) return;
-    for (int c = 0; c < nb_comps_; ++c) {
-      for (int i = 0; i < nb_blocks_[c]; ++i) {
-        RunLevel* const run_levels = all_run_levels_ + nb_run_levels_;
-        const int dc = quantize_block(in, c, &quants_[quant_idx_[c]],
-                                      coeffs, run_levels);
-        coeffs->dc_code_ = GenerateDCDiffCode(dc, &DCs_[c]);
-        if (collect_stats) AddEntropyStats(coeffs, run_levels);
-        nb_run_levels_ += coeffs->nb_coeffs_;
-        ++coeffs;
-        in += 64;
-      }
-    }
-  }
+  QuantizeBands(coeffs, collect_stats);
 }
 
 void Encoder::LoopScan() {
@@ -119,13 +144,28 @@ void Encoder::LoopScan() {
   } else {
     CollectCoeffs();   // we just need the coeffs
   }
+  if (!ok_) return;
 
   const size_t nb_mbs = mb_w_ * mb_h_ * mcu_blocks_;
   DCTCoeffs* const base_coeffs = Alloc<DCTCoeffs>(nb_mbs);
   if (base_coeffs == nullptr) return;
+  stats_.dct_coeffs_bytes = nb_mbs * sizeof(*base_coeffs);
 
   uint8_t opt_quants[2][64];
 
+  // Several candidates per pass, evaluated concurrently?
+  const int num_candidates =
+      std::min(std::max(search_hook_->num_candidates, 1), (int)kMaxThreads);
+  Quantizer* candidates = nullptr;
+  if (num_candidates > 1) {
+    candidates = Alloc<Quantizer>(2 * num_candidates);
+    if (candidates == nullptr) {
+      Free(base_coeffs);
+      return;
+    }
+    InitCodes(false);   // default codes, for sizes and trellis
+  }
+
   // Dichotomy passes
   float best = 0.;     // best distance
   float best_q = 0.;  // informative value to return to the user
@@ -133,6 +173,37 @@ void Encoder::LoopScan() {
   bool last_is_best = false;
   for (int p = 0; p < passes_; ++p) {
     search_hook_->pass = p;
+    if (num_candidates > 1) {
+      float qs[kMaxThreads], results[kMaxThreads];
+      const int num = search_hook_->NextCandidates(qs, num_candidates);
+      assert(num >= 1 && num <= num_candidates);
+      for (int k = 0; k < num; ++k) {
+        search_hook_->q = qs[k];
+        for (int c = 0; c < 2; ++c) {
+          candidates[2 * k + c] = quants_[c];
+          search_hook_->NextMatrix(c, candidates[2 * k + c].quant_);
+          FinalizeQuantMatrix(&candidates[2 * k + c], q_bias_);
+        }
+      }
+      ParallelFor(0, num, [&](int k) {
+        results[k] = EvaluateCandidate(&candidates[2 * k]);
+      });
+      for (int k = 0; k < num; ++k) {
+        if (DBG_PRINT) printf("pass #%d: q=%.2f value:%.2f\n",
+                              p, qs[k], results[k]);
+        const float distance = fabs(results[k] - search_hook_->target);
+        if ((p == 0 && k == 0) || distance < best) {
+          for (int c = 0; c < 2; ++c) {
+            CopyQuantMatrix(candidates[2 * k + c].quant_, opt_quants[c]);
+          }
+          best = distance;
+          best_q = qs[k];
+          best_result = results[k];
+        }
+      }
+      if (search_hook_->UpdateCandidates(qs, results, num)) break;
+      continue;
+    }
     // set new matrices to evaluate
     for (int c = 0; c < 2; ++c) {
       search_hook_->NextMatrix(c, quants_[c].quant_);
@@ -201,13 +272,36 @@ void Encoder::LoopScan() {
       FinalPassScan(nb_mbs, base_coeffs);
     }
   }
+  Free(candidates);
   Free(base_coeffs);
 }
 
+float Encoder::EvaluateCandidate(Quantizer* const quants) {
+  if (use_adaptive_quant_) {
+    AnalyseHisto(quants);   // adjust quant_[] matrices
+  }
+  if (!search_hook_->for_size) return ComputePSNR(quants);
+
+  // Only the frequencies (or the bit count) are needed, not the run/levels.
+  BandStats stats;
+  memset(&stats, 0, sizeof(stats));
+  BitCounter bc;
+  QuantizeBand(0, mb_h_, nullptr, optimize_size_, quants, nullptr, &stats,
+               optimize_size_ ? nullptr : &bc);
+  const size_t size = optimize_size_ ? OptimizedSize(stats.freq_ac,
+                                                     stats.freq_dc)
+                                     : HeaderSize() + bc.Size();
+  return size / 8.f;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Size & PSNR computation, mostly for dichotomy
 
 size_t Encoder::HeaderSize() const {
+  return HeaderSize(Huffman_tables_);
+}
+
+size_t Encoder::HeaderSize(const HuffmanTable* const tables[4]) const {
   size_t size = 0;
   size += 20;    // APP0
   size += app_markers_.size();
@@ -230,10 +324,14 @@ size_t Encoder::HeaderSize() const {
   size += 8 + 3 * nb_comps_ + 2;  // SOF
   size += 6 + 2 * nb_comps_ + 2;  // SOS
   size += 2;                      // EOI
+  if (restart_rows_ > 0) {
+    size += 6;                      // DRI
+    size += 2 * (NumBands() - 1);   // RSTn
+  }
   // DHT:
   for (int c = 0; c < (nb_comps_ == 1 ? 1 : 2); ++c) {   // luma, chroma
     for (int type = 0; type <= 1; ++type) {               // dc, ac
-      const HuffmanTable* const h = Huffman_tables_[type * 2 + c];
+      const HuffmanTable* const h = tables[type * 2 + c];
       size += 2 + 3 + 16 + h->nb_syms_;
     }
   }
@@ -291,7 +389,11 @@ float Encoder::ComputeSize(const DCTCoeffs* coeffs) {
     size += EntropySize();
   } else {
     BitCounter bc;
-    BlocksSize(mb_w_ * mb_h_ * mcu_blocks_, coeffs, all_run_levels_, &bc);
+    RunLevelStore::Reader run_levels(all_run_levels_);
+    const size_t nb_blocks = (size_t)mb_w_ * mb_h_ * mcu_blocks_;
+    for (size_t n = 0; n < nb_blocks; ++n) {
+      BlocksSize(1, &coeffs[n], run_levels.Next(coeffs[n].nb_coeffs_), &bc);
+    }
     size += bc.Size();
   }
   return size / 8.f;
@@ -306,13 +408,16 @@ static float GetPSNR(uint64_t err, uint64_t size) {
                                : 99.f;
 }
 
-float Encoder::ComputePSNR() const {
+float Encoder::ComputePSNR(const Quantizer* const quants) const {
+  assert(have_coeffs_);
   uint64_t error = 0;
-  const int16_t* in = in_blocks_;
+  alignas(16) int16_t mcu[6 * 64];
+  CoeffsReader reader(*this, 0);
   const size_t nb_mbs = mb_w_ * mb_h_;
   for (size_t n = 0; n < nb_mbs; ++n) {
+    const int16_t* in = reader.Next(mcu);
     for (int c = 0; c < nb_comps_; ++c) {
-      const Quantizer* const Q = &quants_[quant_idx_[c]];
+      const Quantizer* const Q = &quants[quant_idx_[c]];
       for (int i = 0; i < nb_blocks_[c]; ++i) {
         error += quantize_error_(in, Q);
         in += 64;
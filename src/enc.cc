@@ -23,17 +23,27 @@
 #include <stdlib.h>
 #include <string.h>  // for memcpy / memset
 
+#include <algorithm>
 #include <cstdlib>
 #include <memory>
 #include <mutex>  // NOLINT
 #include <new>
 #include <string>
+#include <vector>
 
 #include "bit_writer.h"
 
 #define SJPEG_NEED_ASM_HEADERS
 #include "sjpegi.h"
 
+#if defined(SJPEG_USE_SSSE3) || defined(SJPEG_USE_AVX2)
+#if defined(_MSC_VER)
+#include <intrin.h>   // for __cpuidex, _xgetbv
+#else
+#include <cpuid.h>
+#endif
+#endif
+
 using namespace sjpeg;   // for the plain-C entry points at the end
 
 namespace sjpeg {
@@ -60,6 +70,150 @@ static struct DefaultMemory : public MemoryManager {
 
 MemoryManager* GetDefaultMemoryManager() { return &kDefaultMemory; }
 
+void* MemoryManager::Realloc(void* const ptr, size_t used_size,
+                             size_t new_size) {
+  void* const new_ptr = Alloc(new_size);
+  if (new_ptr == nullptr) return nullptr;   // 'ptr' is left untouched
+  if (ptr != nullptr) {
+    memcpy(new_ptr, ptr, std::min(used_size, new_size));
+    Free(ptr);
+  }
+  return new_ptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CountingMemory
+
+void CountingMemory::Add(void* const ptr, size_t size) {
+  sizes_[ptr] = size;
+  used_ += size;
+  peak_ = std::max(peak_, used_);
+  ++num_allocs_;
+}
+
+void* CountingMemory::Alloc(size_t size) {
+  void* const ptr = base_->Alloc(size);
+  if (ptr != nullptr) Add(ptr, size);
+  return ptr;
+}
+
+void CountingMemory::Free(void* const ptr) {
+  if (ptr == nullptr) return;
+  const auto it = sizes_.find(ptr);
+  if (it != sizes_.end()) {
+    used_ -= it->second;
+    sizes_.erase(it);
+  }
+  base_->Free(ptr);
+}
+
+void* CountingMemory::Realloc(void* const ptr, size_t used_size,
+                              size_t new_size) {
+  void* const new_ptr = base_->Realloc(ptr, used_size, new_size);
+  if (new_ptr == nullptr) return nullptr;   // 'ptr' is left untouched
+  if (ptr != nullptr) {
+    const auto it = sizes_.find(ptr);
+    if (it != sizes_.end()) {
+      used_ -= it->second;
+      sizes_.erase(it);
+    }
+    if (new_ptr != ptr) copied_ += std::min(used_size, new_size);
+  }
+  Add(new_ptr, new_size);
+  return new_ptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// RunLevelStore
+
+RunLevel* RunLevelStore::NextChunk(MemoryManager* const memory) {
+  Chunk* chunk = (last_ != nullptr) ? last_->next : first_;
+  if (chunk == nullptr) {   // no spare one
+    chunk = static_cast<Chunk*>(memory->Alloc(sizeof(*chunk)));
+    if (chunk == nullptr) return nullptr;
+    chunk->next = nullptr;
+    chunk->size = 0;
+    if (last_ != nullptr) {
+      last_->next = chunk;
+    } else {
+      first_ = chunk;
+    }
+  }
+  last_ = chunk;
+  return chunk->rl;
+}
+
+void RunLevelStore::Append(RunLevelStore* const other) {
+  if (other->first_ == nullptr) return;
+  if (first_ == nullptr) {
+    *this = *other;
+  } else {
+    // the spare chunks go after the other's ones
+    Chunk* const spare = last_->next;
+    Chunk* end = other->last_;
+    while (end->next != nullptr) end = end->next;
+    end->next = spare;
+    last_->next = other->first_;
+    last_ = other->last_;
+    size_ += other->size_;
+  }
+  *other = RunLevelStore();
+}
+
+size_t RunLevelStore::Bytes() const {
+  size_t size = 0;
+  for (Chunk* chunk = first_; chunk != nullptr; chunk = chunk->next) {
+    size += sizeof(*chunk);
+  }
+  return size;
+}
+
+void RunLevelStore::Rewind() {
+  for (Chunk* chunk = first_; chunk != nullptr; chunk = chunk->next) {
+    chunk->size = 0;
+  }
+  last_ = first_;
+  size_ = 0;
+}
+
+void RunLevelStore::Release(MemoryManager* const memory) {
+  while (first_ != nullptr) {
+    Chunk* const next = first_->next;
+    memory->Free(first_);
+    first_ = next;
+  }
+  *this = RunLevelStore();
+}
+
+RunLevelStore::Spares::Spares(RunLevelStore* const store,
+                              MemoryManager* const base)
+    : base_(base), first_(store->first_) {
+  *store = RunLevelStore();
+}
+
+RunLevelStore::Spares::~Spares() {
+  while (first_ != nullptr) {
+    Chunk* const next = first_->next;
+    base_->Free(first_);
+    first_ = next;
+  }
+}
+
+void* RunLevelStore::Spares::Alloc(size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (size == sizeof(Chunk) && first_ != nullptr) {
+    Chunk* const chunk = first_;
+    first_ = chunk->next;
+    return chunk;
+  }
+  return base_->Alloc(size);
+}
+
+void RunLevelStore::Spares::Free(void* const ptr) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  base_->Free(ptr);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Encoder main class
 
@@ -68,17 +222,29 @@ Encoder::Encoder(SjpegYUVMode yuv_mode, int W, int H, ByteSink* const sink,
   : yuv_mode_(yuv_mode), W_(W), H_(H),
     ok_(true),
     bw_(sink),
+    num_threads_(1),
+    pipelined_(false),
+    flush_rows_(false),
+    restart_rows_(0),
+    executor_(nullptr),
     in_blocks_base_(nullptr),
     in_blocks_(nullptr),
     have_coeffs_(false),
-    all_run_levels_(nullptr),
-    nb_run_levels_(0),
-    max_run_levels_(0),
+    compact_coeffs_(false),
+    packed_rows_(nullptr),
+    max_memory_(0),
+    all_run_levels_(),
+    stream_coeffs_(nullptr),
+    stream_run_levels_(nullptr),
+    stream_dcs_(nullptr),
+    stream_row_(0),
     qdelta_max_luma_(kDefaultDeltaMaxLuma),
     qdelta_max_chroma_(kDefaultDeltaMaxChroma),
     passes_(1),
     search_hook_(nullptr),
-    memory_hook_((memory == nullptr) ? &kDefaultMemory : memory) {
+    memory_hook_((memory == nullptr) ? &kDefaultMemory : memory),
+    quant_cache_(nullptr),
+    stats_out_(nullptr) {
   SetCompressionMethod(kDefaultMethod);
   SetQuality(kDefaultQuality);
   get_yuv_block_ = GetBlockFunc(yuv_mode_);
@@ -91,7 +257,10 @@ Encoder::Encoder(SjpegYUVMode yuv_mode, int W, int H, ByteSink* const sink,
 }
 
 Encoder::~Encoder() {
-  Free(all_run_levels_);
+  Free(stream_dcs_);
+  Free(stream_run_levels_);
+  Free(stream_coeffs_);
+  all_run_levels_.Release(memory_hook_);
   DeallocateBlocks();   // clean-up leftovers in case of we had an error
 }
 
@@ -165,6 +334,69 @@ bool SupportsSSE2() {
   return false;
 }
 
+#if defined(SJPEG_USE_SSSE3) || defined(SJPEG_USE_AVX2)
+// cpuid leaf 'level', sub-leaf 0: { eax, ebx, ecx, edx }
+static void GetCPUInfo(uint32_t info[4], int level) {
+#if defined(_MSC_VER)
+  int regs[4];
+  __cpuidex(regs, level, 0);
+  for (int i = 0; i < 4; ++i) info[i] = static_cast<uint32_t>(regs[i]);
+#else
+  __cpuid_count(level, 0, info[0], info[1], info[2], info[3]);
+#endif
+}
+#endif
+
+#if defined(SJPEG_USE_SSSE3)
+static bool HasSSSE3() {
+  uint32_t info[4];
+  GetCPUInfo(info, 0);
+  if (info[0] < 1) return false;
+  GetCPUInfo(info, 1);
+  return (info[2] & (1u << 9)) != 0;
+}
+#endif
+
+bool SupportsSSSE3() {
+  if (ForceSlowCImplementation) return false;
+#if defined(SJPEG_USE_SSSE3)
+  static const bool has_ssse3 = HasSSSE3();
+  return has_ssse3;
+#endif
+  return false;
+}
+
+#if defined(SJPEG_USE_AVX2)
+// the OS must also save the ymm registers on context switch (XCR0 bits 1-2)
+static bool HasAVX2() {
+  uint32_t info[4];
+  GetCPUInfo(info, 0);
+  if (info[0] < 7) return false;
+  GetCPUInfo(info, 1);
+  const uint32_t kOSXSAVE = 1u << 27, kAVX = 1u << 28;
+  if ((info[2] & (kOSXSAVE | kAVX)) != (kOSXSAVE | kAVX)) return false;
+#if defined(_MSC_VER)
+  const uint64_t xcr0 = _xgetbv(0);
+#else
+  uint32_t lo, hi;
+  __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  const uint64_t xcr0 = (static_cast<uint64_t>(hi) << 32) | lo;
+#endif
+  if ((xcr0 & 6) != 6) return false;
+  GetCPUInfo(info, 7);
+  return (info[1] & (1u << 5)) != 0;
+}
+#endif
+
+bool SupportsAVX2() {
+  if (ForceSlowCImplementation) return false;
+#if defined(SJPEG_USE_AVX2)
+  static const bool has_avx2 = HasAVX2();
+  return has_avx2;
+#endif
+  return false;
+}
+
 bool SupportsNEON() {
   if (ForceSlowCImplementation) return false;
 #if defined(SJPEG_USE_NEON)
@@ -203,35 +435,23 @@ bool Encoder::SetError() {
   return false;
 }
 
-bool Encoder::CheckBuffers() {
+bool Encoder::ReserveMCU(int nb_rows, BitWriter* const bw) const {
   // Worst-case macroblock is 24bits*64*6 coeffs = 1152 bytes, doubled by 0xff
   // stuffing, so 2560 covers one MCU. Writer serves that out of a larger slab
   // and only reaches the sink when the slab runs out. Slab follows the image
-  // rather than being fixed: at a flat 256k, a 64x64 thumbnail whose JPEG is
-  // 3kB holds half a megabyte of capacity, and a string never gives it back.
-  size_t chunk = (size_t)W_ * H_ / 4;
+  // (or the band) rather than being fixed: at a flat 256k, a 64x64 thumbnail
+  // whose JPEG is 3kB holds half a megabyte of capacity, and a string never
+  // gives it back. When flushing rows, it only has to hold one.
+  if (flush_rows_) nb_rows = 1;
+  size_t chunk = (size_t)W_ * std::min(H_, nb_rows * block_h_) / 4;
   if (chunk < 4096) chunk = 4096;
   if (chunk > (256 << 10)) chunk = 256 << 10;
-  ok_ = ok_ && bw_.ReserveMore(2560, chunk);
-  if (!ok_) return false;
+  return bw->ReserveMore(2560, chunk);
+}
 
-  if (reuse_run_levels_) {
-    if (nb_run_levels_ + 6*64 > max_run_levels_) {
-      // need to grow storage for run/levels
-      const size_t new_size = max_run_levels_ ? max_run_levels_ * 2 : 8192;
-      RunLevel* const new_rl = Alloc<RunLevel>(new_size);
-      if (new_rl == nullptr) return false;
-      if (nb_run_levels_ > 0) {
-        memcpy(new_rl, all_run_levels_,
-               nb_run_levels_ * sizeof(new_rl[0]));
-      }
-      Free(all_run_levels_);
-      all_run_levels_ = new_rl;
-      max_run_levels_ = new_size;
-      assert(nb_run_levels_ + 6 * 64 <= max_run_levels_);
-    }
-  }
-  return true;
+bool Encoder::CheckBuffers() {
+  ok_ = ok_ && ReserveMCU(mb_h_, &bw_);
+  return ok_;
 }
 
 bool Encoder::AllocateBlocks(size_t num_blocks) {
@@ -240,6 +460,7 @@ bool Encoder::AllocateBlocks(size_t num_blocks) {
   const size_t size = num_blocks * 64 * sizeof(*in_blocks_);
   in_blocks_base_ = Alloc<uint8_t>(size + ALIGN_CST);
   if (in_blocks_base_ == nullptr) return false;
+  stats_.coeffs_bytes = std::max(stats_.coeffs_bytes, size);
   in_blocks_ = reinterpret_cast<int16_t*>(
       (ALIGN_CST + reinterpret_cast<uintptr_t>(in_blocks_base_)) & ~ALIGN_CST);
   return true;
@@ -249,6 +470,50 @@ void Encoder::DeallocateBlocks() {
   Free(in_blocks_base_);
   in_blocks_base_ = nullptr;
   in_blocks_ = nullptr;          // sanity
+  if (packed_rows_ != nullptr) {
+    for (int mb_y = 0; mb_y < mb_h_; ++mb_y) Free(packed_rows_[mb_y]);
+    Free(packed_rows_);
+    packed_rows_ = nullptr;
+  }
+  have_coeffs_ = false;
+}
+
+int Encoder::NumCollectBands() const {
+  return (executor_ != nullptr) ? std::min(num_threads_, mb_h_) : 1;
+}
+
+int16_t* Encoder::RowCoeffs(int band, int mb_y) const {
+  // If compact, each band has one row for the coefficients, followed by
+  // room for two more (256 bytes per block), where they are packed.
+  const size_t row = compact_coeffs_ ? 3 * band : mb_y;
+  return in_blocks_ + row * mb_w_ * mcu_blocks_ * 64;
+}
+
+bool Encoder::StoreRow(int band, int mb_y, MemoryManager* const memory,
+                       size_t* const size) {
+  if (!compact_coeffs_) return true;
+  int16_t* const in = RowCoeffs(band, mb_y);
+  const int row_blocks = mb_w_ * mcu_blocks_;
+  uint8_t* const packed = reinterpret_cast<uint8_t*>(in + row_blocks * 64);
+  const size_t packed_size = PackCoeffs(in, row_blocks, packed);
+  uint8_t* const dst =
+      static_cast<uint8_t*>(memory->Alloc(packed_size + kPackedPadding));
+  if (dst == nullptr) return false;
+  memcpy(dst, packed, packed_size);
+  memset(dst + packed_size, 0, kPackedPadding);
+  memory->Free(packed_rows_[mb_y]);
+  packed_rows_[mb_y] = dst;
+  *size += packed_size + kPackedPadding;
+  return true;
+}
+
+void Encoder::ParallelFor(int begin, int end,
+                          const std::function<void(int)>& fn) {
+  if (executor_ != nullptr) {
+    executor_->ParallelFor(begin, end, fn);
+  } else {
+    for (int i = begin; i < end; ++i) fn(i);
+  }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -256,143 +521,528 @@ void Encoder::DeallocateBlocks() {
 
 void Encoder::CollectCoeffs() {
   assert(use_extra_memory_);
-  int16_t* in = in_blocks_;
   const int mb_x_max = W_ / block_w_;
   const int mb_y_max = H_ / block_h_;
-  for (int mb_y = 0; mb_y < mb_h_; ++mb_y) {
-    const bool yclip = (mb_y == mb_y_max);
-    for (int mb_x = 0; mb_x < mb_w_; ++mb_x) {
-      GetSamples(mb_x, mb_y, yclip | (mb_x == mb_x_max), in);
-      fDCT_(in, mcu_blocks_);
-      in += 64 * mcu_blocks_;
+  // rows are independent
+  const int nb_bands = NumCollectBands();
+  const int band_rows = (mb_h_ + nb_bands - 1) / nb_bands;
+  LockedMemory memory(memory_hook_);
+  std::vector<char> oks(nb_bands, true);
+  std::vector<size_t> packed_sizes(nb_bands, 0);
+  ParallelFor(0, nb_bands, [&](int band) {
+    const int mb_y_end = std::min((band + 1) * band_rows, mb_h_);
+    for (int mb_y = band * band_rows; mb_y < mb_y_end; ++mb_y) {
+      int16_t* in = RowCoeffs(band, mb_y);
+      const bool yclip = (mb_y == mb_y_max);
+      for (int mb_x = 0; mb_x < mb_w_; ++mb_x) {
+        GetSamples(mb_x, mb_y, yclip | (mb_x == mb_x_max), in);
+        fDCT_(in, mcu_blocks_);
+        in += 64 * mcu_blocks_;
+      }
+      if (!StoreRow(band, mb_y, &memory, &packed_sizes[band])) {
+        oks[band] = false;
+        return;
+      }
     }
-  }
+  });
   have_coeffs_ = true;
+  for (int band = 0; band < nb_bands; ++band) {
+    if (!oks[band]) have_coeffs_ = SetError();
+    stats_.coeffs_bytes += packed_sizes[band];   // on top of in_blocks_
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Restart intervals: the scan is split in bands of MCU rows, each starting
+// with fresh DC predictors and ending with a RSTn marker. Bands don't share
+// any state, so they can be entropy-coded concurrently.
+
+int Encoder::NumBands() const {
+  return (restart_rows_ > 0) ? (mb_h_ + restart_rows_ - 1) / restart_rows_ : 1;
+}
+
+bool Encoder::EndBand(int band, BitWriter* const bw) const {
+  // byte-align the band, then emit the marker for the next one, if any.
+  // ReserveMCU() leaves room for both.
+  if (!ReserveMCU((restart_rows_ > 0) ? restart_rows_ : mb_h_, bw)) {
+    return false;
+  }
+  bw->Flush();
+  if (band + 1 < NumBands()) {
+    bw->PutByte(M_RST0 >> 8);
+    bw->PutByte((M_RST0 & 0xff) + (band & 7));
+  }
+  return true;
+}
+
+void Encoder::CodeBands(
+    const std::function<bool(int, BitWriter*)>& code_band) {
+  CodeParts(NumBands(), false, code_band);
+}
+
+// Without restart intervals, parts end at any bit position: their last bits
+// are kept aside, and the next part is appended right after them.
+void Encoder::CodeParts(int nb_parts, bool stitch,
+                        const std::function<bool(int, BitWriter*)>& code_part) {
+  if (!ok_) return;
+  if (nb_parts == 1) {
+    ok_ = code_part(0, &bw_);
+    return;
+  }
+  struct Part {
+    ScratchSink* sink = nullptr;
+    uint32_t bits = 0;   // left-over bits, if stitching
+    int nb_bits = 0;
+    bool ok = false;
+  };
+  LockedMemory memory(memory_hook_);
+  std::vector<Part> parts(nb_parts);
+  ParallelFor(0, nb_parts, [&](int n) {
+    Part* const part = &parts[n];
+    if (n == 0) {   // directly into the final output
+      part->ok = code_part(0, &bw_);
+      return;
+    }
+    part->sink = new (std::nothrow) ScratchSink(&memory);
+    if (part->sink == nullptr) return;
+    BitWriter bw(part->sink);
+    part->ok = code_part(n, &bw) &&
+               (stitch ? bw.EndSegment(&part->bits, &part->nb_bits)
+                       : bw.Finalize());
+  });
+
+  for (int n = 0; n < nb_parts; ++n) {
+    Part* const part = &parts[n];
+    ok_ = ok_ && part->ok;
+    if (n > 0 && ok_) {
+      const size_t size = part->sink->size();
+      if (stitch) {
+        ok_ = bw_.AppendSegment(part->sink->data(), size,
+                                part->bits, part->nb_bits);
+      } else {
+        ok_ = bw_.Reserve(size);
+        if (ok_ && size > 0) bw_.PutBytes(part->sink->data(), size);
+      }
+    }
+    delete part->sink;
+  }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // 1-pass Scan
 
 void Encoder::SinglePassScan() {
-  ResetDCs();
-
-  RunLevel base_run_levels[64];
-  int16_t* in = in_blocks_;
+  if (pipelined_ && executor_ != nullptr && mb_h_ > 1) {
+    PipelinedScan();
+    return;
+  }
   const int mb_x_max = W_ / block_w_;
   const int mb_y_max = H_ / block_h_;
   const QuantizeBlockFunc quantize_block = use_trellis_ ? TrellisQuantizeBlock
                                                         : quantize_block_;
   const bool have_coeffs = have_coeffs_;
-  for (int mb_y = 0; mb_y < mb_h_; ++mb_y) {
-    const bool yclip = (mb_y == mb_y_max);
-    for (int mb_x = 0; mb_x < mb_w_; ++mb_x) {
-      if (!CheckBuffers()) return;
-      if (!have_coeffs) {
-        in = in_blocks_;
-        GetSamples(mb_x, mb_y, yclip | (mb_x == mb_x_max), in);
-        fDCT_(in, mcu_blocks_);
-      }
-      for (int c = 0; c < nb_comps_; ++c) {
-        DCTCoeffs base_coeffs;
-        for (int i = 0; i < nb_blocks_[c]; ++i) {
-          const int dc = quantize_block(in, c, &quants_[quant_idx_[c]],
-                                        &base_coeffs, base_run_levels);
-          base_coeffs.dc_code_ = GenerateDCDiffCode(dc, &DCs_[c]);
-          CodeBlock(&base_coeffs, base_run_levels);
-          in += 64;
+  const int band_rows = (restart_rows_ > 0) ? restart_rows_ : mb_h_;
+  CodeBands([&](int band, BitWriter* const bw) {
+    alignas(16) int16_t mcu[6 * 64];   // scratch samples
+    RunLevel base_run_levels[64];
+    int DCs[3] = { 0, 0, 0 };
+    const int mb_y_start = band * band_rows;
+    const int mb_y_end = std::min(mb_y_start + band_rows, mb_h_);
+    CoeffsReader reader(*this, have_coeffs ? mb_y_start : 0);
+    for (int mb_y = mb_y_start; mb_y < mb_y_end; ++mb_y) {
+      const bool yclip = (mb_y == mb_y_max);
+      for (int mb_x = 0; mb_x < mb_w_; ++mb_x) {
+        if (!ReserveMCU(band_rows, bw)) return false;
+        const int16_t* in = mcu;
+        if (have_coeffs) {
+          in = reader.Next(mcu);
+        } else {
+          GetSamples(mb_x, mb_y, yclip | (mb_x == mb_x_max), mcu);
+          fDCT_(mcu, mcu_blocks_);
+        }
+        for (int c = 0; c < nb_comps_; ++c) {
+          DCTCoeffs base_coeffs;
+          for (int i = 0; i < nb_blocks_[c]; ++i) {
+            const int dc = quantize_block(in, c, &quants_[quant_idx_[c]],
+                                          &base_coeffs, base_run_levels);
+            base_coeffs.dc_code_ = GenerateDCDiffCode(dc, &DCs[c]);
+            CodeBlock(&base_coeffs, base_run_levels, bw);
+            in += 64;
+          }
         }
       }
+      if (!EndRow(bw)) return false;
+    }
+    return EndBand(band, bw);
+  });
+}
+
+void Encoder::QuantizeRow(int mb_y, DCTCoeffs* coeffs, RunLevel* run_levels,
+                          int* dcs) {
+  const QuantizeBlockFunc quantize_block = use_trellis_ ? TrellisQuantizeBlock
+                                                        : quantize_block_;
+  const int mb_x_max = W_ / block_w_;
+  const bool clip = (mb_y == H_ / block_h_);
+  alignas(16) int16_t mcu[6 * 64];   // scratch samples
+  CoeffsReader reader(*this, have_coeffs_ ? mb_y : 0);
+  for (int mb_x = 0; mb_x < mb_w_; ++mb_x) {
+    const int16_t* in = mcu;
+    if (have_coeffs_) {
+      in = reader.Next(mcu);
+    } else {
+      GetSamples(mb_x, mb_y, clip | (mb_x == mb_x_max), mcu);
+      fDCT_(mcu, mcu_blocks_);
+    }
+    for (int c = 0; c < nb_comps_; ++c) {
+      for (int i = 0; i < nb_blocks_[c]; ++i) {
+        *dcs++ = quantize_block(in, c, &quants_[quant_idx_[c]],
+                                coeffs++, run_levels);
+        run_levels += 64;
+        in += 64;
+      }
     }
   }
 }
 
+void Encoder::PipelinedScan() {
+  // Two sets of 'window' rows: while one is quantized, the other is coded.
+  const int window = num_threads_;
+  const size_t row_blocks = (size_t)mb_w_ * mcu_blocks_;
+  const size_t nb_blocks = 2 * window * row_blocks;
+  DCTCoeffs* const coeffs = Alloc<DCTCoeffs>(nb_blocks);
+  RunLevel* const run_levels = Alloc<RunLevel>(64 * nb_blocks);
+  int* const dcs = Alloc<int>(nb_blocks);
+  if (coeffs != nullptr && run_levels != nullptr && dcs != nullptr) {
+    stats_.dct_coeffs_bytes = nb_blocks * sizeof(*coeffs);
+    stats_.run_levels_bytes = 64 * nb_blocks * sizeof(*run_levels);
+    const int nb_windows = (mb_h_ + window - 1) / window;
+    int DCs[3] = { 0, 0, 0 };
+    bool ok = true;
+    // Coding window #w - 1 is task #0: the calling thread usually takes it.
+    for (int w = 0; w <= nb_windows && ok; ++w) {
+      ParallelFor(0, window + 1, [&](int n) {
+        if (n > 0) {
+          const int mb_y = w * window + n - 1;
+          if (mb_y >= mb_h_) return;
+          const size_t pos = ((w & 1) * window + n - 1) * row_blocks;
+          QuantizeRow(mb_y, coeffs + pos, run_levels + 64 * pos, dcs + pos);
+          return;
+        }
+        if (w == 0) return;
+        const int mb_y_start = (w - 1) * window;
+        const int mb_y_end = std::min(mb_y_start + window, mb_h_);
+        size_t pos = ((w - 1) & 1) * window * row_blocks;
+        for (int mb_y = mb_y_start; mb_y < mb_y_end; ++mb_y) {
+          for (int mb_x = 0; mb_x < mb_w_; ++mb_x) {
+            if (!ReserveMCU(mb_h_, &bw_)) {
+              ok = false;
+              return;
+            }
+            for (int c = 0; c < nb_comps_; ++c) {
+              for (int i = 0; i < nb_blocks_[c]; ++i, ++pos) {
+                coeffs[pos].dc_code_ = GenerateDCDiffCode(dcs[pos], &DCs[c]);
+                CodeBlock(&coeffs[pos], run_levels + 64 * pos, &bw_);
+              }
+            }
+          }
+          if (!EndRow(&bw_)) {
+            ok = false;
+            return;
+          }
+        }
+      });
+    }
+    ok_ = ok && EndBand(0, &bw_);
+  }
+  Free(dcs);
+  Free(run_levels);
+  Free(coeffs);
+}
+
 void Encoder::FinalPassScan(size_t nb_mbs, const DCTCoeffs* coeffs) {
   DeallocateBlocks();     // we can free up some coeffs memory at this point
-  if (!CheckBuffers()) return;  // call needed to finalize all_run_levels_
+  if (!CheckBuffers()) return;
   assert(reuse_run_levels_);
-  const RunLevel* run_levels = all_run_levels_;
-  for (size_t n = 0; n < nb_mbs; ++n) {
-    if (!CheckBuffers()) return;
-    CodeBlock(&coeffs[n], run_levels);
-    run_levels += coeffs[n].nb_coeffs_;
+  // All the DC codes and run/levels are known already: without restart
+  // intervals, the scan can still be split into segments of MCU rows, coded
+  // concurrently then stitched together.
+  int nb_parts = NumBands();
+  int part_rows = (restart_rows_ > 0) ? restart_rows_ : mb_h_;
+  const bool stitch = (nb_parts == 1 && executor_ != nullptr);
+  if (stitch) {
+    part_rows = (mb_h_ + num_threads_ - 1) / num_threads_;
+    nb_parts = (mb_h_ + part_rows - 1) / part_rows;
+  }
+  const size_t part_blocks = (size_t)part_rows * mb_w_ * mcu_blocks_;
+  // locate the run/levels each part starts with
+  std::vector<RunLevelStore::Reader> part_run_levels(
+      nb_parts, RunLevelStore::Reader(all_run_levels_));
+  if (nb_parts > 1) {
+    RunLevelStore::Reader run_levels(all_run_levels_);
+    for (size_t n = 0; n < nb_mbs; ++n) {
+      if (n % part_blocks == 0) part_run_levels[n / part_blocks] = run_levels;
+      run_levels.Next(coeffs[n].nb_coeffs_);
+    }
   }
+  CodeParts(nb_parts, stitch, [&](int part, BitWriter* const bw) {
+    const size_t start = part * part_blocks;
+    const size_t end = std::min(start + part_blocks, nb_mbs);
+    RunLevelStore::Reader run_levels = part_run_levels[part];
+    const size_t row_blocks = (size_t)mb_w_ * mcu_blocks_;
+    for (size_t n = start; n < end; ++n) {
+      if (!ReserveMCU(part_rows, bw)) return false;
+      CodeBlock(&coeffs[n], run_levels.Next(coeffs[n].nb_coeffs_), bw);
+      if ((n + 1) % row_blocks == 0 && !EndRow(bw)) return false;
+    }
+    return stitch || EndBand(part, bw);
+  });
+  if (stitch) ok_ = ok_ && EndBand(0, &bw_);   // pad the stitched scan
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-
-void Encoder::SinglePassScanOptimized() {
-  const size_t nb_mbs = mb_w_ * mb_h_ * mcu_blocks_;
-  DCTCoeffs* const base_coeffs =
-      Alloc<DCTCoeffs>(reuse_run_levels_ ? nb_mbs : 1);
-  if (base_coeffs == nullptr) return;
-  DCTCoeffs* coeffs = base_coeffs;
-  RunLevel base_run_levels[64];
+// Quantization pass, gathering statistics and run/levels for the final scan.
+// Bands of MCU rows are quantized concurrently, each one with its own
+// counters, run/levels storage and DC predictors starting at 0. These are
+// stitched together afterward, so the result doesn't depend on the split.
+
+bool Encoder::QuantizeBand(int mb_y_start, int mb_y_end, DCTCoeffs* coeffs,
+                           bool collect_stats, const Quantizer* const quants,
+                           MemoryManager* const memory, BandStats* const band,
+                           BitCounter* const bc) {
   const QuantizeBlockFunc quantize_block = use_trellis_ ? TrellisQuantizeBlock
                                                         : quantize_block_;
-
-  // We use the default Huffman tables as basis for bit-rate evaluation
-  if (use_trellis_) InitCodes(true);
-
-  ResetEntropyStats();
-  ResetDCs();
-  nb_run_levels_ = 0;
-  int16_t* in = in_blocks_;
   const int mb_x_max = W_ / block_w_;
   const int mb_y_max = H_ / block_h_;
   const bool have_coeffs = have_coeffs_;
-  const bool reuse_run_levels = reuse_run_levels_;
-  for (int mb_y = 0; mb_y < mb_h_; ++mb_y) {
+  const bool store = (coeffs != nullptr);
+  alignas(16) int16_t mcu[6 * 64];   // scratch samples
+  RunLevel base_run_levels[64];      // scratch run/levels, if !store
+  DCTCoeffs base_coeffs;
+  int DCs[3] = { 0, 0, 0 };
+  CoeffsReader reader(*this, have_coeffs ? mb_y_start : 0);
+  for (int mb_y = mb_y_start; mb_y < mb_y_end; ++mb_y) {
     const bool yclip = (mb_y == mb_y_max);
     for (int mb_x = 0; mb_x < mb_w_; ++mb_x) {
-      if (!have_coeffs) {
-        in = in_blocks_;
-        GetSamples(mb_x, mb_y, yclip | (mb_x == mb_x_max), in);
-        fDCT_(in, mcu_blocks_);
+      const int16_t* in = mcu;
+      if (have_coeffs) {
+        in = reader.Next(mcu);
+      } else {
+        GetSamples(mb_x, mb_y, yclip | (mb_x == mb_x_max), mcu);
+        fDCT_(mcu, mcu_blocks_);
+      }
+      RunLevel* mcu_run_levels = nullptr;
+      if (store) {
+        mcu_run_levels = band->run_levels.Reserve(memory);
+        if (mcu_run_levels == nullptr) return false;
       }
-      if (!CheckBuffers()) goto End;
+      if (IsRestart(mb_x, mb_y)) DCs[0] = DCs[1] = DCs[2] = 0;
       for (int c = 0; c < nb_comps_; ++c) {
         for (int i = 0; i < nb_blocks_[c]; ++i) {
-          RunLevel* const run_levels =
-              reuse_run_levels ? all_run_levels_ + nb_run_levels_
-                               : base_run_levels;
-          const int dc = quantize_block(in, c, &quants_[quant_idx_[c]],
-                                        coeffs, run_levels);
-          coeffs->dc_code_ = GenerateDCDiffCode(dc, &DCs_[c]);
-          AddEntropyStats(coeffs, run_levels);
-          if (reuse_run_levels) {
-            nb_run_levels_ += coeffs->nb_coeffs_;
+          DCTCoeffs* const out = store ? coeffs : &base_coeffs;
+          RunLevel* const run_levels = store ? mcu_run_levels : base_run_levels;
+          const int dc = quantize_block(in, c, &quants[quant_idx_[c]],
+                                        out, run_levels);
+          if (mb_y == mb_y_start && mb_x == 0 && i == 0) {
+            band->first_dc[c] = dc;
+          }
+          out->dc_code_ = GenerateDCDiffCode(dc, &DCs[c]);
+          if (collect_stats) {
+            AddEntropyStats(out, run_levels, band->freq_ac, band->freq_dc);
+          }
+          if (bc != nullptr) BlocksSize(1, out, run_levels, bc);
+          if (store) {
+            band->run_levels.Add(out->nb_coeffs_);
+            mcu_run_levels += out->nb_coeffs_;
             ++coeffs;
-            assert(coeffs <= &base_coeffs[nb_mbs]);
           }
           in += 64;
-          assert(nb_run_levels_ <= max_run_levels_);
         }
       }
     }
   }
+  for (int c = 0; c < nb_comps_; ++c) band->last_dc[c] = DCs[c];
+  return true;
+}
 
-  CompileEntropyStats();
-  WriteDHT();
-  WriteSOS();
+bool Encoder::QuantizeBands(DCTCoeffs* const coeffs, bool collect_stats) {
+  int nb_bands = (executor_ != nullptr) ? std::min(num_threads_, mb_h_) : 1;
+  const int band_rows = (mb_h_ + nb_bands - 1) / nb_bands;
+  nb_bands = (mb_h_ + band_rows - 1) / band_rows;   // no empty band
+  BandStats* const bands = Alloc<BandStats>(nb_bands);
+  if (bands == nullptr) return false;
+  memset(bands, 0, nb_bands * sizeof(*bands));
+  // the bands recycle the chunks of the previous pass, in any order
+  RunLevelStore::Spares memory(&all_run_levels_, memory_hook_);
+  std::vector<char> oks(nb_bands, false);
+  const size_t band_blocks = (size_t)band_rows * mb_w_ * mcu_blocks_;
+  ParallelFor(0, nb_bands, [&](int b) {
+    const int mb_y_start = b * band_rows;
+    const int mb_y_end = std::min(mb_y_start + band_rows, mb_h_);
+    DCTCoeffs* const band_coeffs =
+        (coeffs != nullptr) ? coeffs + b * band_blocks : nullptr;
+    oks[b] = QuantizeBand(mb_y_start, mb_y_end, band_coeffs, collect_stats,
+                          quants_, &memory, &bands[b], nullptr);
+  });
+  bool ok = true;
+  for (int b = 0; b < nb_bands; ++b) ok = ok && oks[b];
+
+  // DC prediction runs across the bands that don't start a restart interval:
+  // recode their first DCs using the previous band's last ones.
+  for (int b = 1; ok && b < nb_bands; ++b) {
+    if (IsRestart(0, b * band_rows)) continue;
+    size_t pos = b * band_blocks;   // first block of component #c
+    for (int c = 0; c < nb_comps_; ++c) {
+      const int dc = bands[b].first_dc[c];
+      int predictor = 0;
+      const uint16_t old_code = GenerateDCDiffCode(dc, &predictor);
+      predictor = bands[b - 1].last_dc[c];
+      const uint16_t new_code = GenerateDCDiffCode(dc, &predictor);
+      if (collect_stats) {
+        uint32_t* const freq_dc = bands[b].freq_dc[quant_idx_[c]];
+        --freq_dc[old_code & 0x0f];
+        ++freq_dc[new_code & 0x0f];
+      }
+      if (coeffs != nullptr) coeffs[pos].dc_code_ = new_code;
+      pos += nb_blocks_[c];
+    }
+  }
 
-  if (!reuse_run_levels_) {
-    SinglePassScan();   // redo everything, but with optimal tables now.
-  } else {
-    // Re-use the saved run/levels for fast 2nd-pass.
-    FinalPassScan(nb_mbs, base_coeffs);
+  if (ok && collect_stats) {
+    for (int b = 0; b < nb_bands; ++b) {
+      for (int q = 0; q < 2; ++q) {
+        for (int i = 0; i < 256 + 1; ++i) {
+          freq_ac_[q][i] += bands[b].freq_ac[q][i];
+        }
+        for (int i = 0; i < 12 + 1; ++i) {
+          freq_dc_[q][i] += bands[b].freq_dc[q][i];
+        }
+      }
+    }
+  }
+
+  // chain the run/levels after band #0's, or drop them
+  for (int b = 1; b < nb_bands; ++b) {
+    if (ok) {
+      bands[0].run_levels.Append(&bands[b].run_levels);
+    } else {
+      bands[b].run_levels.Release(memory_hook_);
+    }
+  }
+  if (!ok) bands[0].run_levels.Rewind();
+  all_run_levels_ = bands[0].run_levels;
+  stats_.run_levels_bytes =
+      std::max(stats_.run_levels_bytes, all_run_levels_.Bytes());
+  Free(bands);
+  return ok || SetError();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Encoder::SinglePassScanOptimized() {
+  const size_t nb_mbs = mb_w_ * mb_h_ * mcu_blocks_;
+  DCTCoeffs* base_coeffs = nullptr;
+  if (reuse_run_levels_) {
+    base_coeffs = Alloc<DCTCoeffs>(nb_mbs);
+    if (base_coeffs == nullptr) return;
+    stats_.dct_coeffs_bytes = nb_mbs * sizeof(*base_coeffs);
+  }
+
+  // We use the default Huffman tables as basis for bit-rate evaluation
+  if (use_trellis_) InitCodes(true);
+
+  ResetEntropyStats();
+  if (QuantizeBands(base_coeffs, true)) {
+    CompileEntropyStats();
+    WriteDHT();
+    WriteSOS();
+
+    if (!reuse_run_levels_) {
+      SinglePassScan();   // redo everything, but with optimal tables now.
+    } else {
+      // Re-use the saved run/levels for fast 2nd-pass.
+      FinalPassScan(nb_mbs, base_coeffs);
+    }
   }
- End:
   Free(base_coeffs);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Memory budget and statistics
+
+size_t Encoder::EstimateMemory() const {
+  // Typical values, the actual ones depending on the picture and quality.
+  const size_t kPackedBlockSize = 68;    // see PackCoeffs()
+  const size_t kRunLevelsPerBlock = 16;
+  const size_t kOutputPerBlock = 16;     // compressed bytes
+
+  const size_t row_blocks = (size_t)mb_w_ * mcu_blocks_;
+  const size_t nb_blocks = row_blocks * mb_h_;
+  const size_t block_size = 64 * sizeof(*in_blocks_);
+  size_t coeffs = 0;
+  if (use_extra_memory_) {
+    coeffs = compact_coeffs_ ? nb_blocks * kPackedBlockSize
+                             + 3 * row_blocks * NumCollectBands() * block_size
+                             : nb_blocks * block_size;
+  }
+  // The histograms are released before the scans start.
+  size_t analysis = 0;
+  if (use_adaptive_quant_) {   // see CollectHistograms()
+    analysis = 2 * (NumCollectBands() - 1) * sizeof(Histo);
+  }
+  size_t scan = 0;
+  if (reuse_run_levels_) {
+    scan = nb_blocks * (sizeof(DCTCoeffs)
+                        + kRunLevelsPerBlock * sizeof(RunLevel));
+  } else if (pipelined_ && executor_ != nullptr) {
+    scan = 2 * num_threads_ * row_blocks
+         * (sizeof(DCTCoeffs) + 64 * sizeof(RunLevel) + sizeof(int));
+  }
+  const size_t output = iccp_.size() + xmp_.size() + exif_.size()
+                      + app_markers_.size() + nb_blocks * kOutputPerBlock;
+  return SamplesMemory(stream_samples_) + coeffs + std::max(analysis, scan)
+       + output;
+}
+
+bool Encoder::FitMemoryBudget(bool single_scan) {
+  if (max_memory_ == 0) return true;
+  // From the cheapest to the most expensive trade-off. The search needs the
+  // coefficients and run/levels whatever the budget.
+  if (EstimateMemory() > max_memory_ && use_extra_memory_) {
+    compact_coeffs_ = true;
+  }
+  if (EstimateMemory() > max_memory_ && passes_ == 1) {
+    use_extra_memory_ = false;   // recompute the coefficients for each pass
+    compact_coeffs_ = false;
+  }
+  if (EstimateMemory() > max_memory_ && passes_ == 1 && !single_scan) {
+    reuse_run_levels_ = false;   // two scans
+  }
+  if (EstimateMemory() > max_memory_) pipelined_ = false;
+  if (EstimateMemory() > max_memory_ &&
+      SamplesMemory(true) < SamplesMemory(false)) {
+    // The samples are then produced in order, band after band.
+    stream_samples_ = true;
+    executor_ = nullptr;
+    num_threads_ = 1;
+  }
+  return (EstimateMemory() <= max_memory_);
+}
+
+void Encoder::ReportStats() {
+  if (stats_out_ == nullptr) return;
+  *stats_out_ = stats_;
+  stats_out_->peak_bytes = counting_memory_->peak();
+  stats_out_->num_allocs = counting_memory_->num_allocs();
+  stats_out_->copied_bytes = counting_memory_->copied();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // main call
 
-bool Encoder::Encode() {
+bool Encoder::StartEncoding(bool single_scan) {
   if (!ok_) return false;
 
-  FinalizeQuantMatrix(&quants_[0], q_bias_);
-  FinalizeQuantMatrix(&quants_[1], q_bias_);
+  FinalizeQuantizers();
   SetCostCodes(0);
   SetCostCodes(1);
 
@@ -409,7 +1059,25 @@ bool Encoder::Encode() {
 
   mb_w_ = (W_ + (block_w_ - 1)) / block_w_;
   mb_h_ = (H_ + (block_h_ - 1)) / block_h_;
-  const size_t nb_blocks = use_extra_memory_ ? mb_w_ * mb_h_ : 1;
+
+  if (!FitMemoryBudget(single_scan)) return SetError();
+  if (!PrepareSamples()) return SetError();
+
+  // One restart interval per thread. DRI stores the interval (in MCUs) on
+  // 16 bits, which can call for more bands than threads on wide pictures.
+  restart_rows_ = 0;
+  if (num_threads_ > 1 && mb_h_ > 1 && !pipelined_) {
+    int rows = (mb_h_ + num_threads_ - 1) / num_threads_;
+    rows = std::min(rows, 0xffff / mb_w_);
+    if (rows < mb_h_) restart_rows_ = rows;
+  }
+  size_t nb_blocks = use_extra_memory_ ? mb_w_ * mb_h_ : 1;
+  if (use_extra_memory_ && compact_coeffs_) {
+    nb_blocks = 3 * (size_t)mb_w_ * NumCollectBands();   // see RowCoeffs()
+    packed_rows_ = Alloc<uint8_t*>(mb_h_);
+    if (packed_rows_ == nullptr) return false;
+    for (int mb_y = 0; mb_y < mb_h_; ++mb_y) packed_rows_[mb_y] = nullptr;
+  }
   if (!AllocateBlocks(nb_blocks * mcu_blocks_)) return false;
 
   WriteAPP0();
@@ -418,7 +1086,11 @@ bool Encoder::Encode() {
   if (!WriteAPPMarkers(app_markers_)) return false;
 
   // metadata
-  if (!WriteEXIF(exif_) || !WriteICCP(iccp_) || !WriteXMP(xmp_)) return false;
+  return WriteEXIF(exif_) && WriteICCP(iccp_) && WriteXMP(xmp_);
+}
+
+bool Encoder::Encode() {
+  if (!StartEncoding()) return false;
 
   if (passes_ > 1) {
     LoopScan();
@@ -444,6 +1116,96 @@ bool Encoder::Encode() {
   ok_ = ok_ && bw_.Finalize();
 
   DeallocateBlocks();
+  ReportStats();
+  return ok_;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Row streaming: the MCU rows are coded one at a time, as soon as their
+// samples are available. Only the single-pass tools apply.
+
+bool Encoder::BeginStream() {
+  assert(!use_adaptive_quant_ && !use_extra_memory_ && passes_ == 1);
+  assert(executor_ == nullptr);
+  reuse_run_levels_ = optimize_size_;   // there's no going back to the rows
+  if (!StartEncoding(true)) return false;
+
+  WriteDQT();
+  WriteSOF();
+  // Optimized tables are only known at the end: till then, the run/levels
+  // are stored in all_run_levels_ and the DCTCoeffs in stream_coeffs_.
+  const size_t row_blocks = (size_t)mb_w_ * mcu_blocks_;
+  const size_t nb_blocks = optimize_size_ ? mb_h_ * row_blocks : row_blocks;
+  stream_coeffs_ = Alloc<DCTCoeffs>(nb_blocks);
+  stream_run_levels_ = Alloc<RunLevel>(64 * row_blocks);
+  stream_dcs_ = Alloc<int>(row_blocks);
+  if (!ok_) return false;
+  stats_.dct_coeffs_bytes = nb_blocks * sizeof(*stream_coeffs_);
+  for (int c = 0; c < MAX_COMP; ++c) stream_DCs_[c] = 0;
+  stream_row_ = 0;
+  if (optimize_size_) {
+    ResetEntropyStats();
+  } else {
+    WriteDHT();
+    WriteSOS();
+  }
+  return ok_;
+}
+
+bool Encoder::EncodeStreamRow() {
+  if (!ok_) return false;
+  if (stream_row_ >= mb_h_) return SetError();
+  const size_t row_blocks = (size_t)mb_w_ * mcu_blocks_;
+  DCTCoeffs* coeffs = stream_coeffs_;
+  if (optimize_size_) coeffs += stream_row_ * row_blocks;
+  QuantizeRow(stream_row_, coeffs, stream_run_levels_, stream_dcs_);
+  size_t pos = 0;
+  for (int mb_x = 0; mb_x < mb_w_; ++mb_x) {
+    RunLevel* mcu_run_levels = nullptr;
+    if (optimize_size_) {
+      mcu_run_levels = all_run_levels_.Reserve(memory_hook_);
+      if (mcu_run_levels == nullptr) return SetError();
+    } else if (!CheckBuffers()) {
+      return false;
+    }
+    for (int c = 0; c < nb_comps_; ++c) {
+      for (int i = 0; i < nb_blocks_[c]; ++i, ++pos) {
+        DCTCoeffs* const block = &coeffs[pos];
+        const RunLevel* const run_levels = stream_run_levels_ + 64 * pos;
+        block->dc_code_ = GenerateDCDiffCode(stream_dcs_[pos], &stream_DCs_[c]);
+        if (optimize_size_) {
+          AddEntropyStats(block, run_levels, freq_ac_, freq_dc_);
+          memcpy(mcu_run_levels, run_levels,
+                 block->nb_coeffs_ * sizeof(run_levels[0]));
+          mcu_run_levels += block->nb_coeffs_;
+          all_run_levels_.Add(block->nb_coeffs_);
+        } else {
+          CodeBlock(block, run_levels, &bw_);
+        }
+      }
+    }
+  }
+  ++stream_row_;
+  return optimize_size_ || EndRow(&bw_) || SetError();
+}
+
+bool Encoder::FinishStream() {
+  if (!ok_) return false;
+  if (stream_row_ != mb_h_) return SetError();
+  if (optimize_size_) {
+    stats_.run_levels_bytes = all_run_levels_.Bytes();
+    CompileEntropyStats();
+    WriteDHT();
+    WriteSOS();
+    FinalPassScan((size_t)mb_w_ * mb_h_ * mcu_blocks_, stream_coeffs_);
+  } else {
+    ok_ = ok_ && EndBand(0, &bw_);
+  }
+  WriteEOI();
+  ok_ = ok_ && bw_.Finalize();
+
+  DeallocateBlocks();
+  ReportStats();
   return ok_;
 }
 
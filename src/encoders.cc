@@ -20,6 +20,7 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <algorithm>
 #include <cstdlib>
 #include <new>
 
@@ -129,16 +130,17 @@ void Encoder::AverageExtraLuma(int sub_w, int sub_h, int16_t* out) {
 const uint8_t* Encoder::GetReplicatedSamples(const uint8_t* rgb,
                                              int rgb_step,
                                              int sub_w, int sub_h,
-                                             int w, int h) {
-  Replicate8b(rgb, rgb_step, replicated_buffer_, pix_step_ * w, sub_w, sub_h, w,
-              h, pix_step_);
-  return replicated_buffer_;
+                                             int w, int h,
+                                             uint8_t* const tmp) const {
+  Replicate8b(rgb, rgb_step, tmp, pix_step_ * w, sub_w, sub_h, w, h, pix_step_);
+  return tmp;
 }
 
 const uint8_t* Encoder::GetReplicatedYSamples(const uint8_t* in,
-                                              int step, int sub_w, int sub_h) {
-  Replicate8b(in, step, replicated_buffer_, 16, sub_w, sub_h, 16, 16, 1);
-  return replicated_buffer_;
+                                              int step, int sub_w, int sub_h,
+                                              uint8_t* const tmp) const {
+  Replicate8b(in, step, tmp, 16, sub_w, sub_h, 16, 16, 1);
+  return tmp;
 }
 
 // useful common function. Declared in sjpegi.h: api.cc calls it too.
@@ -170,9 +172,10 @@ class Encoder420 final : public Encoder {
   void GetSamples(int mb_x, int mb_y, bool clipped, int16_t* out) override {
     const uint8_t* rgb = rgb_ + (pix_step_ * mb_x + mb_y * step_) * 16;
     int step = step_;
+    uint8_t tmp[kReplicatedSize];
     if (clipped) {
       rgb = GetReplicatedSamples(rgb, step,
-                                 W_ - mb_x * 16, H_ - mb_y * 16, 16, 16);
+                                 W_ - mb_x * 16, H_ - mb_y * 16, 16, 16, tmp);
       step = pix_step_ * 16;
     }
     get_yuv_block_(rgb, step, out);
@@ -206,9 +209,10 @@ class Encoder444 final : public Encoder {
   void GetSamples(int mb_x, int mb_y, bool clipped, int16_t* out) override {
     const uint8_t* rgb = rgb_ + (pix_step_ * mb_x + mb_y * step_) * 8;
     int step = step_;
+    uint8_t tmp[kReplicatedSize];
     if (clipped) {
       rgb = GetReplicatedSamples(rgb, step,
-                                 W_ - mb_x * 8, H_ - mb_y * 8, 8, 8);
+                                 W_ - mb_x * 8, H_ - mb_y * 8, 8, 8, tmp);
       step = pix_step_ * 8;
     }
     get_yuv_block_(rgb, step, out);
@@ -239,9 +243,10 @@ class Encoder400 final : public Encoder {
   void GetSamples(int mb_x, int mb_y, bool clipped, int16_t* out) override {
     const uint8_t* rgb = rgb_ + (pix_step_ * mb_x + mb_y * step_) * 8;
     int step = step_;
+    uint8_t tmp[kReplicatedSize];
     if (clipped) {
       rgb = GetReplicatedSamples(rgb, step_,
-                                 W_ - mb_x * 8, H_ - mb_y * 8, 8, 8);
+                                 W_ - mb_x * 8, H_ - mb_y * 8, 8, 8, tmp);
       step = pix_step_ * 8;
     }
     get_yuv_block_(rgb, step, out);
@@ -297,8 +302,10 @@ class EncoderNV12 final : public Encoder {
   void GetYSamples(int mb_x, int mb_y, bool clipped, int16_t* out) {
     const uint8_t* Y1 = y_ + (mb_x + mb_y * y_step_) * 16;
     int y_step = y_step_;
+    uint8_t tmp[kReplicatedSize];
     if (clipped) {
-      Y1 = GetReplicatedYSamples(Y1, y_step, W_ - mb_x * 16, H_ - mb_y * 16);
+      Y1 = GetReplicatedYSamples(Y1, y_step, W_ - mb_x * 16, H_ - mb_y * 16,
+                                 tmp);
       y_step = 16;
     }
     const uint8_t* Y2 = Y1 + 8 * y_step;
@@ -454,10 +461,13 @@ class EncoderYUV420 : public Encoder {
 
   void GetSamples(int mb_x, int mb_y, bool clipped, int16_t* out) override {
     // Luma
-    const uint8_t* Y1 = y_ + (mb_x + mb_y * y_step_) * 16;
+    const int row = mb_y - mb_y0_;
+    const uint8_t* Y1 = y_ + (mb_x + row * y_step_) * 16;
     int y_step = y_step_;
+    uint8_t tmp[kReplicatedSize];
     if (clipped) {
-      Y1 = GetReplicatedYSamples(Y1, y_step,  W_ - mb_x * 16, H_ - mb_y * 16);
+      Y1 = GetReplicatedYSamples(Y1, y_step, W_ - mb_x * 16, H_ - mb_y * 16,
+                                 tmp);
       y_step = 16;
     }
     const uint8_t* const Y2 = Y1 + 8 * y_step;
@@ -469,8 +479,8 @@ class EncoderYUV420 : public Encoder {
       AverageExtraLuma(W_ - mb_x * 16, H_ - mb_y * 16, out);
     }
     // U/V
-    const uint8_t* U = u_ + (mb_x + mb_y * u_step_) * 8;
-    const uint8_t* V = v_ + (mb_x + mb_y * v_step_) * 8;
+    const uint8_t* U = u_ + (mb_x + row * u_step_) * 8;
+    const uint8_t* V = v_ + (mb_x + row * v_step_) * 8;
     if (clipped) {
       const int sub_w = ((W_ + 1) >> 1) - mb_x * 8;
       const int sub_h = ((H_ + 1) >> 1) - mb_y * 8;
@@ -487,6 +497,7 @@ class EncoderYUV420 : public Encoder {
   const uint8_t* u_;
   const uint8_t* v_;
   int y_step_, u_step_, v_step_;
+  int mb_y0_ = 0;   // first MCU row in the planes
 };
 
 bool EncodeYUV420(const uint8_t* Y, int Y_stride,
@@ -514,30 +525,78 @@ class EncoderSharp420 final : public EncoderYUV420 {
   EncoderSharp420(int W, int H, const uint8_t* const rgb, int step,
                   ByteSink* const sink, MemoryManager* const memory = nullptr)
       : EncoderYUV420(nullptr, 0, nullptr, 0, nullptr, 0, W, H, sink, memory),
-        yuv_memory_(nullptr) {
-    const int uv_w = (W + 1) >> 1;
-    const int uv_h = (H + 1) >> 1;
-    const size_t y_size = (size_t)W * H;
-    const size_t uv_size = (size_t)uv_w * uv_h;
-    yuv_memory_ = Alloc<uint8_t>(y_size + 2 * uv_size);
-    ok_ = (yuv_memory_ != nullptr);
-    if (ok_) {
-      y_ = yuv_memory_;
-      y_step_ = W;
-      u_ = yuv_memory_ + y_size;
-      v_ = u_ + uv_size;
-      u_step_ = uv_w;
-      v_step_ = uv_w;
-      ApplySharpYUVConversion(rgb, W, H, step,
-                              const_cast<uint8_t*>(y_),
-                              const_cast<uint8_t*>(u_),
-                              const_cast<uint8_t*>(v_));
-    }
+        rgb_(rgb), rgb_step_(step), yuv_memory_(nullptr),
+        y_size_(0), uv_size_(0), band_(-1) {
+    ok_ = (rgb_ != nullptr);   // the planes are allocated by PrepareSamples()
   }
   ~EncoderSharp420() override { Free(yuv_memory_); }
 
+  void GetSamples(int mb_x, int mb_y, bool clipped, int16_t* out) override {
+    if (stream_samples_) {   // convert the band on demand
+      const int band = mb_y / kBandMCURows;
+      if (band != band_) {
+        band_ = band;
+        mb_y0_ = band * kBandMCURows;
+        if (!ApplySharpYUVConversionBand(rgb_, W_, H_, rgb_step_, band,
+                                         yuv_memory_, yuv_memory_ + y_size_,
+                                         yuv_memory_ + y_size_ + uv_size_,
+                                         memory())) {
+          SetError();
+        }
+      }
+      if (!ok_) {
+        memset(out, 0, 6 * 64 * sizeof(*out));
+        return;
+      }
+    }
+    EncoderYUV420::GetSamples(mb_x, mb_y, clipped, out);
+  }
+
  protected:
+  enum { kBandMCURows = kSharpYUVBandRows / 16 };
+
+  // Number of rows in the planes, which hold a single band if 'streamed'.
+  int PlaneRows(bool streamed) const {
+    return streamed ? std::min(static_cast<int>(kSharpYUVBandRows), H_) : H_;
+  }
+  size_t SamplesMemory(bool streamed) const override {
+    const int rows = PlaneRows(streamed);
+    const size_t planes_size =
+        (size_t)W_ * rows + 2 * (size_t)((W_ + 1) >> 1) * ((rows + 1) >> 1);
+    // ApplySharpYUVConversion() may convert all the bands concurrently
+    const int nb_bands = (H_ + kSharpYUVBandRows - 1) / kSharpYUVBandRows;
+    const int nb_tasks = (!streamed && executor() != nullptr)
+                       ? std::min(nb_bands, static_cast<int>(kMaxThreads)) : 1;
+    return planes_size + nb_tasks * SharpYUVConversionMemory(W_, H_);
+  }
+
+  // The conversion waits for the executor, known after InitFromParam().
+  bool PrepareSamples() override {
+    const int rows = PlaneRows(stream_samples_);
+    const int uv_w = (W_ + 1) >> 1;
+    y_size_ = (size_t)W_ * rows;
+    uv_size_ = (size_t)uv_w * ((rows + 1) >> 1);
+    yuv_memory_ = Alloc<uint8_t>(y_size_ + 2 * uv_size_);
+    if (yuv_memory_ == nullptr) return false;
+    SetSamplesBytes(y_size_ + 2 * uv_size_);
+    y_ = yuv_memory_;
+    y_step_ = W_;
+    u_ = yuv_memory_ + y_size_;
+    v_ = u_ + uv_size_;
+    u_step_ = uv_w;
+    v_step_ = uv_w;
+    if (stream_samples_) return true;
+    return ApplySharpYUVConversion(rgb_, W_, H_, rgb_step_,
+                                   yuv_memory_, yuv_memory_ + y_size_,
+                                   yuv_memory_ + y_size_ + uv_size_,
+                                   memory(), executor());
+  }
+
+  const uint8_t* const rgb_;
+  const int rgb_step_;
   uint8_t* yuv_memory_;
+  size_t y_size_, uv_size_;
+  int band_;   // band held by the planes, if stream_samples_
 };
 
 ////////////////////////////////////////////////////////////////////////////////
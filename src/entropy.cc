@@ -152,23 +152,18 @@ uint16_t Encoder::GenerateDCDiffCode(int DC, int* const DC_predictor) {
 ////////////////////////////////////////////////////////////////////////////////
 // Code bitstream
 
-void Encoder::ResetDCs() {
-  for (int c = 0; c < nb_comps_; ++c) {
-    DCs_[c] = 0;
-  }
-}
-
 void Encoder::CodeBlock(const DCTCoeffs* const coeffs,
-                        const RunLevel* const rl) {
+                        const RunLevel* const rl,
+                        BitWriter* const bw) const {
   const int idx = coeffs->idx_;
   const int q_idx = quant_idx_[idx];
 
   // DC coefficient symbol
   const int dc_len = coeffs->dc_code_ & 0x0f;
   const uint32_t code = dc_codes_[q_idx][dc_len];
-  bw_.PutPackedCode(code);
+  bw->PutPackedCode(code);
   if (dc_len > 0) {
-    bw_.PutBits(coeffs->dc_code_ >> 4, dc_len);
+    bw->PutBits(coeffs->dc_code_ >> 4, dc_len);
   }
 
   // AC coeffs
@@ -176,7 +171,7 @@ void Encoder::CodeBlock(const DCTCoeffs* const coeffs,
   for (int i = 0; i < coeffs->nb_coeffs_; ++i) {
     int run = rl[i].run_;
     while (run & ~15) {        // escapes
-      bw_.PutPackedCode(codes[0xf0]);
+      bw->PutPackedCode(codes[0xf0]);
       run -= 16;
     }
     const uint32_t suffix = rl[i].level_;
@@ -186,14 +181,14 @@ void Encoder::CodeBlock(const DCTCoeffs* const coeffs,
     // here. The zero case is only reachable through the ZRL escape above.
     assert(n > 0);
 #if defined(SJPEG_HAVE_64BIT)
-    bw_.PutPackedCodeAndSuffix(codes[sym], suffix >> 4, n);
+    bw->PutPackedCodeAndSuffix(codes[sym], suffix >> 4, n);
 #else
-    bw_.PutPackedCode(codes[sym]);
-    bw_.PutBits(suffix >> 4, n);
+    bw->PutPackedCode(codes[sym]);
+    bw->PutBits(suffix >> 4, n);
 #endif
   }
   if (coeffs->last_ < 63) {     // EOB
-    bw_.PutPackedCode(codes[0x00]);
+    bw->PutPackedCode(codes[0x00]);
   }
 }
 
@@ -206,8 +201,10 @@ void Encoder::ResetEntropyStats() {
 }
 
 void Encoder::AddEntropyStats(const DCTCoeffs* const coeffs,
-                              const RunLevel* const run_levels) {
-  // freq_ac_[] and freq_dc_[] cannot overflow 32bits, since the maximum
+                              const RunLevel* const run_levels,
+                              uint32_t freq_ac[2][256 + 1],
+                              uint32_t freq_dc[2][12 + 1]) const {
+  // freq_ac[] and freq_dc[] cannot overflow 32bits, since the maximum
   // resolution allowed is 65535 * 65535. The sum of all frequencies cannot
   // be greater than 32bits, either.
   const int idx = coeffs->idx_;
@@ -215,29 +212,36 @@ void Encoder::AddEntropyStats(const DCTCoeffs* const coeffs,
   for (int i = 0; i < coeffs->nb_coeffs_; ++i) {
     const int run = run_levels[i].run_;
     const int tmp = (run >> 4);
-    if (tmp) freq_ac_[q_idx][0xf0] += tmp;  // count escapes (all at once)
+    if (tmp) freq_ac[q_idx][0xf0] += tmp;  // count escapes (all at once)
     const int suffix = run_levels[i].level_;
     const int sym = ((run & 0x0f) << 4) | (suffix & 0x0f);
-    ++freq_ac_[q_idx][sym];
+    ++freq_ac[q_idx][sym];
   }
   if (coeffs->last_ < 63) {     // EOB
-    ++freq_ac_[q_idx][0x00];
+    ++freq_ac[q_idx][0x00];
   }
-  ++freq_dc_[q_idx][coeffs->dc_code_ & 0x0f];
+  ++freq_dc[q_idx][coeffs->dc_code_ & 0x0f];
 }
 
 // Same total as BlocksSize(), minus uncounted 0xff byte-stuffing
 size_t Encoder::EntropySize() const {
+  return EntropySize(freq_ac_, freq_dc_, dc_codes_, ac_codes_);
+}
+
+size_t Encoder::EntropySize(const uint32_t freq_ac[2][256 + 1],
+                            const uint32_t freq_dc[2][12 + 1],
+                            const uint32_t dc_codes[2][12],
+                            const uint32_t ac_codes[2][256]) const {
   size_t size = 0;
   const int nb_tables = (nb_comps_ == 1) ? 1 : 2;
   for (int q = 0; q < nb_tables; ++q) {
     for (int len = 0; len < 12; ++len) {
-      const uint32_t freq = freq_dc_[q][len];
-      if (freq > 0) size += freq * ((dc_codes_[q][len] & 0xff) + len);
+      const uint32_t freq = freq_dc[q][len];
+      if (freq > 0) size += freq * ((dc_codes[q][len] & 0xff) + len);
     }
-    const uint32_t* const codes = ac_codes_[q];
+    const uint32_t* const codes = ac_codes[q];
     for (int sym = 0; sym < 256; ++sym) {
-      const uint32_t freq = freq_ac_[q][sym];
+      const uint32_t freq = freq_ac[q][sym];
       if (freq > 0) size += freq * ((codes[sym] & 0xff) + (sym & 0x0f));
     }
   }
@@ -443,4 +447,24 @@ void Encoder::CompileEntropyStats() {
   }
 }
 
+size_t Encoder::OptimizedSize(const uint32_t freq_ac[2][256 + 1],
+                              const uint32_t freq_dc[2][12 + 1]) const {
+  // same as CompileEntropyStats() + InitCodes(), but with local tables
+  HuffmanTable tables_dc[2], tables_ac[2];
+  uint8_t syms_dc[2][12], syms_ac[2][256];
+  uint32_t dc_codes[2][12], ac_codes[2][256];
+  const HuffmanTable* tables[4] = { nullptr, nullptr, nullptr, nullptr };
+  for (int q_idx = 0; q_idx < (nb_comps_ == 1 ? 1 : 2); ++q_idx) {
+    tables_dc[q_idx].syms_ = syms_dc[q_idx];
+    BuildOptimalTable(&tables_dc[q_idx], freq_dc[q_idx], 12);
+    BuildHuffmanTable(tables_dc[q_idx].bits_, syms_dc[q_idx], dc_codes[q_idx]);
+    tables[q_idx] = &tables_dc[q_idx];
+    tables_ac[q_idx].syms_ = syms_ac[q_idx];
+    BuildOptimalTable(&tables_ac[q_idx], freq_ac[q_idx], 256);
+    BuildHuffmanTable(tables_ac[q_idx].bits_, syms_ac[q_idx], ac_codes[q_idx]);
+    tables[2 + q_idx] = &tables_ac[q_idx];
+  }
+  return HeaderSize(tables) + EntropySize(freq_ac, freq_dc, dc_codes, ac_codes);
+}
+
 }    // namespace sjpeg
@@ -20,6 +20,7 @@
 
 #define SJPEG_NEED_ASM_HEADERS
 #include "sjpegi.h"
+#include "fdct.h"
 
 namespace sjpeg {
 
@@ -34,115 +35,6 @@ const int16_t kTable26[7] = { 29692, 27969, 25172, 21407, 16819, 11585, 5906 };
 // rows #3 and #5 are pre-multiplied by 2.C(3):
 const int16_t kTable35[7] = { 26722, 25172, 22654, 19266, 15137, 10426, 5315 };
 
-///////////////////////////////////////////////////////////////////////////////
-// Constants and C/SSE2 macros for IDCT vertical pass
-
-#define kTan1   (13036)   // = tan(pi/16)
-#define kTan2   (27146)   // = tan(2.pi/16) = sqrt(2) - 1.
-#define kTan3m1 (-21746)  // = tan(3.pi/16) - 1
-#define k2Sqrt2 (23170)   // = 1 / 2.sqrt(2)
-
-  // performs: {a,b} <- {a-b, a+b}, without saturation
-#define BUTTERFLY(a, b) do {   \
-  SUB((a), (b));               \
-  ADD((b), (b));               \
-  ADD((b), (a));               \
-} while (0)
-
-///////////////////////////////////////////////////////////////////////////////
-// Constants for DCT horizontal pass
-
-// Note about the CORRECT_LSB macro:
-// using 16bit fixed-point constants, we often compute products like:
-// p = (A*x + B*y + 32768) >> 16 by adding two sub-terms q = (A*x) >> 16
-// and r = (B*y) >> 16 together. Statistically, we have p = q + r + 1
-// in 3/4 of the cases. This can be easily seen from the relation:
-//   (a + b + 1) >> 1 = (a >> 1) + (b >> 1) + ((a|b)&1)
-// The approximation we are doing is replacing ((a|b)&1) by 1.
-// In practice, this is a slightly more involved because the constants A and B
-// have also been rounded compared to their exact floating point value.
-// However, all in all the correction is quite small, and CORRECT_LSB can
-// be defined empty if needed.
-
-#define COLUMN_DCT8(in) do { \
-  LOAD(m0, (in)[0 * 8]);     \
-  LOAD(m2, (in)[2 * 8]);     \
-  LOAD(m7, (in)[7 * 8]);     \
-  LOAD(m5, (in)[5 * 8]);     \
-                             \
-  BUTTERFLY(m0, m7);         \
-  BUTTERFLY(m2, m5);         \
-                             \
-  LOAD(m3, (in)[3 * 8]);     \
-  LOAD(m4, (in)[4 * 8]);     \
-  BUTTERFLY(m3, m4);         \
-                             \
-  LOAD(m6, (in)[6 * 8]);     \
-  LOAD(m1, (in)[1 * 8]);     \
-  BUTTERFLY(m1, m6);         \
-  BUTTERFLY(m7, m4);         \
-  BUTTERFLY(m6, m5);         \
-                             \
-  /* RowIdct() needs 15bits fixed-point input, when the output from   */ \
-  /* ColumnIdct() would be 12bits. We are better doing the shift by 3 */ \
-  /* now instead of in RowIdct(), because we have some multiplies to  */ \
-  /* perform, that can take advantage of the extra 3bits precision.   */ \
-  LSHIFT(m4, 3);             \
-  LSHIFT(m5, 3);             \
-  BUTTERFLY(m4, m5);         \
-  STORE16((in)[0 * 8], m5);  \
-  STORE16((in)[4 * 8], m4);  \
-                             \
-  LSHIFT(m7, 3);             \
-  LSHIFT(m6, 3);             \
-  LSHIFT(m3, 3);             \
-  LSHIFT(m0, 3);             \
-                             \
-  LOAD_CST(m4, kTan2);       \
-  m5 = m4;                   \
-  MULT(m4, m7);              \
-  MULT(m5, m6);              \
-  SUB(m4, m6);               \
-  ADD(m5, m7);               \
-  STORE16((in)[2 * 8], m5);  \
-  STORE16((in)[6 * 8], m4);  \
-                             \
-  /* We should be multiplying m6 by C4 = 1/sqrt(2) here, but we only have */ \
-  /* the k2Sqrt2 = 1/(2.sqrt(2)) constant that fits into 15bits. So we    */ \
-  /* shift by 4 instead of 3 to compensate for the additional 1/2 factor. */ \
-  LOAD_CST(m6, k2Sqrt2);     \
-  LSHIFT(m2, 3 + 1);         \
-  LSHIFT(m1, 3 + 1);         \
-  BUTTERFLY(m1, m2);         \
-  MULT(m2, m6);              \
-  MULT(m1, m6);              \
-  BUTTERFLY(m3, m1);         \
-  BUTTERFLY(m0, m2);         \
-                             \
-  LOAD_CST(m4, kTan3m1);     \
-  LOAD_CST(m5, kTan1);       \
-  m7 = m3;                   \
-  m6 = m1;                   \
-  MULT(m3, m4);              \
-  MULT(m1, m5);              \
-                             \
-  ADD(m3, m7);               \
-  ADD(m1, m2);               \
-  CORRECT_LSB(m1);           \
-  CORRECT_LSB(m3);           \
-  MULT(m4, m0);              \
-  MULT(m5, m2);              \
-  ADD(m4, m0);               \
-  SUB(m0, m3);               \
-  ADD(m7, m4);               \
-  SUB(m5, m6);               \
-                             \
-  STORE16((in)[1 * 8], m1);  \
-  STORE16((in)[3 * 8], m0);  \
-  STORE16((in)[5 * 8], m7);  \
-  STORE16((in)[7 * 8], m5);  \
-} while (0)
-
 ///////////////////////////////////////////////////////////////////////////////
 // Plain-C implementation, bit-wise equivalent to the SSE2 version
 
@@ -236,27 +128,24 @@ static const union {
   CST_kfRounder1 = CST(1);  // rounders for fdct
 #undef CST
 
-static const union {
-  const uint16_t s[4 * 8];
-  const __m128i m[4];
-} kfTables_SSE2[4] = {
+alignas(16) const uint16_t kfTables[4][4 * 8] = {
     // Tables for fdct, roughly the transposed of the above, shuffled
-    { { 0x4000, 0x4000, 0x58c5, 0x4b42, 0xdd5d, 0xac61, 0xa73b, 0xcdb7,
-        0x4000, 0x4000, 0x3249, 0x11a8, 0x539f, 0x22a3, 0x4b42, 0xee58,
-        0x4000, 0xc000, 0x3249, 0xa73b, 0x539f, 0xdd5d, 0x4b42, 0xa73b,
-        0xc000, 0x4000, 0x11a8, 0x4b42, 0x22a3, 0xac61, 0x11a8, 0xcdb7 } },
-    { { 0x58c5, 0x58c5, 0x7b21, 0x6862, 0xcff5, 0x8c04, 0x84df, 0xba41,
-        0x58c5, 0x58c5, 0x45bf, 0x187e, 0x73fc, 0x300b, 0x6862, 0xe782,
-        0x58c5, 0xa73b, 0x45bf, 0x84df, 0x73fc, 0xcff5, 0x6862, 0x84df,
-        0xa73b, 0x58c5, 0x187e, 0x6862, 0x300b, 0x8c04, 0x187e, 0xba41 } },
-    { { 0x539f, 0x539f, 0x73fc, 0x6254, 0xd2bf, 0x92bf, 0x8c04, 0xbe4d,
-        0x539f, 0x539f, 0x41b3, 0x1712, 0x6d41, 0x2d41, 0x6254, 0xe8ee,
-        0x539f, 0xac61, 0x41b3, 0x8c04, 0x6d41, 0xd2bf, 0x6254, 0x8c04,
-        0xac61, 0x539f, 0x1712, 0x6254, 0x2d41, 0x92bf, 0x1712, 0xbe4d } },
-    { { 0x4b42, 0x4b42, 0x6862, 0x587e, 0xd746, 0x9dac, 0x979e, 0xc4df,
-        0x4b42, 0x4b42, 0x3b21, 0x14c3, 0x6254, 0x28ba, 0x587e, 0xeb3d,
-        0x4b42, 0xb4be, 0x3b21, 0x979e, 0x6254, 0xd746, 0x587e, 0x979e,
-        0xb4be, 0x4b42, 0x14c3, 0x587e, 0x28ba, 0x9dac, 0x14c3, 0xc4df } } };
+    { 0x4000, 0x4000, 0x58c5, 0x4b42, 0xdd5d, 0xac61, 0xa73b, 0xcdb7,
+      0x4000, 0x4000, 0x3249, 0x11a8, 0x539f, 0x22a3, 0x4b42, 0xee58,
+      0x4000, 0xc000, 0x3249, 0xa73b, 0x539f, 0xdd5d, 0x4b42, 0xa73b,
+      0xc000, 0x4000, 0x11a8, 0x4b42, 0x22a3, 0xac61, 0x11a8, 0xcdb7 },
+    { 0x58c5, 0x58c5, 0x7b21, 0x6862, 0xcff5, 0x8c04, 0x84df, 0xba41,
+      0x58c5, 0x58c5, 0x45bf, 0x187e, 0x73fc, 0x300b, 0x6862, 0xe782,
+      0x58c5, 0xa73b, 0x45bf, 0x84df, 0x73fc, 0xcff5, 0x6862, 0x84df,
+      0xa73b, 0x58c5, 0x187e, 0x6862, 0x300b, 0x8c04, 0x187e, 0xba41 },
+    { 0x539f, 0x539f, 0x73fc, 0x6254, 0xd2bf, 0x92bf, 0x8c04, 0xbe4d,
+      0x539f, 0x539f, 0x41b3, 0x1712, 0x6d41, 0x2d41, 0x6254, 0xe8ee,
+      0x539f, 0xac61, 0x41b3, 0x8c04, 0x6d41, 0xd2bf, 0x6254, 0x8c04,
+      0xac61, 0x539f, 0x1712, 0x6254, 0x2d41, 0x92bf, 0x1712, 0xbe4d },
+    { 0x4b42, 0x4b42, 0x6862, 0x587e, 0xd746, 0x9dac, 0x979e, 0xc4df,
+      0x4b42, 0x4b42, 0x3b21, 0x14c3, 0x6254, 0x28ba, 0x587e, 0xeb3d,
+      0x4b42, 0xb4be, 0x3b21, 0x979e, 0x6254, 0xd746, 0x587e, 0x979e,
+      0xb4be, 0x4b42, 0x14c3, 0x587e, 0x28ba, 0x9dac, 0x14c3, 0xc4df } };
 
 #define LOAD_CST(x, y)  (x) = (CST_ ## y).m
 #define LOAD(x, y)      \
@@ -610,12 +499,14 @@ static void FdctC(int16_t* coeffs, int num_blocks) {
 
 #if defined(SJPEG_USE_SSE2)
 static void FdctSSE2(int16_t* coeffs, int num_blocks) {
+  const __m128i (*const kTables)[4] =
+      reinterpret_cast<const __m128i (*)[4]>(kfTables);
   while (num_blocks-- > 0) {
     ColumnDct_SSE2(coeffs);
-    RowDct_SSE2(coeffs + 0 * 8, kfTables_SSE2[0].m, kfTables_SSE2[1].m);
-    RowDct_SSE2(coeffs + 2 * 8, kfTables_SSE2[2].m, kfTables_SSE2[3].m);
-    RowDct_SSE2(coeffs + 4 * 8, kfTables_SSE2[0].m, kfTables_SSE2[3].m);
-    RowDct_SSE2(coeffs + 6 * 8, kfTables_SSE2[2].m, kfTables_SSE2[1].m);
+    RowDct_SSE2(coeffs + 0 * 8, kTables[0], kTables[1]);
+    RowDct_SSE2(coeffs + 2 * 8, kTables[2], kTables[3]);
+    RowDct_SSE2(coeffs + 4 * 8, kTables[0], kTables[3]);
+    RowDct_SSE2(coeffs + 6 * 8, kTables[2], kTables[1]);
     coeffs += 64;
   }
 }
@@ -623,6 +514,9 @@ static void FdctSSE2(int16_t* coeffs, int num_blocks) {
 
 FdctFunc GetFdct() {
 #if defined(SJPEG_USE_SSE2)
+#if defined(SJPEG_USE_AVX2)
+  if (SupportsAVX2()) return FdctAVX2;
+#endif
   if (SupportsSSE2()) return FdctSSE2;
 #elif defined(SJPEG_USE_NEON)
   if (SupportsNEON()) return FdctNEON;
@@ -0,0 +1,146 @@
+// Copyright 2026 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//  forward DCT: macros shared by fdct.cc and fdct_avx2.cc
+//
+// The column pass is written once with the LOAD / STORE16 / MULT / ADD...
+// primitives, that each implementation defines before expanding
+// COLUMN_DCT8(), and #undef's afterward.
+
+#ifndef SJPEG_FDCT_H_
+#define SJPEG_FDCT_H_
+
+#include <stdint.h>
+
+namespace sjpeg {
+
+///////////////////////////////////////////////////////////////////////////////
+// Constants and C/SIMD macros for the DCT vertical pass
+
+#define kTan1   (13036)   // = tan(pi/16)
+#define kTan2   (27146)   // = tan(2.pi/16) = sqrt(2) - 1.
+#define kTan3m1 (-21746)  // = tan(3.pi/16) - 1
+#define k2Sqrt2 (23170)   // = 1 / 2.sqrt(2)
+
+  // performs: {a,b} <- {a-b, a+b}, without saturation
+#define BUTTERFLY(a, b) do {   \
+  SUB((a), (b));               \
+  ADD((b), (b));               \
+  ADD((b), (a));               \
+} while (0)
+
+///////////////////////////////////////////////////////////////////////////////
+// Constants for DCT horizontal pass
+
+// Note about the CORRECT_LSB macro:
+// using 16bit fixed-point constants, we often compute products like:
+// p = (A*x + B*y + 32768) >> 16 by adding two sub-terms q = (A*x) >> 16
+// and r = (B*y) >> 16 together. Statistically, we have p = q + r + 1
+// in 3/4 of the cases. This can be easily seen from the relation:
+//   (a + b + 1) >> 1 = (a >> 1) + (b >> 1) + ((a|b)&1)
+// The approximation we are doing is replacing ((a|b)&1) by 1.
+// In practice, this is a slightly more involved because the constants A and B
+// have also been rounded compared to their exact floating point value.
+// However, all in all the correction is quite small, and CORRECT_LSB can
+// be defined empty if needed.
+
+#define COLUMN_DCT8(in) do { \
+  LOAD(m0, (in)[0 * 8]);     \
+  LOAD(m2, (in)[2 * 8]);     \
+  LOAD(m7, (in)[7 * 8]);     \
+  LOAD(m5, (in)[5 * 8]);     \
+                             \
+  BUTTERFLY(m0, m7);         \
+  BUTTERFLY(m2, m5);         \
+                             \
+  LOAD(m3, (in)[3 * 8]);     \
+  LOAD(m4, (in)[4 * 8]);     \
+  BUTTERFLY(m3, m4);         \
+                             \
+  LOAD(m6, (in)[6 * 8]);     \
+  LOAD(m1, (in)[1 * 8]);     \
+  BUTTERFLY(m1, m6);         \
+  BUTTERFLY(m7, m4);         \
+  BUTTERFLY(m6, m5);         \
+                             \
+  /* RowIdct() needs 15bits fixed-point input, when the output from   */ \
+  /* ColumnIdct() would be 12bits. We are better doing the shift by 3 */ \
+  /* now instead of in RowIdct(), because we have some multiplies to  */ \
+  /* perform, that can take advantage of the extra 3bits precision.   */ \
+  LSHIFT(m4, 3);             \
+  LSHIFT(m5, 3);             \
+  BUTTERFLY(m4, m5);         \
+  STORE16((in)[0 * 8], m5);  \
+  STORE16((in)[4 * 8], m4);  \
+                             \
+  LSHIFT(m7, 3);             \
+  LSHIFT(m6, 3);             \
+  LSHIFT(m3, 3);             \
+  LSHIFT(m0, 3);             \
+                             \
+  LOAD_CST(m4, kTan2);       \
+  m5 = m4;                   \
+  MULT(m4, m7);              \
+  MULT(m5, m6);              \
+  SUB(m4, m6);               \
+  ADD(m5, m7);               \
+  STORE16((in)[2 * 8], m5);  \
+  STORE16((in)[6 * 8], m4);  \
+                             \
+  /* We should be multiplying m6 by C4 = 1/sqrt(2) here, but we only have */ \
+  /* the k2Sqrt2 = 1/(2.sqrt(2)) constant that fits into 15bits. So we    */ \
+  /* shift by 4 instead of 3 to compensate for the additional 1/2 factor. */ \
+  LOAD_CST(m6, k2Sqrt2);     \
+  LSHIFT(m2, 3 + 1);         \
+  LSHIFT(m1, 3 + 1);         \
+  BUTTERFLY(m1, m2);         \
+  MULT(m2, m6);              \
+  MULT(m1, m6);              \
+  BUTTERFLY(m3, m1);         \
+  BUTTERFLY(m0, m2);         \
+                             \
+  LOAD_CST(m4, kTan3m1);     \
+  LOAD_CST(m5, kTan1);       \
+  m7 = m3;                   \
+  m6 = m1;                   \
+  MULT(m3, m4);              \
+  MULT(m1, m5);              \
+                             \
+  ADD(m3, m7);               \
+  ADD(m1, m2);               \
+  CORRECT_LSB(m1);           \
+  CORRECT_LSB(m3);           \
+  MULT(m4, m0);              \
+  MULT(m5, m2);              \
+  ADD(m4, m0);               \
+  SUB(m0, m3);               \
+  ADD(m7, m4);               \
+  SUB(m5, m6);               \
+                             \
+  STORE16((in)[1 * 8], m1);  \
+  STORE16((in)[3 * 8], m0);  \
+  STORE16((in)[5 * 8], m7);  \
+  STORE16((in)[7 * 8], m5);  \
+} while (0)
+
+#if defined(SJPEG_USE_SSE2)
+// Tables for the SSE2 and AVX2 horizontal pass (in fdct.cc), one for each
+// row scaling: rows #0/#4, #1/#7, #2/#6 and #3/#5. Each is four 128bit
+// vectors.
+extern const uint16_t kfTables[4][4 * 8];
+#endif
+
+}     // namespace sjpeg
+
+#endif    // SJPEG_FDCT_H_
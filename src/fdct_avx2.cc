@@ -0,0 +1,144 @@
+// Copyright 2026 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//  forward DCT, AVX2 version
+//
+// Two blocks are transformed at once: the first one in the low 128bit lane,
+// the second one in the high lane. All the operations of the SSE2 version
+// work per-lane, so the output is the same, bit-wise.
+
+#define SJPEG_NEED_ASM_HEADERS
+#include "sjpegi.h"
+#include "fdct.h"
+
+namespace sjpeg {
+
+#if defined(SJPEG_USE_AVX2)
+
+// Row #i of the blocks 'src' and 'src + step'. With step = 0, both lanes
+// hold the same block.
+static inline __m256i LoadRows(const int16_t* const src, int step) {
+  const __m128i lo = _mm_load_si128(reinterpret_cast<const __m128i*>(src));
+  const __m128i hi =
+      _mm_load_si128(reinterpret_cast<const __m128i*>(src + step));
+  return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+static inline void StoreRows(int16_t* const dst, int step, const __m256i v) {
+  _mm_store_si128(reinterpret_cast<__m128i*>(dst + step),
+                  _mm256_extracti128_si256(v, 1));
+  _mm_store_si128(reinterpret_cast<__m128i*>(dst),
+                  _mm256_castsi256_si128(v));
+}
+
+static inline __m256i LoadTable(const uint16_t* const table, int i) {
+  return _mm256_broadcastsi128_si256(
+      _mm_load_si128(reinterpret_cast<const __m128i*>(table) + i));
+}
+
+#define LOAD_CST(x, y)  (x) = _mm256_set1_epi16(y)
+#define LOAD(x, y)      (x) = LoadRows(&(y), step)
+#define MULT(x, y)      (x) = _mm256_mulhi_epi16((x), (y))
+#define ADD(x, y)       (x) = _mm256_add_epi16((x), (y))
+#define SUB(x, y)       (x) = _mm256_sub_epi16((x), (y))
+#define LSHIFT(x, n)    (x) = _mm256_slli_epi16((x), (n))
+#define STORE16(a, b)   StoreRows(&(a), step, (b))
+#define CORRECT_LSB(a)  (a) = _mm256_adds_epi16((a), _mm256_set1_epi16(1))
+
+// DCT vertical pass
+
+static void ColumnDct_AVX2(int16_t* in, int step) {
+  __m256i m0, m1, m2, m3, m4, m5, m6, m7;
+  COLUMN_DCT8(in);
+}
+
+#undef LOAD_CST
+#undef LOAD
+#undef MULT
+#undef ADD
+#undef SUB
+#undef LSHIFT
+#undef STORE16
+#undef CORRECT_LSB
+#undef BUTTERFLY
+#undef COLUMN_DCT8
+
+// DCT horizontal pass, for the two rows at 'in' (see RowDct_SSE2())
+
+static void RowDct_AVX2(int16_t* in, int step,
+                        const uint16_t* table1, const uint16_t* table2) {
+  // load row [0123|4567] as [0123|7654]
+  __m256i m0 = _mm256_shufflehi_epi16(LoadRows(in + 0 * 8, step), 0x1b);
+  __m256i m2 = _mm256_shufflehi_epi16(LoadRows(in + 1 * 8, step), 0x1b);
+
+  // => x7 x6 x5 x4 | x7' x6' x5' x4'
+  __m256i m4 = _mm256_castps_si256(
+      _mm256_shuffle_ps(_mm256_castsi256_ps(m0), _mm256_castsi256_ps(m2),
+                        0xee));
+  // => x0 x1 x2 x3 | x0' x1' x2' x3'
+  m0 = _mm256_castps_si256(
+      _mm256_shuffle_ps(_mm256_castsi256_ps(m0), _mm256_castsi256_ps(m2),
+                        0x44));
+
+  // initial butterfly
+  m2 = _mm256_sub_epi16(m0, m4);  // b0=x0-x7 | b1=x1-x6 | b2=x2-x5 | b3=x3-x4
+  m0 = _mm256_add_epi16(m0, m4);  // a0=x0+x7 | a1=x1+x6 | a2=x2+x5 | a3=x3+x4
+
+  // prepare for scalar products which are performed using four madd_epi16
+  m4 = _mm256_unpackhi_epi32(m0, m2);
+  m0 = _mm256_unpacklo_epi32(m0, m2);  // a0 a1 | b0 b1 | a2 a3 | b2 b3
+  m2 = _mm256_shuffle_epi32(m0, 0x4e);  // a2 a3 | b2 b3 | a0 a1 | b0 b1
+  __m256i m6 = _mm256_shuffle_epi32(m4, 0x4e);
+
+  const __m256i m1 = _mm256_madd_epi16(m2, LoadTable(table1, 1));
+  const __m256i m3 = _mm256_madd_epi16(m0, LoadTable(table1, 2));
+  const __m256i m5 = _mm256_madd_epi16(m6, LoadTable(table2, 1));
+  const __m256i m7 = _mm256_madd_epi16(m4, LoadTable(table2, 2));
+
+  m2 = _mm256_madd_epi16(m2, LoadTable(table1, 3));
+  m0 = _mm256_madd_epi16(m0, LoadTable(table1, 0));
+  m6 = _mm256_madd_epi16(m6, LoadTable(table2, 3));
+  m4 = _mm256_madd_epi16(m4, LoadTable(table2, 0));
+
+  // add the sub-terms and descale
+  m0 = _mm256_srai_epi32(_mm256_add_epi32(m0, m1), 16);
+  m4 = _mm256_srai_epi32(_mm256_add_epi32(m4, m5), 16);
+  m2 = _mm256_srai_epi32(_mm256_add_epi32(m2, m3), 16);
+  m6 = _mm256_srai_epi32(_mm256_add_epi32(m6, m7), 16);
+
+  StoreRows(in + 0 * 8, step, _mm256_packs_epi32(m0, m2));
+  StoreRows(in + 1 * 8, step, _mm256_packs_epi32(m4, m6));
+}
+
+static void Dct2_AVX2(int16_t* coeffs, int step) {
+  ColumnDct_AVX2(coeffs, step);
+  RowDct_AVX2(coeffs + 0 * 8, step, kfTables[0], kfTables[1]);
+  RowDct_AVX2(coeffs + 2 * 8, step, kfTables[2], kfTables[3]);
+  RowDct_AVX2(coeffs + 4 * 8, step, kfTables[0], kfTables[3]);
+  RowDct_AVX2(coeffs + 6 * 8, step, kfTables[2], kfTables[1]);
+}
+
+void FdctAVX2(int16_t* coeffs, int num_blocks) {
+  for (; num_blocks >= 2; num_blocks -= 2) {
+    Dct2_AVX2(coeffs, 64);
+    coeffs += 2 * 64;
+  }
+  // An odd last block goes in both lanes. All rows are loaded before any
+  // is stored, so the two identical results can overwrite each other.
+  if (num_blocks > 0) Dct2_AVX2(coeffs, 0);
+}
+
+#endif    // SJPEG_USE_AVX2
+
+}     // namespace sjpeg
@@ -0,0 +1,155 @@
+// Copyright 2026 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//  Sinks writing to a file descriptor: MakeFdSink(), MakeMmapFileSink()
+//
+
+#include <assert.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <memory>
+#include <new>
+
+#include "sjpeg.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SJPEG_HAVE_FD_SINKS
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+namespace sjpeg {
+
+#if defined(SJPEG_HAVE_FD_SINKS)
+
+namespace {
+
+const size_t kMinBufferSize = 64 << 10;   // FdSink
+const size_t kMinMapSize = 256 << 10;     // MmapFileSink
+
+// The committed bytes pile up in a buffer that is written out whenever the
+// next reservation doesn't fit, or nothing more is reserved: the latter is
+// what BitWriter::CommitBytes() and BitWriter::Finalize() do. The buffer is
+// reused from the start after each write, and never zero-filled.
+class FdSink : public ByteSink {
+ public:
+  explicit FdSink(int fd) : fd_(fd), buf_(nullptr), pos_(0), max_pos_(0) {}
+  ~FdSink() override { delete[] buf_; }
+
+  bool Commit(size_t used_size, size_t extra_size, uint8_t** data) override {
+    pos_ += used_size;
+    assert(pos_ <= max_pos_);
+    if (extra_size == 0 || pos_ + extra_size > max_pos_) {
+      if (!WriteOut()) return false;
+      if (extra_size > max_pos_) {
+        delete[] buf_;
+        max_pos_ = std::max(extra_size, kMinBufferSize);
+        buf_ = new (std::nothrow) uint8_t[max_pos_];
+        if (buf_ == nullptr) {
+          max_pos_ = 0;
+          return false;
+        }
+      }
+    }
+    *data = buf_ + pos_;
+    return true;
+  }
+  bool Finalize() override { return WriteOut(); }
+  void Reset() override { pos_ = 0; }   // bytes already written stay there
+
+ private:
+  bool WriteOut() {
+    size_t done = 0;
+    while (done < pos_) {
+      const ssize_t n = write(fd_, buf_ + done, pos_ - done);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      done += static_cast<size_t>(n);
+    }
+    pos_ = 0;
+    return true;
+  }
+
+  const int fd_;
+  uint8_t* buf_;
+  size_t pos_, max_pos_;
+};
+
+// The file is grown with ftruncate() and mapped whole: the encoder writes
+// straight into the mapping. It's trimmed to the final size in Finalize().
+class MmapFileSink : public ByteSink {
+ public:
+  explicit MmapFileSink(int fd) : fd_(fd), map_(nullptr), pos_(0), size_(0) {}
+  ~MmapFileSink() override { Unmap(); }
+
+  bool Commit(size_t used_size, size_t extra_size, uint8_t** data) override {
+    pos_ += used_size;
+    assert(pos_ <= size_);
+    if (pos_ + extra_size > size_) {
+      const size_t new_size =
+          std::max(std::max(pos_ + extra_size, 2 * size_), kMinMapSize);
+      Unmap();
+      if (ftruncate(fd_, static_cast<off_t>(new_size)) != 0) return false;
+      void* const map = mmap(nullptr, new_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd_, 0);
+      if (map == MAP_FAILED) return false;
+      map_ = static_cast<uint8_t*>(map);
+      size_ = new_size;
+    }
+    *data = map_ + pos_;
+    return true;
+  }
+  bool Finalize() override {
+    Unmap();
+    return (ftruncate(fd_, static_cast<off_t>(pos_)) == 0);
+  }
+  void Reset() override {
+    Unmap();
+    pos_ = 0;
+    (void)ftruncate(fd_, 0);
+  }
+
+ private:
+  void Unmap() {
+    if (map_ != nullptr) munmap(map_, size_);
+    map_ = nullptr;
+    size_ = 0;
+  }
+
+  const int fd_;
+  uint8_t* map_;
+  size_t pos_, size_;
+};
+
+}   // namespace
+
+std::shared_ptr<ByteSink> MakeFdSink(int fd) {
+  return std::shared_ptr<ByteSink>(new (std::nothrow) FdSink(fd));
+}
+
+std::shared_ptr<ByteSink> MakeMmapFileSink(int fd) {
+  return std::shared_ptr<ByteSink>(new (std::nothrow) MmapFileSink(fd));
+}
+
+#else    // !SJPEG_HAVE_FD_SINKS
+
+std::shared_ptr<ByteSink> MakeFdSink(int) { return nullptr; }
+std::shared_ptr<ByteSink> MakeMmapFileSink(int) { return nullptr; }
+
+#endif   // SJPEG_HAVE_FD_SINKS
+
+}   // namespace sjpeg
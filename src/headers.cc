@@ -239,7 +239,20 @@ void Encoder::WriteDHT() {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+void Encoder::WriteDRI() {   // DRI
+  if (restart_rows_ == 0) return;
+  const uint32_t interval = restart_rows_ * mb_w_;   // in MCU units
+  assert(interval > 0 && interval <= 0xffff);
+  const uint8_t kHeader[] = {
+    0xff, 0xdd, DATA_16b(4), DATA_16b(interval)
+  };
+  ok_ = ok_ && bw_.Reserve(sizeof(kHeader));
+  if (!ok_) return;
+  bw_.PutBytes(kHeader, sizeof(kHeader));
+}
+
 void Encoder::WriteSOS() {   // SOS
+  WriteDRI();   // the restart interval applies to the scan that follows
   const size_t data_size = 3 + nb_comps_ * 2 + 3;
   assert(data_size <= 255);
   const uint8_t kHeader[] = {
@@ -21,6 +21,9 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <algorithm>
+#include <vector>
+
 #define SJPEG_NEED_ASM_HEADERS
 #include "sjpegi.h"
 
@@ -109,6 +112,9 @@ void StoreHisto(const int16_t in[64], Histo* const histos, int nb_blocks) {
 
 Encoder::StoreHistoFunc Encoder::GetStoreHistoFunc() {
 #if defined(SJPEG_USE_SSE2)
+#if defined(SJPEG_USE_AVX2)
+  if (SupportsAVX2()) return StoreHistoAVX2;
+#endif
   if (SupportsSSE2()) return StoreHistoSSE2;
 #elif defined(SJPEG_USE_NEON)
   if (SupportsNEON()) return StoreHistoNEON;
@@ -123,7 +129,7 @@ const float Encoder::kHistoWeight[QSIZE] = {
   0, 0, 0, 0, 0
 };
 
-void Encoder::AnalyseHisto() {
+void Encoder::AnalyseHisto(Quantizer* const quants) const {
   // A bit of theory and background: for each sub-band i in [0..63], we pick a
   // quantization scale New_Qi close to the initial one Qi. We evaluate a cost
   // function associated with F({New_Qi}) = distortion + lambda . rate,
@@ -190,10 +196,10 @@ void Encoder::AnalyseHisto() {
       if (omit_channels & (1ULL << pos)) {
         continue;
       }
-      const int dq0 = quants_[idx].quant_[pos];
-      const int min_dq0 = quants_[idx].min_quant_[pos];
+      const int dq0 = quants[idx].quant_[pos];
+      const int min_dq0 = quants[idx].min_quant_[pos];
       // We should be using the exact bias:
-      //    const int bias = quants_[idx].bias_[pos] << (FP_BITS - AC_BITS);
+      //    const int bias = quants[idx].bias_[pos] << (FP_BITS - AC_BITS);
       // but this value is too precise considering the other approximations
       // we're using (namely: HSHIFT). So we better use the a mid value of 0.5
       // for the bias. This have the advantage of making it possible to
@@ -306,36 +312,75 @@ void Encoder::AnalyseHisto() {
           }
         }
       }
-      quants_[idx].quant_[pos] += best_dq;
-      assert(quants_[idx].quant_[pos] >= 1);
+      quants[idx].quant_[pos] += best_dq;
+      assert(quants[idx].quant_[pos] >= 1);
     }
-    FinalizeQuantMatrix(&quants_[idx], q_bias_);
-    SetCostCodes(idx);
+    FinalizeQuantMatrix(&quants[idx], q_bias_);
+    quants[idx].codes_ = ac_codes_[idx];   // as SetCostCodes()
   }
 }
 
 void Encoder::CollectHistograms() {
   ResetHisto();
-  int16_t* in = in_blocks_;
   const int mb_x_max = W_ / block_w_;
   const int mb_y_max = H_ / block_h_;
   const bool use_extra_memory = use_extra_memory_;
-  for (int mb_y = 0; mb_y < mb_h_; ++mb_y) {
-    const bool yclip = (mb_y == mb_y_max);
-    for (int mb_x = 0; mb_x < mb_w_; ++mb_x) {
-      if (!use_extra_memory) {
-        in = in_blocks_;
+  // Each task fills its own pair of histograms over a band of MCU rows. They
+  // are summed up at the end, so the result doesn't depend on the split.
+  const int nb_tasks = NumCollectBands();
+  Histo* extra_histos = nullptr;
+  if (nb_tasks > 1) {
+    extra_histos = Alloc<Histo>(2 * (nb_tasks - 1));
+    if (extra_histos == nullptr) return;
+    memset(extra_histos, 0, 2 * (nb_tasks - 1) * sizeof(*extra_histos));
+  }
+  const int band_rows = (mb_h_ + nb_tasks - 1) / nb_tasks;
+  LockedMemory memory(memory_hook_);
+  std::vector<char> oks(nb_tasks, true);
+  std::vector<size_t> packed_sizes(nb_tasks, 0);
+  ParallelFor(0, nb_tasks, [&](int task) {
+    Histo* const histos = (task == 0) ? histos_ : &extra_histos[2 * task - 2];
+    alignas(16) int16_t mcu[6 * 64];   // scratch, if !use_extra_memory
+    const int mb_y_start = task * band_rows;
+    const int mb_y_end = std::min(mb_y_start + band_rows, mb_h_);
+    for (int mb_y = mb_y_start; mb_y < mb_y_end; ++mb_y) {
+      const bool yclip = (mb_y == mb_y_max);
+      int16_t* in = use_extra_memory ? RowCoeffs(task, mb_y) : mcu;
+      for (int mb_x = 0; mb_x < mb_w_; ++mb_x) {
+        if (!use_extra_memory) {
+          in = mcu;
+        }
+        GetSamples(mb_x, mb_y, yclip | (mb_x == mb_x_max), in);
+        fDCT_(in, mcu_blocks_);
+        for (int c = 0; c < nb_comps_; ++c) {
+          const int num_blocks = nb_blocks_[c];
+          store_histo_(in, &histos[quant_idx_[c]], num_blocks);
+          in += 64 * num_blocks;
+        }
       }
-      GetSamples(mb_x, mb_y, yclip | (mb_x == mb_x_max), in);
-      fDCT_(in, mcu_blocks_);
-      for (int c = 0; c < nb_comps_; ++c) {
-        const int num_blocks = nb_blocks_[c];
-        store_histo_(in, &histos_[quant_idx_[c]], num_blocks);
-        in += 64 * num_blocks;
+      if (use_extra_memory &&
+          !StoreRow(task, mb_y, &memory, &packed_sizes[task])) {
+        oks[task] = false;
+        return;
+      }
+    }
+  });
+  for (int task = 1; task < nb_tasks; ++task) {
+    for (int idx = 0; idx < 2; ++idx) {
+      const Histo& src = extra_histos[2 * task - 2 + idx];
+      for (int pos = 0; pos < 64; ++pos) {
+        for (int i = 0; i <= MAX_HISTO_DCT_COEFF; ++i) {
+          histos_[idx].counts_[pos][i] += src.counts_[pos][i];
+        }
       }
     }
   }
+  Free(extra_histos);
   have_coeffs_ = use_extra_memory_;
+  for (int task = 0; task < nb_tasks; ++task) {
+    if (!oks[task]) have_coeffs_ = SetError();
+    stats_.coeffs_bytes += packed_sizes[task];   // on top of in_blocks_
+  }
 }
 
 }    // namespace sjpeg
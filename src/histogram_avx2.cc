@@ -0,0 +1,49 @@
+// Copyright 2026 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//  Coefficient histograms, AVX2 version
+//
+
+#include <stdint.h>
+
+#define SJPEG_NEED_ASM_HEADERS
+#include "sjpegi.h"
+
+namespace sjpeg {
+
+#if defined(SJPEG_USE_AVX2)
+
+// Same counts as StoreHistoSSE2(), with 16 coefficients at a time.
+void StoreHistoAVX2(const int16_t in[64], Histo* const histos, int nb_blocks) {
+  const __m256i kMaxHisto = _mm256_set1_epi16(MAX_HISTO_DCT_COEFF);
+  for (int n = 0; n < nb_blocks; ++n, in += 64) {
+    uint16_t tmp[64];
+    for (int i = 0; i < 64; i += 16) {
+      const __m256i A =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+      const __m256i B = _mm256_abs_epi16(A);
+      const __m256i C = _mm256_srli_epi16(B, HSHIFT);   // >>= HSHIFT
+      const __m256i D = _mm256_min_epi16(C, kMaxHisto);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(tmp + i), D);
+    }
+    for (int j = 0; j < 64; ++j) {
+      const int k = tmp[j];
+      ++histos->counts_[j][k];
+    }
+  }
+}
+
+#endif    // SJPEG_USE_AVX2
+
+}    // namespace sjpeg
@@ -147,6 +147,38 @@ void Encoder::FinalizeQuantMatrix(Quantizer* const q, int q_bias) {
   }
 }
 
+void Encoder::FinalizeQuantizers() {
+  QuantizerCache* const cache = quant_cache_;
+  if (cache != nullptr && cache->valid && cache->bias == q_bias_) {
+    bool same = true;
+    for (int c = 0; c < 2 && same; ++c) {
+      same = !memcmp(cache->quant[c], quants_[c].quant_, 64) &&
+             !memcmp(cache->min_quant[c], quants_[c].min_quant_, 64);
+    }
+    if (same) {
+      quants_[0] = cache->quants[0];
+      quants_[1] = cache->quants[1];
+      return;
+    }
+  }
+  if (cache != nullptr) {
+    for (int c = 0; c < 2; ++c) {
+      memcpy(cache->quant[c], quants_[c].quant_, 64);
+      memcpy(cache->min_quant[c], quants_[c].min_quant_, 64);
+    }
+  }
+  FinalizeQuantMatrix(&quants_[0], q_bias_);
+  FinalizeQuantMatrix(&quants_[1], q_bias_);
+  if (cache != nullptr) {
+    for (int c = 0; c < 2; ++c) {
+      cache->quants[c] = quants_[c];
+      cache->quants[c].codes_ = nullptr;
+    }
+    cache->bias = q_bias_;
+    cache->valid = true;
+  }
+}
+
 void Encoder::SetCostCodes(int idx) {
   quants_[idx].codes_ = ac_codes_[idx];
 }
@@ -160,9 +192,9 @@ void Encoder::SetCostCodes(int idx) {
 // Store eight 16b-words into *dst
 #define STORE_16(V, dst) _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), (V))
 
-static int QuantizeBlockSSE2(const int16_t in[64], int idx,
-                             const Quantizer* const Q,
-                             DCTCoeffs* const out, RunLevel* const rl) {
+int QuantizeBlockSSE2(const int16_t in[64], int idx,
+                      const Quantizer* const Q,
+                      DCTCoeffs* const out, RunLevel* const rl) {
   const uint16_t* const bias = Q->bias_;
   const uint16_t* const iquant = Q->iquant_;
   int prev = 1;
@@ -325,76 +357,75 @@ static int QuantizeBlock(const int16_t in[64], int idx,
 typedef uint32_t score_t;
 static const score_t kMaxScore = 0xffffffffu;
 
-struct TrellisNode {
-  uint32_t code;
-  int      nbits;
-  score_t score;
-  uint32_t disto;
-  uint32_t bits;
-  uint32_t run;
-  const TrellisNode* best_prev;
-  int pos;
-  int rank;
-
-  TrellisNode() : score(kMaxScore), best_prev(nullptr) {}
-  void InitSink() {
-    score = 0u;
-    disto = 0;
-    pos = 0;
-    rank = 0;
-    nbits = 0;
-    bits = 0;
-  }
+// number of alternate levels to investigate
+#define NUM_TRELLIS_NODES 2
+
+// Nodes of the trellis, as a structure of arrays: the backward search only
+// reads 'pos', 'disto0' and 'score', which are then contiguous. Node #0 is the
+// sink, the others come by increasing 'pos'.
+struct TrellisNodes {
+  enum { kMaxNodes = 1 + NUM_TRELLIS_NODES * 63 };  // 1 sink + n channels
+  int pos[kMaxNodes];           // zigzag position
+  uint32_t disto0[kMaxNodes];   // distortion if all coeffs up to 'pos' are 0
+  score_t score[kMaxNodes];     // best score of a path ending here
+  int rank[kMaxNodes];          // number of non-zero coeffs on this path
+  int run[kMaxNodes];           // zero-run before the node
+  int prev[kMaxNodes];          // best predecessor
+  uint32_t code[kMaxNodes];     // level's mantissa
+  int nbits[kMaxNodes];         // level's length
 };
 
-static bool SearchBestPrev(const TrellisNode* const nodes0, TrellisNode* node,
-                           const uint32_t disto0[], const uint32_t codes[],
-                           uint32_t lambda) {
-  bool found = false;
+// Finds the best predecessor of the node #n, among the nodes #0..#n-1, and
+// sets its 'score', 'rank', 'run' and 'prev'. 'disto' is the distortion of the
+// node, plus the one of the coeffs before it if they were all zeroed.
+static bool SearchBestPrev(TrellisNodes* const nodes, int n, uint32_t disto,
+                           const uint32_t codes[], uint32_t lambda) {
   assert(codes[0xf0] != 0);
-  // Careful: loop overwrites node->disto, so compute this before it runs.
-  const uint32_t base_disto = node->disto + disto0[node->pos - 1];
-  for (const TrellisNode* cur = node - 1; cur >= nodes0; --cur) {
-    const int run = node->pos - 1 - cur->pos;
+  const int pos = nodes->pos[n];
+  const int nbits = nodes->nbits[n];
+  score_t best_score = kMaxScore;
+  int best = -1;
+  for (int cur = n - 1; cur >= 0; --cur) {
+    const int run = pos - 1 - nodes->pos[cur];
     if (run < 0) continue;
-    uint32_t bits = node->nbits;
+    uint32_t bits = nbits;
     bits += (run >> 4) * (codes[0xf0] & 0xff);
-    const uint32_t disto = base_disto - disto0[cur->pos];
+    const uint32_t cur_disto = disto - nodes->disto0[cur];
     // Exact early-out: walking back towards the sink only grows the run, so both
     // disto and the ZRL part of bits are monotone here, and the two terms left
-    // out -- symbol's code length and cur->score -- are non-negative. Once the
+    // out -- symbol's code length and cur's score -- are non-negative. Once the
     // bound reaches the incumbent, nothing left can win.
-    if (disto + lambda * bits >= node->score) break;
-    const uint32_t sym = ((run & 15) << 4) | node->nbits;
+    if (cur_disto + lambda * bits >= best_score) break;
+    const uint32_t sym = ((run & 15) << 4) | nbits;
     assert(codes[sym] != 0);
     bits += codes[sym] & 0xff;
-    const score_t score = disto + lambda * bits + cur->score;
-    if (score < node->score) {
-      node->score = score;
-      node->disto = disto;
-      node->bits = bits;
-      node->best_prev = cur;
-      node->rank = cur->rank + 1;
-      node->run = run;
-      found = true;
+    const score_t score = cur_disto + lambda * bits + nodes->score[cur];
+    if (score < best_score) {
+      best_score = score;
+      best = cur;
     }
   }
-  return found;
+  if (best < 0) return false;
+  nodes->score[n] = best_score;
+  nodes->rank[n] = nodes->rank[best] + 1;
+  nodes->run[n] = pos - 1 - nodes->pos[best];
+  nodes->prev[n] = best;
+  return true;
 }
 
-// number of alternate levels to investigate
-#define NUM_TRELLIS_NODES 2
-
 int Encoder::TrellisQuantizeBlock(const int16_t in[64], int idx,
                                   const Quantizer* const Q,
                                   DCTCoeffs* const out,
                                   RunLevel* const rl) {
   const uint16_t* const bias = Q->bias_;
   const uint16_t* const iquant = Q->iquant_;
-  TrellisNode nodes[1 + NUM_TRELLIS_NODES * 63];  // 1 sink + n channels
-  nodes[0].InitSink();
+  TrellisNodes nodes;
+  nodes.pos[0] = 0;   // the sink
+  nodes.disto0[0] = 0;
+  nodes.score[0] = 0;
+  nodes.rank[0] = 0;
   const uint32_t* const codes = Q->codes_;
-  TrellisNode* cur_node = &nodes[1];
+  int num_nodes = 1;
   uint32_t disto0[64];   // disto0[i] = sum of distortions up to i (inclusive)
   disto0[0] = 0;
   for (int i = 1; i < 64; ++i) {
@@ -410,13 +441,14 @@ int Encoder::TrellisQuantizeBlock(const int16_t in[64], int idx,
     int nbits = CalcLog2(v);
     for (int k = 0; k < NUM_TRELLIS_NODES; ++k) {
       const int err = V - v * q;
-      cur_node->code = (v ^ mask) & ((1 << nbits) - 1);
-      cur_node->pos = i;
-      cur_node->disto = err * err;
-      cur_node->nbits = nbits;
-      cur_node->score = kMaxScore;
-      if (SearchBestPrev(&nodes[0], cur_node, disto0, codes, lambda)) {
-        ++cur_node;
+      const int n = num_nodes;
+      nodes.code[n] = (v ^ mask) & ((1 << nbits) - 1);
+      nodes.pos[n] = i;
+      nodes.disto0[n] = disto0[i];
+      nodes.nbits[n] = nbits;
+      if (SearchBestPrev(&nodes, n, err * err + disto0[i - 1],
+                         codes, lambda)) {
+        ++num_nodes;
       }
       --nbits;
       if (nbits <= 0) break;
@@ -424,32 +456,26 @@ int Encoder::TrellisQuantizeBlock(const int16_t in[64], int idx,
     }
   }
   // search best entry point backward
-  const TrellisNode* nz = &nodes[0];
-  if (cur_node != nz) {
-    score_t best_score = kMaxScore;
-    while (cur_node-- != &nodes[0]) {
-      const uint32_t disto = disto0[63] - disto0[cur_node->pos];
-      // No need to incorporate EOB's bit cost (codes[0x00]), since
-      // it's the same for all coeff except the last one #63.
-      cur_node->disto += disto;
-      cur_node->score += disto;
-      if (cur_node->score < best_score) {
-        nz = cur_node;
-        best_score = cur_node->score;
-      }
+  int nz = 0;
+  score_t best_score = kMaxScore;
+  for (int n = num_nodes - 1; n >= 0; --n) {
+    // No need to incorporate EOB's bit cost (codes[0x00]), since
+    // it's the same for all coeff except the last one #63.
+    nodes.score[n] += disto0[63] - disto0[nodes.pos[n]];
+    if (nodes.score[n] < best_score) {
+      nz = n;
+      best_score = nodes.score[n];
     }
   }
-  int nb = nz->rank;
+  int nb = nodes.rank[nz];
   out->idx_ = idx;
-  out->last_ = nz->pos;
+  out->last_ = nodes.pos[nz];
   out->nb_coeffs_ = nb;
 
   while (nb-- > 0) {
-    const int32_t code = nz->code;
-    const int n = nz->nbits;
-    rl[nb].level_ = (code << 4) | n;
-    rl[nb].run_ = nz->run;
-    nz = nz->best_prev;
+    rl[nb].level_ = (nodes.code[nz] << 4) | nodes.nbits[nz];
+    rl[nb].run_ = nodes.run[nz];
+    nz = nodes.prev[nz];
   }
   const int dc = (in[0] < 0) ? -QUANTIZE(-in[0], iquant[0], bias[0])
                              : QUANTIZE(in[0], iquant[0], bias[0]);
@@ -458,6 +484,9 @@ int Encoder::TrellisQuantizeBlock(const int16_t in[64], int idx,
 
 Encoder::QuantizeBlockFunc Encoder::GetQuantizeBlockFunc() {
 #if defined(SJPEG_USE_SSE2)
+#if defined(SJPEG_USE_AVX2)
+  if (SupportsAVX2()) return QuantizeBlockAVX2;
+#endif
   if (SupportsSSE2()) return QuantizeBlockSSE2;
 #elif defined(SJPEG_USE_NEON)
   if (SupportsNEON()) return QuantizeBlockNEON;
@@ -474,8 +503,7 @@ Encoder::QuantizeBlockFunc Encoder::GetQuantizeBlockFunc() {
 // Store eight 16b-words into *dst
 #define STORE_16(V, dst) _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), (V))
 
-static uint32_t QuantizeErrorSSE2(const int16_t in[64],
-                                  const Quantizer* const Q) {
+uint32_t QuantizeErrorSSE2(const int16_t in[64], const Quantizer* const Q) {
   const uint16_t* const bias = Q->bias_;
   const uint16_t* const iquant = Q->iquant_;
   const uint8_t* const quant = Q->quant_;
@@ -560,6 +588,9 @@ static uint32_t QuantizeError(const int16_t in[64], const Quantizer* const Q) {
 
 Encoder::QuantizeErrorFunc Encoder::GetQuantizeErrorFunc() {
 #if defined(SJPEG_USE_SSE2)
+#if defined(SJPEG_USE_AVX2)
+  if (SupportsAVX2()) return QuantizeErrorAVX2;
+#endif
   if (SupportsSSE2()) return QuantizeErrorSSE2;
 #elif defined(SJPEG_USE_NEON)
   if (SupportsNEON()) return QuantizeErrorNEON;
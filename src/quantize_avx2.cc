@@ -0,0 +1,155 @@
+// Copyright 2026 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//  Quantization, AVX2 version
+//
+
+#include <stdint.h>
+
+#define SJPEG_NEED_ASM_HEADERS
+#include "sjpegi.h"
+
+namespace sjpeg {
+
+#if defined(SJPEG_USE_AVX2)
+
+#define LOAD_32(src) _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src))
+#define LOAD_16(src) _mm_loadu_si128(reinterpret_cast<const __m128i*>(src))
+
+// Same as QuantizeErrorSSE2(), with 16 coefficients at a time. The sum
+// wraps around the same way.
+uint32_t QuantizeErrorAVX2(const int16_t in[64], const Quantizer* const Q) {
+  const uint16_t* const bias = Q->bias_;
+  const uint16_t* const iquant = Q->iquant_;
+  const uint8_t* const quant = Q->quant_;
+  __m256i sum = _mm256_setzero_si256();
+  for (int i = 0; i < 64; i += 16) {
+    const __m256i m_bias = LOAD_32(bias + i);
+    const __m256i m_iquant = LOAD_32(iquant + i);
+    const __m256i m_quant = _mm256_cvtepu8_epi16(LOAD_16(quant + i));
+    const __m256i A = LOAD_32(in + i);                    // v0 = in[i]
+    const __m256i C = _mm256_abs_epi16(A);                // abs(v0)
+    const __m256i D = _mm256_adds_epi16(C, m_bias);       // v' = v0 + bias
+    const __m256i E = _mm256_mulhi_epu16(D, m_iquant);    // (v' * iq) >> 16
+    const __m256i F = _mm256_srai_epi16(E, AC_BITS);
+    const __m256i G = _mm256_srai_epi16(C, AC_BITS);
+    const __m256i H = _mm256_mullo_epi16(F, m_quant);     // *= quant[j]
+    const __m256i I = _mm256_sub_epi16(G, H);
+    sum = _mm256_add_epi32(sum, _mm256_madd_epi16(I, I));  // (v0-v) ^ 2
+  }
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(sum),
+                            _mm256_extracti128_si256(sum, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+  return static_cast<uint32_t>(_mm_cvtsi128_si32(s));
+}
+
+// kZigzagShuffle[h][k] gathers the zigzag-ordered bytes #32h..#32h+31 that
+// come from the bytes #16k..#16k+15 of a block, when broadcast to both lanes.
+// Negative entries zero the output byte.
+alignas(32) static const int8_t kZigzagShuffle[2][4][32] = {
+  {
+    {  0,  1,  8, -1,  9,  2,  3, 10, -1, -1, -1, -1, -1, 11,  4,  5,
+      12, -1, -1, -1, -1, -1, -1, -1, -1, -1, 13,  6,  7, 14, -1, -1 },
+    { -1, -1, -1,  0, -1, -1, -1, -1,  1,  8, -1,  9,  2, -1, -1, -1,
+      -1,  3, 10, -1, -1, -1, -1, -1, 11,  4, -1, -1, -1, -1,  5, 12 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0, -1, -1, -1, -1, -1,
+      -1, -1, -1,  1,  8, -1,  9,  2, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+  },
+  {
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 15, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, 13,  6, -1,  7, 14, -1, -1, -1,
+      -1, -1, -1, -1, -1, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    {  3, 10, -1, -1, -1, -1, 11,  4, -1, -1, -1, -1, -1,  5, 12, -1,
+      -1, -1, -1, 13,  6, -1,  7, 14, -1, -1, -1, -1, 15, -1, -1, -1 },
+    { -1, -1,  1,  8,  9,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1,  3,
+      10, 11,  4, -1, -1, -1, -1, -1,  5, 12, 13,  6, -1,  7, 14, 15 },
+  },
+};
+
+// Same as QuantizeBlockSSE2(), with 16 coefficients at a time. The zero
+// flags are then shuffled to zigzag order directly, so that the emission
+// loop only visits the non-zero coefficients.
+int QuantizeBlockAVX2(const int16_t in[64], int idx,
+                      const Quantizer* const Q,
+                      DCTCoeffs* const out, RunLevel* const rl) {
+  const uint16_t* const bias = Q->bias_;
+  const uint16_t* const iquant = Q->iquant_;
+  alignas(32) int16_t tmp[64], masked[64];
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i is_zero[4];
+  for (int i = 0; i < 64; i += 16) {
+    const __m256i m_bias = LOAD_32(bias + i);
+    const __m256i m_mult = LOAD_32(iquant + i);
+    const __m256i A = LOAD_32(in + i);                     // A = in[i]
+    const __m256i B = _mm256_srai_epi16(A, 15);            // sign extract
+    const __m256i C = _mm256_abs_epi16(A);                 // abs(A)
+    const __m256i D = _mm256_adds_epi16(C, m_bias);        // v' = v + bias
+    const __m256i E = _mm256_mulhi_epu16(D, m_mult);       // (v' * iq) >> 16
+    const __m256i F = _mm256_srli_epi16(E, AC_BITS);       // = QUANTIZE(...)
+    const __m256i G = _mm256_xor_si256(F, B);              // v ^ mask
+    _mm256_store_si256(reinterpret_cast<__m256i*>(tmp + i), F);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(masked + i), G);
+    is_zero[i / 16] = _mm256_cmpeq_epi16(F, zero);
+  }
+  // one byte per coefficient, in natural order
+  const __m256i N0 = _mm256_permute4x64_epi64(
+      _mm256_packs_epi16(is_zero[0], is_zero[1]), 0xd8);
+  const __m256i N1 = _mm256_permute4x64_epi64(
+      _mm256_packs_epi16(is_zero[2], is_zero[3]), 0xd8);
+  const __m256i src[4] = {
+    _mm256_permute2x128_si256(N0, N0, 0x00),
+    _mm256_permute2x128_si256(N0, N0, 0x11),
+    _mm256_permute2x128_si256(N1, N1, 0x00),
+    _mm256_permute2x128_si256(N1, N1, 0x11),
+  };
+  uint64_t zz = 0;   // bit i set iff the zigzag coefficient #i is zero
+  for (int h = 0; h < 2; ++h) {
+    __m256i Z = zero;
+    for (int k = 0; k < 4; ++k) {
+      const __m256i mask = _mm256_load_si256(
+          reinterpret_cast<const __m256i*>(kZigzagShuffle[h][k]));
+      Z = _mm256_or_si256(Z, _mm256_shuffle_epi8(src[k], mask));
+    }
+    zz |= static_cast<uint64_t>(
+              static_cast<uint32_t>(_mm256_movemask_epi8(Z))) << (32 * h);
+  }
+  int prev = 1;
+  int nb = 0;
+  for (uint64_t b = ~zz & ~1ull; b != 0; b &= b - 1) {   // AC coeffs only
+    const int i = TrailingZeros64(b);
+    const int j = kZigzag[i];
+    const int n = CalcLog2(tmp[j]);
+    const uint16_t code = masked[j] & ((1 << n) - 1);
+    rl[nb].level_ = (code << 4) | n;
+    rl[nb].run_ = i - prev;
+    prev = i + 1;
+    ++nb;
+  }
+  const int dc = (in[0] < 0) ? -tmp[0] : tmp[0];
+  out->idx_ = idx;
+  out->last_ = prev - 1;
+  out->nb_coeffs_ = nb;
+  return dc;
+}
+
+#undef LOAD_32
+#undef LOAD_16
+
+#endif    // SJPEG_USE_AVX2
+
+}    // namespace sjpeg
@@ -20,6 +20,7 @@
 #define SJPEG_JPEG_H_
 
 #include <inttypes.h>
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
@@ -112,6 +113,14 @@ size_t SjpegEncode(const uint8_t* rgb,
 // SjpegCompress() or sjpeg::Encode(). Useful for non-C++ bindings.
 void SjpegFreeBuffer(const uint8_t* buffer);
 
+// Upper bound on the size of the bitstream for a 'width' x 'height' picture,
+// whatever the samples and encoding parameters. 'metadata_size' is the total
+// size of the EXIF, ICC, XMP and custom markers data. A fixed-capacity sink
+// (sjpeg::FixedBufferSink) of this size never runs out of room. Returns 0 for
+// invalid dimensions.
+size_t SjpegMaxOutputSize(int width, int height, SjpegYUVMode yuv_mode,
+                          size_t metadata_size);
+
 ////////////////////////////////////////////////////////////////////////////////
 // JPEG-parsing tools
 
@@ -180,6 +189,8 @@ struct Encoder;
 struct SearchHook;
 struct ByteSink;
 struct MemoryManager;
+struct Executor;
+struct EncoderStats;
 
 // Structure for holding encoding parameter, to be passed to the unique
 // call to SjpegEncode() below. For a more detailed description of some fields,
@@ -229,6 +240,11 @@ struct EncoderParam {
   float qmin, qmax;             // Limits for the search quality values.
                                 // If set, min_quant_[] matrices will take
                                 // precedence and limit qmax further.
+  // If true, the methods keeping the DCT coefficients of the whole picture
+  // (searches with passes > 1, methods 3, 4 and 7) store them in a lossless
+  // packed form, about half the size, at some extra CPU cost for each pass.
+  // The output is unchanged.
+  bool compact_coeffs;          // default is false
 
   // fine-grained control over compression parameters
   int quantization_bias;    // [0..255] Rounding bias for quantization.
@@ -240,6 +256,27 @@ struct EncoderParam {
   // if null, a default implementation will be used
   sjpeg::SearchHook* search_hook;
 
+  // multi-threading: if num_threads > 1, the picture is split into as many
+  // bands of MCU rows, separated by restart markers (DRI / RSTn), and these are
+  // coded concurrently. The output only depends on the value of num_threads.
+  // The calls to 'memory' below are serialized, it needn't be thread-safe.
+  int num_threads;          // default is 1 (no restart markers)
+  // If true, no restart markers are used: the entropy coding stays serial,
+  // overlapped with the quantization of the next MCU rows. Unless a size or
+  // PSNR search is used, the output is then the same as with num_threads = 1.
+  bool pipelined;           // default is false
+  // If true, the bytes of the final scan are committed to the sink after each
+  // MCU row, instead of whenever the output buffer is full, so that they can
+  // be sent while the encoding goes on (see MakeByteSink() with a callback).
+  // With Huffman_compress, the final scan only starts once all the rows are
+  // analyzed. Rows of the bands coded concurrently (num_threads > 1 and not
+  // pipelined) are only available once the first band is coded.
+  bool flush_rows;          // default is false
+  // Executor running the parallel stages. If null and num_threads > 1, a
+  // pool of num_threads threads is created for the duration of the encoding.
+  // Otherwise, no thread is ever created by the library.
+  sjpeg::Executor* executor;
+
   // metadata: extra EXIF/XMP/XMPExt/ICCP data that will be embedded in
   // APP1 or APP2 markers. They should contain only the raw payload and not
   // the prefixes ("Exif\0", "ICC_PROFILE", etc...). These will be added
@@ -260,6 +297,17 @@ struct EncoderParam {
 
   // Memory manager used by the codec. If null, default one will be used.
   sjpeg::MemoryManager* memory;
+  // If not 0, the encoder estimates its peak memory use from the picture size
+  // and the parameters above (including the output, but not the input), and
+  // picks slower but leaner strategies until the estimate fits: packed
+  // coefficients, then recomputing them for each pass and coding in two scans
+  // instead of keeping the run/levels (passes = 1 only), then no pipelining
+  // and, for SJPEG_YUV_SHARP, converting band by band on the calling thread.
+  // The encoding fails if the leanest strategy still doesn't fit.
+  size_t max_memory_bytes;   // default is 0 (no limit)
+
+  // If not null, filled with the memory statistics of the encoding.
+  sjpeg::EncoderStats* stats;
 
  protected:
   uint8_t quant_[2][64];         // quantization matrices to use
@@ -369,9 +417,39 @@ struct SearchHook {
   virtual void NextMatrix(int idx, uint8_t dst[64]);
   // return true if the search is finished
   virtual bool Update(float result);
+
+  // K-section search: if num_candidates > 1, each pass evaluates up to that
+  // many q values concurrently instead of a single one. The default hook
+  // uses EncoderParam::num_threads candidates, custom ones must opt in.
+  int num_candidates = 1;
+  // Stores the q values to try next in qs[] (at most 'max_num' of them) and
+  // returns their number. NextMatrix() is then called with 'q' set to each
+  // of them in turn.
+  virtual int NextCandidates(float qs[], int max_num);
+  // Same as Update(), with the results for all the candidates.
+  // Should set 'q' and 'value' to the best candidate.
+  virtual bool UpdateCandidates(const float qs[], const float results[],
+                                int num);
   virtual ~SearchHook() {}
 };
 
+////////////////////////////////////////////////////////////////////////////////
+// Memory statistics of an encoding (see EncoderParam::stats). They cover the
+// memory obtained from the MemoryManager (EncoderParam::memory), but not the
+// output's, which the ByteSink manages.
+
+struct EncoderStats {
+  size_t peak_bytes = 0;    // largest number of bytes in use at once
+  size_t num_allocs = 0;    // number of allocations, including Realloc()'s
+  size_t copied_bytes = 0;  // bytes moved by Realloc(), when growing buffers
+                            // such as the bands of the bitstream
+  // Largest size reached by the main buffers, in bytes:
+  size_t coeffs_bytes = 0;       // unquantized DCT coefficients (packed or not)
+  size_t run_levels_bytes = 0;   // quantized run/levels kept for the last scan
+  size_t dct_coeffs_bytes = 0;   // per-block infos kept along (DCTCoeffs)
+  size_t samples_bytes = 0;      // samples kept by the encoder (sharp YUV)
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 // Generic byte-sink: custom streaming output of compressed data
 //
@@ -388,6 +466,10 @@ struct SearchHook {
 //       destruction (and the assembled byte-stream can be grabbed).
 //       Returns false in case of I/O error.
 //  . Reset(): releases resources (called in case of error or at destruction).
+//  . MaxExtraSize(used_size): the largest 'extra_size' the next call to
+//       Commit(used_size, ...) could honor. When that is less than what it
+//       would like, the encoder only asks for what it needs. Default is no
+//       limit.
 
 struct ByteSink {
  public:
@@ -395,6 +477,29 @@ struct ByteSink {
   virtual bool Commit(size_t used_size, size_t extra_size, uint8_t** data) = 0;
   virtual bool Finalize() = 0;
   virtual void Reset() = 0;
+  virtual size_t MaxExtraSize(size_t used_size) const {
+    (void)used_size;
+    return ~static_cast<size_t>(0);
+  }
+};
+
+// Sink writing into the caller's buffer 'buf' of 'capacity' bytes, which is
+// never reallocated. Encoding fails if it's too small: SjpegMaxOutputSize()
+// gives a capacity that is always enough. Once encoding is done, size() is
+// the number of bytes written.
+class FixedBufferSink : public ByteSink {
+ public:
+  FixedBufferSink(uint8_t* buf, size_t capacity);
+  bool Commit(size_t used_size, size_t extra_size, uint8_t** data) override;
+  bool Finalize() override { return true; }
+  void Reset() override { pos_ = 0; }
+  size_t MaxExtraSize(size_t used_size) const override;
+  size_t size() const { return pos_; }
+
+ private:
+  uint8_t* const buf_;
+  const size_t capacity_;
+  size_t pos_;
 };
 
 // Some useful factories
@@ -403,6 +508,25 @@ std::shared_ptr<ByteSink> MakeByteSink(std::string* output);
 template<typename T>
 std::shared_ptr<ByteSink> MakeByteSink(std::vector<T>* output);
 template<> std::shared_ptr<ByteSink> MakeByteSink(std::vector<uint8_t>* output);
+// Calls 'write' with the bytes as soon as they are committed, rather than
+// assembling them. 'write' returns false in case of error, which aborts the
+// encoding.
+std::shared_ptr<ByteSink> MakeByteSink(
+    const std::function<bool(const uint8_t* data, size_t size)>& write);
+// Sinks writing into the file descriptor 'fd', which the caller keeps owning.
+// Neither holds the whole bitstream in memory. They return null where not
+// available (non-POSIX systems).
+//  . MakeFdSink() writes through a small buffer, reused once written out.
+//    'fd' can be a pipe or a socket. The bytes are written as soon as the
+//    encoder commits them (see EncoderParam::flush_rows).
+//  . MakeMmapFileSink() maps the file, and the encoder writes straight into
+//    it. 'fd' must be a regular file open for reading and writing, whose
+//    content is replaced.
+std::shared_ptr<ByteSink> MakeFdSink(int fd);
+std::shared_ptr<ByteSink> MakeMmapFileSink(int fd);
+
+// Same as SjpegMaxOutputSize(), with the yuv_mode and metadata of 'param'.
+size_t MaxOutputSize(int width, int height, const EncoderParam& param);
 
 ////////////////////////////////////////////////////////////////////////////////
 // Memory manager (for internal allocation)
@@ -412,6 +536,168 @@ struct MemoryManager {
   virtual ~MemoryManager() {}
   virtual void* Alloc(size_t size) = 0;     // same semantic as malloc()
   virtual void Free(void* const ptr) = 0;   // same semantic as free()
+  // Same semantic as realloc(), except that only the first 'used_size' bytes
+  // need to be preserved. The default implementation uses Alloc() and Free().
+  virtual void* Realloc(void* const ptr, size_t used_size, size_t new_size);
+};
+
+// Bump-pointer allocator, for one encoding at a time: Free() only takes back
+// the last allocation, and Reset() releases everything at once in between
+// encodings. The memory comes in chunks from 'base' (the default manager if
+// null), each one twice as large as the previous one. After an encoding that
+// needed several chunks, Reset() merges them, so that the next ones are
+// served from a single chunk. Realloc() grows the last allocation in place
+// when there's room. Not thread-safe, but the encoder serializes its calls.
+class ArenaMemoryManager : public MemoryManager {
+ public:
+  explicit ArenaMemoryManager(size_t initial_size = 0,
+                              MemoryManager* base = nullptr);
+  ~ArenaMemoryManager() override;
+  void* Alloc(size_t size) override;
+  void Free(void* const ptr) override;
+  void* Realloc(void* const ptr, size_t used_size, size_t new_size) override;
+
+  // Invalidates all the allocations.
+  void Reset();
+  // Largest number of bytes allocated at once since construction, and the
+  // number of bytes currently obtained from 'base'.
+  size_t HighWaterMark() const { return high_water_mark_; }
+  size_t Capacity() const { return capacity_; }
+
+ private:
+  struct Chunk;
+  bool AddChunk(size_t size);
+  void ReleaseChunks();
+
+  MemoryManager* const base_;
+  Chunk* chunk_ = nullptr;      // current one, linked to the previous ones
+  uint8_t* top_ = nullptr;      // free space of chunk_
+  uint8_t* end_ = nullptr;
+  uint8_t* last_ = nullptr;     // last allocation, if not freed yet
+  size_t next_size_;            // size of the next chunk
+  size_t used_ = 0;             // allocated bytes, including the ones freed
+  size_t high_water_mark_ = 0;
+  size_t capacity_ = 0;
+
+  ArenaMemoryManager(const ArenaMemoryManager&) = delete;
+  ArenaMemoryManager& operator=(const ArenaMemoryManager&) = delete;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Executor (for internal parallel work)
+//
+//  . ParallelFor(begin, end, fn): calls fn(i) once for each i in [begin, end),
+//       in any order and from any thread, and returns once all calls are
+//       complete. The calling thread should take part in the work: calls can
+//       be nested (fn() may itself call ParallelFor()) and can be issued by
+//       several encoders at once.
+
+struct Executor {
+ public:
+  virtual ~Executor() {}
+  virtual void ParallelFor(int begin, int end,
+                           const std::function<void(int)>& fn) = 0;
+};
+
+// Default implementation: a pool of std::thread. The caller of ParallelFor()
+// counts as one of the 'num_threads'. Returns null in case of error.
+std::shared_ptr<Executor> MakeThreadPool(int num_threads);
+
+////////////////////////////////////////////////////////////////////////////////
+// Batch encoding
+//
+// EncodeBatch() encodes all the 'jobs' concurrently, over a common pool of
+// 'num_threads' threads (or 'executor', if not null). Pictures are scheduled
+// largest first. Small ones are encoded whole, one per thread, while large
+// ones are also split into bands (see EncoderParam::num_threads) that idle
+// threads pick up. Jobs using the default memory manager recycle the scratch
+// buffers of the ones that previously ran on the same thread.
+// If not null, (*results)[i] is set to the success of jobs[i]. Returns true
+// if all the jobs succeeded.
+
+struct EncodeJob {
+  typedef enum { RGB = 0, BGRA, RGBA, GRAY } Format;   // see Encode*() above
+
+  const uint8_t* pixels = nullptr;
+  int width = 0, height = 0;
+  int stride = 0;                 // in bytes
+  Format format = RGB;
+  EncoderParam param;   // If param.num_threads is 1, pictures larger than
+                        // about 1Mpixel use one band per thread of the batch.
+  ByteSink* sink = nullptr;
+};
+
+bool EncodeBatch(const std::vector<EncodeJob>& jobs, int num_threads,
+                 Executor* executor = nullptr,
+                 std::vector<bool>* results = nullptr);
+
+////////////////////////////////////////////////////////////////////////////////
+// Row-streaming encoding
+//
+// For RGB sources produced a few rows at a time (decoders, scalers, ...).
+// Each row of MCUs (16 pixels high for 4:2:0, 8 otherwise) is converted and
+// coded as soon as all its rows are pushed, so that only these rows are held
+// at once. With 'Huffman_compress', the compact run/levels of the whole
+// picture are kept instead, for coding with the optimized tables at the end.
+// Tools needing several passes over the samples are not available:
+// 'adaptive_quantization', 'passes' and 'use_trellis' are ignored,
+// SJPEG_YUV_AUTO and SJPEG_YUV_SHARP mean SJPEG_YUV_420, and the rows are
+// coded on the calling thread ('num_threads' and 'executor' are ignored).
+
+class StreamEncoder {
+ public:
+  StreamEncoder() {}
+  ~StreamEncoder();
+
+  // Starts encoding a 'width' x 'height' picture into 'sink', discarding the
+  // previous one if not finished. Returns false in case of error.
+  bool Begin(int width, int height, const EncoderParam& param,
+             ByteSink* sink);
+  // Pushes the next 'nb_rows' rows, 'stride' bytes apart. Returns false in
+  // case of error, including pushing more than 'height' rows overall.
+  bool PushRows(const uint8_t* rgb, int stride, int nb_rows);
+  // Completes the bitstream once all the rows are pushed. Returns false in
+  // case of error, or if some rows are missing.
+  bool Finish();
+
+ private:
+  Encoder* enc_ = nullptr;
+
+  StreamEncoder(const StreamEncoder&) = delete;
+  StreamEncoder& operator=(const StreamEncoder&) = delete;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Encoder context
+//
+// For encoding many pictures in a row, typically small ones: the scratch
+// buffers of each encoding are kept to serve the next ones, and the
+// quantizers derived from the parameters are reused as long as the quality
+// and quantization settings don't change. The output is the same as with
+// the Encode() functions. A context can't be used by several threads at once.
+
+class EncoderContext {
+ public:
+  // The buffers kept come from 'memory', or the default manager if null.
+  explicit EncoderContext(MemoryManager* memory = nullptr);
+  ~EncoderContext();
+
+  // Same as Encode(), except that 'param.memory' is ignored.
+  bool Encode(const uint8_t* rgb, int width, int height, int stride,
+              const EncoderParam& param, ByteSink* sink);
+  bool Encode(const uint8_t* rgb, int width, int height, int stride,
+              const EncoderParam& param, std::string* output);
+
+  // Returns the kept buffers to the memory manager.
+  void Clear();
+
+ private:
+  struct Cache;
+  MemoryManager* const memory_;
+  Cache* cache_ = nullptr;
+
+  EncoderContext(const EncoderContext&) = delete;
+  EncoderContext& operator=(const EncoderContext&) = delete;
 };
 
 }  // namespace sjpeg
@@ -21,6 +21,10 @@
 
 #include <stdint.h>
 
+#include <mutex>  // NOLINT
+#include <unordered_map>
+#include <vector>
+
 // IWYU pragma: begin_exports
 #include "sjpeg.h"
 #include "bit_writer.h"
@@ -34,6 +38,21 @@
 #define SJPEG_USE_SSE2
 #endif
 
+// AVX2 code is kept in the *_avx2.cc files. The build compiles them with
+// -mavx2 and defines SJPEG_HAVE_AVX2 when the compiler supports it, and the
+// rest of the library then only calls them if SupportsAVX2(). They should
+// not use inline functions or templates shared with other files: the linker
+// could keep their AVX2 copy for everyone.
+#if defined(SJPEG_USE_SSE2) && (defined(__AVX2__) || defined(SJPEG_HAVE_AVX2))
+#define SJPEG_USE_AVX2
+#endif
+
+// Same for the SSSE3 code of the *_ssse3.cc files, with -mssse3,
+// SJPEG_HAVE_SSSE3 and SupportsSSSE3().
+#if defined(SJPEG_USE_SSE2) && (defined(__SSSE3__) || defined(SJPEG_HAVE_SSSE3))
+#define SJPEG_USE_SSSE3
+#endif
+
 #if defined(__ARM_NEON__) || defined(__aarch64__)
 #define SJPEG_USE_NEON
 #endif
@@ -47,6 +66,14 @@
 #include <emmintrin.h>
 #endif
 
+#if defined(SJPEG_USE_SSSE3) && defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+#if defined(SJPEG_USE_AVX2) && defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 #if defined(SJPEG_USE_NEON)
 #include <arm_neon.h>
 #endif
@@ -54,11 +81,15 @@
 
 #include <assert.h>
 
+#include <functional>
+
 ////////////////////////////////////////////////////////////////////////////////
 
 namespace sjpeg {
 
 extern bool SupportsSSE2();
+extern bool SupportsSSSE3();
+extern bool SupportsAVX2();
 extern bool SupportsNEON();
 
 // Constants below are marker codes defined in JPEG spec
@@ -72,10 +103,15 @@ extern bool SupportsNEON();
 #define M_EOI   0xffd9
 #define M_SOS   0xffda
 #define M_DQT   0xffdb
+#define M_DRI   0xffdd
+#define M_RST0  0xffd0    // RST0..RST7 are 0xffd0..0xffd7
 
 // Maximum picture dimension: SOF stores the width and height on 16 bits.
 enum { kMaxDimension = 0xffff };
 
+// Upper limit for EncoderParam::num_threads.
+enum { kMaxThreads = 64 };
+
 // Forward 8x8 Fourier transforms, in-place.
 typedef void (*FdctFunc)(int16_t *coeffs, int num_blocks);
 FdctFunc GetFdct();
@@ -115,10 +151,28 @@ extern RGBToIndexRowFunc GetRowFunc();
 // Enhanced slower RGB->YUV conversion:
 //  y_plane[] has dimension W x H, whereas u_plane[] and v_plane[] have
 //  dimension (W + 1)/2 x (H + 1)/2.
-void ApplySharpYUVConversion(const uint8_t* const rgb,
+//  The picture is processed in bands of bounded height, concurrently if
+//  'executor' is not null, with scratch memory taken from 'memory'.
+//  Returns false in case of allocation failure.
+bool ApplySharpYUVConversion(const uint8_t* const rgb,
                              int W, int H, int stride,
                              uint8_t* y_plane,
-                             uint8_t* u_plane, uint8_t* v_plane);
+                             uint8_t* u_plane, uint8_t* v_plane,
+                             MemoryManager* const memory,
+                             Executor* const executor);
+
+// Band-wise variant, for when the planes can't be kept whole: converts the
+// rows [band * kSharpYUVBandRows, (band + 1) * kSharpYUVBandRows) only, the
+// planes starting at the band's first row. The samples are the same as
+// ApplySharpYUVConversion()'s.
+enum { kSharpYUVBandRows = 128 };   // must be a multiple of 16
+bool ApplySharpYUVConversionBand(const uint8_t* const rgb,
+                                 int W, int H, int stride, int band,
+                                 uint8_t* y_plane,
+                                 uint8_t* u_plane, uint8_t* v_plane,
+                                 MemoryManager* const memory);
+// Scratch memory used by the conversion of one band.
+size_t SharpYUVConversionMemory(int W, int H);
 
 ///////////////////////////////////////////////////////////////////////////////
 // Generic sample-replication function. Replicate sub_w x sub_h area of 'src'
@@ -234,6 +288,17 @@ struct Quantizer {
   const uint32_t* codes_;  // codes for bit-cost calculation
 };
 
+// The last finalized quantizers, along with the matrices and bias they were
+// derived from: encoders sharing it skip FinalizeQuantMatrix() when these
+// haven't changed (see EncoderContext).
+struct QuantizerCache {
+  bool valid = false;
+  int bias = 0;
+  uint8_t quant[2][64];       // before clamping to min_quant[]
+  uint8_t min_quant[2][64];
+  Quantizer quants[2];        // the result, without codes_
+};
+
 // compact Run/Level storage, separate from DCTCoeffs infos
 // Run/Level Information is not yet entropy-coded, but just stored
 struct RunLevel {
@@ -250,6 +315,107 @@ struct DCTCoeffs {
   int8_t bias_;        // perceptual bias
 };
 
+// Lossless compact form of the unquantized coefficients, used if
+// EncoderParam::compact_coeffs is set. In each block, the coefficients are
+// taken in zigzag order by groups of 8. A group is packed on the bit-width
+// 'w' of its largest value (zigzag-encoded, see coeffs.cc), and so takes 'w'
+// bytes. The 8 widths come first, on 4 bits each.
+enum { kMaxPackedBlockSize = 4 + 64 * 2,
+       kPackedPadding = 8 };   // bytes written or read past the end
+// Packs 'num_blocks' blocks to 'dst' and returns the number of bytes used.
+// 'dst' must have room for num_blocks * kMaxPackedBlockSize + kPackedPadding.
+size_t PackCoeffs(const int16_t* in, int num_blocks, uint8_t* dst);
+// Unpacks 'num_blocks' blocks to 'out', and returns the end of their data.
+// The kPackedPadding bytes after it must be readable.
+const uint8_t* UnpackCoeffs(const uint8_t* src, int num_blocks, int16_t* out);
+
+// Run/levels of all the blocks, stored in a list of fixed-size chunks: unlike
+// a contiguous array, growing never copies what is already stored. The
+// run/levels of an MCU are never split between two chunks. A zero-initialized
+// store is empty, and its chunks must be released with Release().
+class RunLevelStore {
+ public:
+  enum { kChunkSize = 8192,      // number of run/levels per chunk
+         kMaxMCU = 6 * 64 };     // at most, for one MCU
+  // Returns room for the run/levels of one more MCU, or nullptr if the
+  // allocation of a new chunk failed.
+  RunLevel* Reserve(MemoryManager* const memory) {
+    if (last_ != nullptr && last_->size + kMaxMCU <= kChunkSize) {
+      return last_->rl + last_->size;
+    }
+    return NextChunk(memory);
+  }
+  // Commits the 'num' run/levels written after Reserve().
+  void Add(size_t num) {
+    assert(last_ != nullptr && last_->size + num <= kChunkSize);
+    last_->size += num;
+    size_ += num;
+  }
+  // Moves the chunks of 'other' after the ones of this store.
+  void Append(RunLevelStore* const other);
+  // Empties the store, keeping the chunks to be filled again.
+  void Rewind();
+  void Release(MemoryManager* const memory);
+  size_t size() const { return size_; }
+  size_t Bytes() const;   // memory held by the chunks
+
+ private:
+  struct Chunk {
+    Chunk* next;
+    size_t size;   // number of run/levels stored in rl[]
+    RunLevel rl[kChunkSize];
+  };
+  RunLevel* NextChunk(MemoryManager* const memory);
+
+  Chunk* first_;
+  Chunk* last_;    // the one being filled. Following ones are empty
+  size_t size_;
+
+ public:
+  // Reads the run/levels back, block after block, in the order they were
+  // stored. Copies can be made to resume from a given block later on.
+  class Reader {
+   public:
+    explicit Reader(const RunLevelStore& store)
+        : chunk_(store.first_), pos_(0) {}
+    const RunLevel* Next(int num) {   // 'num' run/levels of the next block
+      if (chunk_ == nullptr) {
+        assert(num == 0);
+        return nullptr;
+      }
+      while (pos_ == chunk_->size && chunk_->next != nullptr) {
+        chunk_ = chunk_->next;
+        pos_ = 0;
+      }
+      const RunLevel* const rl = chunk_->rl + pos_;
+      pos_ += num;
+      assert(pos_ <= chunk_->size);
+      return rl;
+    }
+
+   private:
+    const Chunk* chunk_;
+    size_t pos_;
+  };
+
+  // Takes the chunks of 'store', and hands them out again to the stores
+  // calling Reserve() with it, before allocating from 'base'. The parallel
+  // bands of a pass share the chunks of the previous one this way.
+  // Thread-safe. The chunks left are freed at destruction.
+  class Spares : public MemoryManager {
+   public:
+    Spares(RunLevelStore* const store, MemoryManager* const base);
+    ~Spares() override;
+    void* Alloc(size_t size) override;
+    void Free(void* const ptr) override;
+
+   private:
+    MemoryManager* const base_;
+    Chunk* first_;
+    std::mutex mutex_;
+  };
+};
+
 // Histogram of transform coefficients, for adaptive quant matrices
 // * HSHIFT controls the trade-off between storage size for counts[]
 //   and precision: the fdct doesn't descale and returns coefficients as
@@ -281,6 +447,109 @@ struct Histo {
   int counts_[64][MAX_HISTO_DCT_COEFF + 1];
 };
 
+// What a band of MCU rows collects during the quantization pass
+struct BandStats {
+  uint32_t freq_ac[2][256 + 1];   // symbol frequencies
+  uint32_t freq_dc[2][12 + 1];
+  RunLevelStore run_levels;       // run/levels storage
+  int first_dc[3], last_dc[3];    // DC values of first/last blocks, per comp.
+};
+
+// The user's MemoryManager isn't required to be thread-safe: serialize it.
+class LockedMemory : public MemoryManager {
+ public:
+  explicit LockedMemory(MemoryManager* const memory) : memory_(memory) {}
+  ~LockedMemory() override {}
+  void* Alloc(size_t size) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return memory_->Alloc(size);
+  }
+  void Free(void* const ptr) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    memory_->Free(ptr);
+  }
+  void* Realloc(void* const ptr, size_t used_size, size_t new_size) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return memory_->Realloc(ptr, used_size, new_size);
+  }
+
+ private:
+  MemoryManager* const memory_;
+  std::mutex mutex_;
+};
+
+// Forwards to 'base', counting the bytes in use and their peak, the number of
+// allocations and the bytes Realloc() copies (see EncoderStats). The blocks
+// allocated before are forwarded too, but not counted. Not thread-safe: the
+// encoder serializes its calls.
+class CountingMemory : public MemoryManager {
+ public:
+  explicit CountingMemory(MemoryManager* const base) : base_(base) {}
+  ~CountingMemory() override {}
+  void* Alloc(size_t size) override;
+  void Free(void* const ptr) override;
+  void* Realloc(void* const ptr, size_t used_size, size_t new_size) override;
+
+  size_t peak() const { return peak_; }
+  size_t num_allocs() const { return num_allocs_; }
+  size_t copied() const { return copied_; }
+
+ private:
+  void Add(void* const ptr, size_t size);
+  MemoryManager* const base_;
+  std::unordered_map<void*, size_t> sizes_;   // the blocks in use
+  size_t used_ = 0, peak_ = 0;
+  size_t num_allocs_ = 0, copied_ = 0;
+};
+
+// Keeps the blocks released by the encoders to serve the next ones, rather
+// than returning them to 'base'. The allocations of a given encoder are
+// serialized, so this needn't be thread-safe as long as it's used by one
+// job at a time. Defined in batch.cc.
+class RecyclingMemory : public MemoryManager {
+ public:
+  explicit RecyclingMemory(MemoryManager* const base) : base_(base) {}
+  ~RecyclingMemory() override;
+  void* Alloc(size_t size) override;
+  void Free(void* const ptr) override;
+
+ private:
+  struct alignas(16) Block {   // header, preserving the alignment of 'base'
+    size_t capacity;
+  };
+  MemoryManager* const base_;
+  std::vector<Block*> free_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX2 kernels, in the *_avx2.cc files. They give the same results as their
+// SSE2 counterpart, and are only picked if SupportsAVX2().
+
+// The SSE2 versions, in histogram.cc and quantize.cc, exported for the tests.
+#if defined(SJPEG_USE_SSE2)
+void StoreHistoSSE2(const int16_t in[64], Histo* const histos, int nb_blocks);
+uint32_t QuantizeErrorSSE2(const int16_t in[64], const Quantizer* const Q);
+int QuantizeBlockSSE2(const int16_t in[64], int idx, const Quantizer* const Q,
+                      DCTCoeffs* const out, RunLevel* const rl);
+#endif
+
+#if defined(SJPEG_USE_AVX2)
+void FdctAVX2(int16_t* coeffs, int num_blocks);
+void StoreHistoAVX2(const int16_t in[64], Histo* const histos, int nb_blocks);
+uint32_t QuantizeErrorAVX2(const int16_t in[64], const Quantizer* const Q);
+int QuantizeBlockAVX2(const int16_t in[64], int idx, const Quantizer* const Q,
+                      DCTCoeffs* const out, RunLevel* const rl);
+RGBToYUVBlockFunc GetBlockFuncAVX2(SjpegYUVMode mode, PixelFormat fmt);
+#endif
+
+// SSSE3 kernels, in the *_ssse3.cc files. Same rules, with SupportsSSSE3().
+// They only cover the packed RGB24 input.
+
+#if defined(SJPEG_USE_SSSE3)
+RGBToYUVBlockFunc GetBlockFuncSSSE3(SjpegYUVMode mode);
+void RowToIndexSSSE3(const uint8_t* src, int width, uint16_t* dst);
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 
 struct Encoder {
@@ -295,6 +564,8 @@ struct Encoder {
   // setters
   void SetQuality(float q);
   void SetCompressionMethod(int method);
+  // 'cache' (not owned) outlives the encoder. Can be null.
+  void SetQuantizerCache(QuantizerCache* cache) { quant_cache_ = cache; }
 
   // all-in-one init from EncoderParam.
   bool InitFromParam(const EncoderParam& param);
@@ -307,6 +578,27 @@ struct Encoder {
   virtual void GetSamples(int mb_x, int mb_y, bool clipped,
                           int16_t* out_blocks) = 0;
 
+  // Kernels, selected at runtime. Public for the tests.
+
+  // This function aggregates each 63 unquantized AC coefficients into an
+  // histogram for further analysis.
+  typedef void (*StoreHistoFunc)(const int16_t in[64], Histo* const histos,
+                                 int nb_blocks);
+  static StoreHistoFunc GetStoreHistoFunc();
+
+  // Quantizes the AC coeffs of 'in' into 'rl' and 'out', returns the DC.
+  typedef int (*QuantizeBlockFunc)(const int16_t in[64], int idx,
+                                   const Quantizer* const Q,
+                                   DCTCoeffs* const out, RunLevel* const rl);
+  static QuantizeBlockFunc GetQuantizeBlockFunc();
+
+  typedef uint32_t (*QuantizeErrorFunc)(const int16_t in[64],
+                                        const Quantizer* const Q);
+  static QuantizeErrorFunc GetQuantizeErrorFunc();
+
+  // Derives the reciprocals, bias and thresholds of 'q' from its matrices.
+  static void FinalizeQuantMatrix(Quantizer* const q, int bias);
+
  private:
   // setters
   void SetQuantMatrices(const uint8_t m[2][64]);
@@ -320,7 +612,11 @@ struct Encoder {
   void SetMetadata(const std::string& data, MetadataType type);
 
  private:
-  bool CheckBuffers();  // returns false in case of memory alloc error
+  bool CheckBuffers();  // returns false if the output can't grow
+  // Checks the parameters and writes the headers common to Encode() and
+  // BeginStream(), up to the metadata. Returns false in case of error.
+  // 'single_scan' is true if the samples can only be read once (BeginStream).
+  bool StartEncoding(bool single_scan = false);
 
   void Put16b(uint32_t size);
   void Put32b(uint32_t size);
@@ -335,10 +631,9 @@ struct Encoder {
   void WriteSOF();
   void WriteDHT();
   void WriteSOS();
+  void WriteDRI();
   void WriteEOI();
 
-  void ResetDCs();
-
   // collect transformed coeffs (unquantized) only
   void CollectCoeffs();
 
@@ -348,53 +643,115 @@ struct Encoder {
   // 2-pass Huffman optimizing scan
   void ResetEntropyStats();
   void AddEntropyStats(const DCTCoeffs* const coeffs,
-                       const RunLevel* const run_levels);
+                       const RunLevel* const run_levels,
+                       uint32_t freq_ac[2][256 + 1],
+                       uint32_t freq_dc[2][12 + 1]) const;
   void CompileEntropyStats();
   size_t EntropySize() const;  // size, in bits, derived from freq_ac_/freq_dc_
+  size_t EntropySize(const uint32_t freq_ac[2][256 + 1],
+                     const uint32_t freq_dc[2][12 + 1],
+                     const uint32_t dc_codes[2][12],
+                     const uint32_t ac_codes[2][256]) const;
+  // Total size, in bits, with the optimal tables for these frequencies.
+  // Doesn't touch the current tables.
+  size_t OptimizedSize(const uint32_t freq_ac[2][256 + 1],
+                       const uint32_t freq_dc[2][12 + 1]) const;
 
   void SinglePassScan();           // finalizing scan
   void SinglePassScanOptimized();  // optimize the Huffman table + finalize scan
 
+  // Quantizes all the blocks, and computes their DC codes. If 'coeffs' is not
+  // null, the DCTCoeffs are stored there and the run/levels in
+  // all_run_levels_. If 'collect_stats' is true, the symbol frequencies are
+  // added to freq_ac_[] / freq_dc_[]. Bands of MCU rows are run on executor_.
+  // Returns false in case of error.
+  bool QuantizeBands(DCTCoeffs* const coeffs, bool collect_stats);
+  // Same, for the MCU rows [mb_y_start, mb_y_end) and into 'band' only,
+  // using 'quants'. DC predictors start at 0. If 'bc' is not null, the bits
+  // with the current codes are counted there.
+  bool QuantizeBand(int mb_y_start, int mb_y_end, DCTCoeffs* coeffs,
+                    bool collect_stats, const Quantizer* const quants,
+                    MemoryManager* const memory, BandStats* const band,
+                    BitCounter* const bc);
+
+  // Same as SinglePassScan(), without restart intervals: windows of MCU rows
+  // are quantized concurrently while the previous window is entropy-coded.
+  void PipelinedScan();
+  // Quantizes the row 'mb_y' into coeffs[], run_levels[] (64 per block) and
+  // dcs[] (the DC values, to be coded in order later).
+  void QuantizeRow(int mb_y, DCTCoeffs* coeffs, RunLevel* run_levels,
+                   int* dcs);
+
   // quantize and compute run/levels from already stored coeffs
   void StoreRunLevels(DCTCoeffs* coeffs);
   // just write already stored run_levels & coeffs:
   void FinalPassScan(size_t nb_mbs, const DCTCoeffs* coeffs);
 
+  // Runs fn(begin)...fn(end - 1) on executor_, if any.
+  void ParallelFor(int begin, int end, const std::function<void(int)>& fn);
+
+  // Restart intervals. Each band of 'restart_rows_' MCU rows is coded with
+  // its own BitWriter and DC predictors, so they can be coded concurrently.
+  int NumBands() const;
+  // Calls code_band(band, bw) for every band, band #0 writing straight into
+  // bw_ and the others into scratch sinks, then appended in order.
+  // code_band() returns false in case of error.
+  void CodeBands(const std::function<bool(int, BitWriter*)>& code_band);
+  // Same, for 'nb_parts' parts of the scan. If 'stitch' is true, these are
+  // not restart intervals: each part is appended to the previous one at the
+  // bit position it ended at.
+  void CodeParts(int nb_parts, bool stitch,
+                 const std::function<bool(int, BitWriter*)>& code_part);
+  // Ends band 'band' in 'bw': byte-aligns and emits a RSTn marker, if needed.
+  // Returns false in case of error.
+  bool EndBand(int band, BitWriter* const bw) const;
+  // makes sure 'bw' can hold one more MCU, for a band of 'nb_rows' MCU rows.
+  bool ReserveMCU(int nb_rows, BitWriter* const bw) const;
+  // Called after each MCU row: commits the bytes of bw_ to the sink, if
+  // flush_rows_. Returns false in case of error.
+  bool EndRow(BitWriter* const bw) const {
+    return !flush_rows_ || bw != &bw_ || bw->CommitBytes();
+  }
+  // DC predictors must be reset at the start of each restart interval
+  bool IsRestart(int mb_x, int mb_y) const {
+    return (restart_rows_ > 0) && (mb_x == 0) && (mb_y % restart_rows_ == 0);
+  }
+
   // dichotomy loop
   void LoopScan();
 
   // Histogram pass
   void CollectHistograms();
 
-  typedef int (*QuantizeBlockFunc)(const int16_t in[64], int idx,
-                                   const Quantizer* const Q,
-                                   DCTCoeffs* const out, RunLevel* const rl);
   static QuantizeBlockFunc quantize_block_;
-  static QuantizeBlockFunc GetQuantizeBlockFunc();
 
   static int TrellisQuantizeBlock(const int16_t in[64], int idx,
                                   const Quantizer* const Q,
                                   DCTCoeffs* const out,
                                   RunLevel* const rl);
 
-  typedef uint32_t (*QuantizeErrorFunc)(const int16_t in[64],
-                                        const Quantizer* const Q);
   static QuantizeErrorFunc quantize_error_;
-  static QuantizeErrorFunc GetQuantizeErrorFunc();
 
-  void CodeBlock(const DCTCoeffs* const coeffs, const RunLevel* const rl);
+  void CodeBlock(const DCTCoeffs* const coeffs, const RunLevel* const rl,
+                 BitWriter* const bw) const;
   // returns DC code (4bits for length, 12bits for suffix), updates DC_predictor
   static uint16_t GenerateDCDiffCode(int DC, int* const DC_predictor);
 
-  static void FinalizeQuantMatrix(Quantizer* const q, int bias);
+  // Finalizes quants_[], through quant_cache_ if any.
+  void FinalizeQuantizers();
   void SetCostCodes(int idx);
   void InitCodes(bool only_ac);
 
   size_t HeaderSize() const;
+  size_t HeaderSize(const HuffmanTable* const tables[4]) const;
   void BlocksSize(int nb_mbs, const DCTCoeffs* coeffs,
                   const RunLevel* rl, sjpeg::BitCounter* const bc) const;
   float ComputeSize(const DCTCoeffs* coeffs);
-  float ComputePSNR() const;
+  float ComputePSNR() const { return ComputePSNR(quants_); }
+  float ComputePSNR(const Quantizer* const quants) const;
+  // Search result (size or PSNR) for the matrices in quants[], which are
+  // adjusted if use_adaptive_quant_. Only reads the encoder's state.
+  float EvaluateCandidate(Quantizer* const quants);
 
  protected:
   bool SetError();   // sets ok_ to false, and returns false
@@ -411,21 +768,50 @@ struct Encoder {
 
   void InitComponents();
 
+  // Row streaming, instead of Encode(). BeginStream() writes the headers,
+  // EncodeStreamRow() codes the next MCU row, GetSamples() being called for
+  // that row only, and FinishStream() completes the bitstream once all the
+  // rows are coded. The parameters must not call for several passes over
+  // the samples: no adaptive quantization, search or executor. All return
+  // false in case of error.
+  bool BeginStream();
+  bool EncodeStreamRow();
+  bool FinishStream();
+
+  // Called by Encode() once all the parameters are known, before any call
+  // to GetSamples(). Returns false in case of error.
+  virtual bool PrepareSamples() { return true; }
+  // Memory the sub-class needs for the samples from PrepareSamples() on, either
+  // for the whole picture or, if 'streamed', band by band. The latter is only
+  // asked for (stream_samples_ set before PrepareSamples()) if it is smaller,
+  // and then GetSamples() is called on the calling thread only, row after row
+  // during each pass over the picture.
+  virtual size_t SamplesMemory(bool /*streamed*/) const { return 0; }
+  bool stream_samples_ = false;
+  Executor* executor() const { return executor_; }
+  MemoryManager* memory() const { return memory_hook_; }
+  // Records the memory held by the samples, for EncoderStats.
+  void SetSamplesBytes(size_t size) { stats_.samples_bytes = size; }
+
   // data accessible to sub-classes implementing alternate input format
   int W_, H_;           // width, height
   int mb_w_, mb_h_;     // width / height in units of mcu
 
-  // Replicate an RGB source sub_w x sub_h block, expanding it to w x h size.
+  // Replicate an RGB source sub_w x sub_h block, expanding it to w x h size,
+  // into tmp[] (kReplicatedSize bytes). GetSamples() may run concurrently for
+  // different bands, so the caller owns this buffer, typically on its stack.
+  enum { kReplicatedSize = 4 * 16 * 16 };
   const uint8_t* GetReplicatedSamples(const uint8_t* rgb,    // block source
                                       int rgb_step,          // stride in source
                                       int sub_w, int sub_h,  // sub-block size
-                                      int w, int h);         // size of mcu
+                                      int w, int h,          // size of mcu
+                                      uint8_t* const tmp) const;
   // Replicate a 16x16 sub-block similarly.
   const uint8_t* GetReplicatedYSamples(const uint8_t* in, int step,
-                                       int sub_w, int sub_h);
+                                       int sub_w, int sub_h,
+                                       uint8_t* const tmp) const;
   // set blocks that are totally outside of the picture to an average value
   void AverageExtraLuma(int sub_w, int sub_h, int16_t* out);
-  uint8_t replicated_buffer_[4 * 16 * 16];  // tmp buffer for replication
   int pix_step_ = 3;  // bytes per input pixel (3=RGB, 4=BGRA/RGBA)
 
   sjpeg::RGBToYUVBlockFunc get_yuv_block_;  // set by GetBlockFunc()
@@ -460,7 +846,13 @@ struct Encoder {
 
   int q_bias_;           // [0..255]: rounding bias for quant. of AC coeffs.
   Quantizer quants_[2];  // quant matrices
-  int DCs_[3];           // DC predictors
+
+  int num_threads_;      // number of bands the scan can be split into
+  bool pipelined_;       // if true, no restart interval: see PipelinedScan()
+  bool flush_rows_;      // if true, bw_ is committed after each MCU row
+  int restart_rows_;     // MCU rows per restart interval, or 0 if none
+  Executor* executor_;   // if null, everything runs on the calling thread
+  std::shared_ptr<Executor> own_executor_;   // default pool, if needed
 
   // DCT coefficients storage, aligned
   static constexpr size_t ALIGN_CST = 15;
@@ -469,13 +861,72 @@ struct Encoder {
   bool have_coeffs_;          // true if the Fourier coefficients are stored
   bool AllocateBlocks(size_t num_blocks);  // returns false in case of error
   void DeallocateBlocks();
+  // If compact_coeffs_, the MCU rows are kept packed in packed_rows_[], and
+  // in_blocks_ only holds one row per band being collected.
+  bool compact_coeffs_;
+  uint8_t** packed_rows_;
+  // Number of bands the coefficients are collected over.
+  int NumCollectBands() const;
+  // Where band 'band' collects the coefficients of row 'mb_y'. StoreRow()
+  // then packs them, if compact_coeffs_, adding their size to *size. It
+  // returns false in case of error.
+  int16_t* RowCoeffs(int band, int mb_y) const;
+  bool StoreRow(int band, int mb_y, MemoryManager* const memory,
+                size_t* const size);
+
+  // Reads the stored coefficients back, MCU after MCU from the start of a
+  // given row. Next() returns those of the next MCU: if they are packed,
+  // they are unpacked into 'mcu' (6 * 64 values).
+  class CoeffsReader {
+   public:
+    CoeffsReader(const Encoder& enc, int mb_y)
+        : in_(enc.compact_coeffs_ ? nullptr : enc.RowCoeffs(0, mb_y)),
+          rows_(enc.compact_coeffs_ ? enc.packed_rows_ + mb_y : nullptr),
+          src_(nullptr), left_(0),
+          mb_w_(enc.mb_w_), mcu_blocks_(enc.mcu_blocks_) {}
+    const int16_t* Next(int16_t* const mcu) {
+      if (in_ != nullptr) {
+        const int16_t* const in = in_;
+        in_ += 64 * mcu_blocks_;
+        return in;
+      }
+      if (left_ == 0) {
+        src_ = *rows_++;
+        left_ = mb_w_;
+      }
+      --left_;
+      src_ = UnpackCoeffs(src_, mcu_blocks_, mcu);
+      return mcu;
+    }
+
+   private:
+    const int16_t* in_;              // if not compact
+    uint8_t* const* rows_;
+    const uint8_t* src_;
+    int left_;                       // MCUs left in the current row
+    const int mb_w_, mcu_blocks_;
+  };
+
+  // Memory budget (EncoderParam::max_memory_bytes), 0 if none.
+  size_t max_memory_;
+  // Rough estimate of the peak memory used by the current strategy.
+  size_t EstimateMemory() const;
+  // Switches to leaner strategies until the estimate fits in max_memory_.
+  // Returns false if it can't.
+  bool FitMemoryBudget(bool single_scan);
 
   // these are for regular compression methods 0 or 2.
   RunLevel base_run_levels_[64];
 
   // this is the extra memory for compression method 1
-  RunLevel* all_run_levels_;
-  size_t nb_run_levels_, max_run_levels_;
+  RunLevelStore all_run_levels_;
+
+  // row streaming state, see BeginStream()
+  DCTCoeffs* stream_coeffs_;      // one MCU row, or all of them if optimizing
+  RunLevel* stream_run_levels_;   // one MCU row, 64 per block
+  int* stream_dcs_;               // DC values of the MCU row
+  int stream_DCs_[MAX_COMP];      // DC predictors
+  int stream_row_;                // next MCU row to code
 
   // Huffman_tables_ indices:
   //  0: luma dc, 1: chroma dc, 2: luma ac, 3: chroma ac
@@ -498,17 +949,13 @@ struct Encoder {
 
   // Histogram handling
 
-  // This function aggregates each 63 unquantized AC coefficients into an
-  // histogram for further analysis.
-  typedef void (*StoreHistoFunc)(const int16_t in[64], Histo* const histos,
-                                 int nb_blocks);
   static StoreHistoFunc store_histo_;
-  static StoreHistoFunc GetStoreHistoFunc();  // select between the above.
 
   // Provided the AC histograms have been stored with StoreHisto(), this
   // function will analyze impact of varying the quantization scales around
   // initial values, trading distortion for bit-rate in a controlled way.
-  void AnalyseHisto();
+  void AnalyseHisto() { AnalyseHisto(quants_); }
+  void AnalyseHisto(Quantizer* const quants) const;
   void ResetHisto();  // initialize histos_[]
   Histo histos_[2];
 
@@ -520,6 +967,15 @@ struct Encoder {
   // lower memory management
   MemoryManager* memory_hook_;
 
+  QuantizerCache* quant_cache_;
+
+  // Memory statistics (EncoderParam::stats). If requested, memory_hook_ is
+  // substituted with counting_memory_, forwarding to the original one.
+  EncoderStats stats_;
+  EncoderStats* stats_out_;
+  std::unique_ptr<CountingMemory> counting_memory_;
+  void ReportStats();   // fills *stats_out_, if not null
+
   static const float kHistoWeight[QSIZE];
 
   static void (*fDCT_)(int16_t* in, int num_blocks);
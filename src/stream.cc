@@ -0,0 +1,148 @@
+// Copyright 2026 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//  Row-streaming encoding: StreamEncoder
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include "sjpegi.h"
+
+namespace sjpeg {
+
+namespace {
+
+// Samples are read from the rows of the current MCU row only: either
+// straight from the caller's buffer, or from a strip the pushed rows are
+// gathered into.
+class StreamingEncoder final : public Encoder {
+ public:
+  StreamingEncoder(SjpegYUVMode yuv_mode, int W, int H, ByteSink* const sink,
+                   MemoryManager* const memory)
+      : Encoder(yuv_mode, W, H, sink, memory) {}
+  ~StreamingEncoder() override { Free(strip_); }
+
+  bool Begin(const EncoderParam& param) {
+    if (!ok_ || !InitFromParam(param) || !BeginStream()) return false;
+    strip_step_ = pix_step_ * W_;
+    strip_ = Alloc<uint8_t>((size_t)strip_step_ * block_h_);
+    SetSamplesBytes((size_t)strip_step_ * block_h_);
+    return ok_;
+  }
+
+  bool PushRows(const uint8_t* rgb, int stride, int nb_rows) {
+    if (!ok_) return false;
+    if (nb_rows < 0 || nb_rows > H_ - nb_rows_ ||
+        (nb_rows > 0 && (rgb == nullptr || std::abs(stride) < strip_step_))) {
+      return SetError();
+    }
+    while (nb_rows > 0) {
+      int n;
+      if (nb_strip_rows_ == 0 && nb_rows >= block_h_) {  // no copy needed
+        n = block_h_;
+        rows_ = rgb;
+        rows_step_ = stride;
+      } else {
+        n = std::min(nb_rows, block_h_ - nb_strip_rows_);
+        for (int y = 0; y < n; ++y) {
+          memcpy(strip_ + (size_t)(nb_strip_rows_ + y) * strip_step_,
+                 rgb + (ptrdiff_t)y * stride, strip_step_);
+        }
+        nb_strip_rows_ += n;
+        rows_ = strip_;
+        rows_step_ = strip_step_;
+      }
+      rgb += (ptrdiff_t)n * stride;
+      nb_rows -= n;
+      nb_rows_ += n;
+      if (rows_ != strip_ || nb_strip_rows_ == block_h_ || nb_rows_ == H_) {
+        if (!EncodeStreamRow()) return false;
+        nb_strip_rows_ = 0;
+      }
+    }
+    return true;
+  }
+
+  bool Finish() {
+    if (ok_ && nb_rows_ != H_) return SetError();
+    return FinishStream();
+  }
+
+  void GetSamples(int mb_x, int mb_y, bool clipped, int16_t* out) override {
+    const uint8_t* rgb = rows_ + pix_step_ * mb_x * block_w_;
+    int step = rows_step_;
+    uint8_t tmp[kReplicatedSize];
+    const int sub_w = W_ - mb_x * block_w_;
+    const int sub_h = H_ - mb_y * block_h_;
+    if (clipped) {
+      rgb = GetReplicatedSamples(rgb, step, sub_w, sub_h,
+                                 block_w_, block_h_, tmp);
+      step = pix_step_ * block_w_;
+    }
+    get_yuv_block_(rgb, step, out);
+    if (clipped && yuv_mode_ == SJPEG_YUV_420) {
+      AverageExtraLuma(sub_w, sub_h, out);
+    }
+  }
+
+ private:
+  uint8_t* strip_ = nullptr;   // rows of the MCU row being gathered
+  int strip_step_ = 0;
+  int nb_strip_rows_ = 0;      // rows gathered in strip_ so far
+  int nb_rows_ = 0;            // rows pushed so far
+  const uint8_t* rows_ = nullptr;   // rows of the MCU row being coded
+  int rows_step_ = 0;
+};
+
+}   // namespace
+
+StreamEncoder::~StreamEncoder() { delete enc_; }
+
+bool StreamEncoder::Begin(int width, int height, const EncoderParam& param,
+                          ByteSink* const sink) {
+  delete enc_;
+  enc_ = nullptr;
+  if (sink == nullptr) return false;
+  // no second look at the samples: single pass tools only
+  EncoderParam stream_param = param;
+  stream_param.adaptive_quantization = false;
+  stream_param.passes = 1;
+  stream_param.num_threads = 1;
+  stream_param.executor = nullptr;
+  SjpegYUVMode yuv_mode = param.yuv_mode;
+  if (yuv_mode == SJPEG_YUV_AUTO || yuv_mode == SJPEG_YUV_SHARP) {
+    yuv_mode = SJPEG_YUV_420;
+  }
+  StreamingEncoder* const enc =
+      new (std::nothrow) StreamingEncoder(yuv_mode, width, height, sink,
+                                          param.memory);
+  enc_ = enc;
+  return (enc != nullptr) && enc->Begin(stream_param);
+}
+
+bool StreamEncoder::PushRows(const uint8_t* rgb, int stride, int nb_rows) {
+  return (enc_ != nullptr) &&
+         static_cast<StreamingEncoder*>(enc_)->PushRows(rgb, stride, nb_rows);
+}
+
+bool StreamEncoder::Finish() {
+  return (enc_ != nullptr) && static_cast<StreamingEncoder*>(enc_)->Finish();
+}
+
+}   // namespace sjpeg
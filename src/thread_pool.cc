@@ -0,0 +1,124 @@
+// Copyright 2026 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//  Default Executor: a plain pool of std::thread
+//
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>  // NOLINT
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>  // NOLINT
+#include <new>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "sjpeg.h"
+
+namespace sjpeg {
+
+////////////////////////////////////////////////////////////////////////////////
+// The thread calling ParallelFor() always takes part in the loop, and doesn't
+// return before the last index is done. Hence, nested calls can't deadlock:
+// in the worst case, the caller does all the work itself. Idle workers pick
+// the oldest job with indices left.
+
+namespace {
+
+class ThreadPool : public Executor {
+ public:
+  explicit ThreadPool(int num_threads) : quit_(false) {
+    for (int n = 1; n < num_threads; ++n) {   // the caller is the n-th thread
+      workers_.emplace_back(&ThreadPool::Loop, this);
+    }
+  }
+  ~ThreadPool() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      quit_ = true;
+    }
+    work_cv_.notify_all();
+    for (std::thread& worker : workers_) worker.join();
+  }
+
+  void ParallelFor(int begin, int end,
+                   const std::function<void(int)>& fn) override {
+    if (end - begin <= 1 || workers_.empty()) {
+      for (int i = begin; i < end; ++i) fn(i);
+      return;
+    }
+    Job job(fn, begin, end);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_.push_back(&job);
+    }
+    work_cv_.notify_all();
+    job.Run();
+    // all indices are taken now, but some might still be running elsewhere
+    std::unique_lock<std::mutex> lock(mutex_);
+    Drop(&job);
+    done_cv_.wait(lock, [&job]() { return job.num_users == 0; });
+  }
+
+ private:
+  struct Job {
+    Job(const std::function<void(int)>& f, int first, int last)
+        : fn(f), next(first), end(last), num_users(0) {}
+    void Run() {
+      for (int i = next++; i < end; i = next++) fn(i);
+    }
+    const std::function<void(int)>& fn;
+    std::atomic<int> next;
+    const int end;
+    int num_users;   // workers still inside Run(). Guarded by mutex_.
+  };
+
+  void Loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      work_cv_.wait(lock, [this]() { return quit_ || !jobs_.empty(); });
+      if (quit_) return;
+      Job* const job = jobs_.front();
+      ++job->num_users;
+      lock.unlock();
+      job->Run();
+      lock.lock();
+      Drop(job);   // exhausted
+      if (--job->num_users == 0) done_cv_.notify_all();
+    }
+  }
+
+  // removes 'job' from the queue, if still there. mutex_ must be held.
+  void Drop(Job* const job) {
+    const auto it = std::find(jobs_.begin(), jobs_.end(), job);
+    if (it != jobs_.end()) jobs_.erase(it);
+  }
+
+  std::mutex mutex_;
+  std::condition_variable work_cv_;   // signaled when a job is queued
+  std::condition_variable done_cv_;   // signaled when a job loses its users
+  std::deque<Job*> jobs_;             // jobs that may have indices left
+  bool quit_;
+  std::vector<std::thread> workers_;
+};
+
+}   // namespace
+
+std::shared_ptr<Executor> MakeThreadPool(int num_threads) {
+  return std::shared_ptr<Executor>(new (std::nothrow) ThreadPool(num_threads));
+}
+
+}   // namespace sjpeg
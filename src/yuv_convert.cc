@@ -19,6 +19,8 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <functional>
 #include <memory>
 #include <mutex>  // NOLINT
 #include <vector>
@@ -540,16 +542,16 @@ static void InterpolateTwoRows(const fixed_y_t* const best_y,
   }
 }
 
+// Emits the rows [first_row, last_row) of best_y[] / best_uv[], first_row
+// being even.
 static void ConvertWRGBToYUV(const fixed_y_t* best_y,
                              const fixed_t* best_uv,
-                             int width, int height,
+                             int width, int first_row, int last_row,
                              uint8_t* y_plane,
                              uint8_t* u_plane, uint8_t* v_plane) {
   const int w = (width + 1) & ~1;
-  const int h = (height + 1) & ~1;
   const int uv_w = w >> 1;
-  const int uv_h = h >> 1;
-  for (int j = 0; j < height; ++j) {
+  for (int j = first_row; j < last_row; ++j) {
     const int off = (j >> 1) * 3 * uv_w;
     for (int i = 0; i < width; ++i) {
       const int W = best_y[i + j * w];
@@ -560,7 +562,7 @@ static void ConvertWRGBToYUV(const fixed_y_t* best_y,
     }
     y_plane += width;
   }
-  for (int j = 0; j < uv_h; ++j) {
+  for (int j = first_row >> 1; j < (last_row + 1) >> 1; ++j) {
     for (int i = 0; i < uv_w; ++i) {
       const int off = i + j * 3 * uv_w;
       const int r = best_uv[off + 0 * uv_w];
@@ -577,8 +579,24 @@ static void ConvertWRGBToYUV(const fixed_y_t* best_y,
 //------------------------------------------------------------------------------
 // Main function
 
-static void PreprocessARGB(const uint8_t* const rgb,
+// Size of PreprocessARGB()'s scratch memory.
+static size_t ScratchSize(int width, int height) {
+  const int w = (width + 1) & ~1;
+  const int h = (height + 1) & ~1;
+  const int uv_w = w >> 1;
+  const int uv_h = h >> 1;
+  const size_t y_size = (size_t)w * h;
+  const size_t uv_size = (size_t)uv_w * 3 * uv_h;
+  return (w * 3 * 2 + 2 * y_size + w * 2 + 2 * uv_size + uv_w * 3 * 1)
+       * sizeof(fixed_y_t);
+}
+
+// Converts the 'height' rows of 'rgb', but only emits the rows
+// [first_row, last_row) into the planes. The other rows are context.
+static bool PreprocessARGB(const uint8_t* const rgb,
                            int width, int height, size_t stride,
+                           int first_row, int last_row,
+                           MemoryManager* const memory,
                            uint8_t* y_plane,
                            uint8_t* u_plane, uint8_t* v_plane) {
   // we expand the right/bottom border if needed
@@ -588,17 +606,19 @@ static void PreprocessARGB(const uint8_t* const rgb,
   const int uv_h = h >> 1;
   uint64_t prev_diff_y_sum = ~0;
 
-  InitGammaTablesF();
-  InitFunctionPointers();
-
-  // TODO(skal): allocate one big memory chunk instead.
-  vector<fixed_y_t> tmp_buffer(w * 3 * 2);
-  vector<fixed_y_t> best_y(w * h);
-  vector<fixed_y_t> target_y(w * h);
-  vector<fixed_y_t> best_rgb_y(w * 2);
-  vector<fixed_t> best_uv(uv_w * 3 * uv_h);
-  vector<fixed_t> target_uv(uv_w * 3 * uv_h);
-  vector<fixed_t> best_rgb_uv(uv_w * 3 * 1);
+  // fixed_t and fixed_y_t have the same size: use one chunk for all.
+  const size_t y_size = (size_t)w * h;
+  const size_t uv_size = (size_t)uv_w * 3 * uv_h;
+  fixed_y_t* const mem = reinterpret_cast<fixed_y_t*>(
+      memory->Alloc(ScratchSize(width, height)));
+  if (mem == nullptr) return false;
+  fixed_y_t* const tmp_buffer = mem;
+  fixed_y_t* const best_y = tmp_buffer + w * 3 * 2;
+  fixed_y_t* const target_y = best_y + y_size;
+  fixed_y_t* const best_rgb_y = target_y + y_size;
+  fixed_t* const best_uv = reinterpret_cast<fixed_t*>(best_rgb_y + w * 2);
+  fixed_t* const target_uv = best_uv + uv_size;
+  fixed_t* const best_rgb_uv = target_uv + uv_size;
   const uint64_t diff_y_threshold = static_cast<uint64_t>(3.0 * w * h);
 
   assert(width >= kMinDimensionIterativeConversion);
@@ -609,9 +629,9 @@ static void PreprocessARGB(const uint8_t* const rgb,
     const int is_last_row = (j == height - 1);
     fixed_y_t* const src1 = &tmp_buffer[0 * w];
     fixed_y_t* const src2 = &tmp_buffer[3 * w];
-    const int rgb_off = j * stride;
-    const int y_off = j * w;
-    const int uv_off = (j >> 1) * 3 * uv_w;
+    const size_t rgb_off = j * stride;
+    const size_t y_off = (size_t)j * w;
+    const size_t uv_off = (size_t)(j >> 1) * 3 * uv_w;
 
     // prepare two rows of input
     ImportOneRow(rgb + rgb_off, width, src1);
@@ -635,11 +655,11 @@ static void PreprocessARGB(const uint8_t* const rgb,
     uint64_t diff_y_sum = 0;
 
     for (int j = 0; j < h; j += 2) {
-      const int uv_off = (j >> 1) * 3 * uv_w;
+      const size_t uv_off = (size_t)(j >> 1) * 3 * uv_w;
       fixed_y_t* const src1 = &tmp_buffer[0 * w];
       fixed_y_t* const src2 = &tmp_buffer[3 * w];
       const fixed_t* const next_uv = cur_uv + ((j < h - 2) ? 3 * uv_w : 0);
-      InterpolateTwoRows(&best_y[j * w], prev_uv, cur_uv, next_uv,
+      InterpolateTwoRows(&best_y[(size_t)j * w], prev_uv, cur_uv, next_uv,
                          w, src1, src2);
       prev_uv = cur_uv;
       cur_uv = next_uv;
@@ -649,8 +669,9 @@ static void PreprocessARGB(const uint8_t* const rgb,
       UpdateChroma(src1, src2, &best_rgb_uv[0], uv_w);
 
       // update two rows of Y and one row of RGB
-      diff_y_sum += kSharpUpdateY(&target_y[j * w],
-                                  &best_rgb_y[0], &best_y[j * w], 2 * w);
+      diff_y_sum += kSharpUpdateY(&target_y[(size_t)j * w],
+                                  &best_rgb_y[0], &best_y[(size_t)j * w],
+                                  2 * w);
       kSharpUpdateRGB(&target_uv[uv_off],
                       &best_rgb_uv[0], &best_uv[uv_off], 3 * uv_w);
     }
@@ -662,36 +683,90 @@ static void PreprocessARGB(const uint8_t* const rgb,
     prev_diff_y_sum = diff_y_sum;
   }
   // final reconstruction
-  ConvertWRGBToYUV(&best_y[0], &best_uv[0], width, height,
+  ConvertWRGBToYUV(best_y, best_uv, width, first_row, last_row,
                    y_plane, u_plane, v_plane);
+  memory->Free(mem);
+  return true;
 }
 
+// The picture is converted in bands of kSharpYUVBandRows rows, independently.
+// Each band is extended by kSharpBandMargin rows of context on each side,
+// which are converted too but not emitted: changes only spread by a couple
+// of rows per iteration, so they hide the band's artificial borders.
+// The working memory is hence O(width x band height) per band.
+static const int kSharpBandMargin = 16;   // must be even
+
 }  // namespace sjpeg
 
 ////////////////////////////////////////////////////////////////////////////////
-// Entry point
-
-void sjpeg::ApplySharpYUVConversion(const uint8_t* const rgb,
-                                    int W, int H, int stride,
-                                    uint8_t* y_plane,
-                                    uint8_t* u_plane, uint8_t* v_plane) {
+// Entry points
+
+bool sjpeg::ApplySharpYUVConversionBand(const uint8_t* const rgb,
+                                        int W, int H, int stride, int band,
+                                        uint8_t* y_plane,
+                                        uint8_t* u_plane, uint8_t* v_plane,
+                                        MemoryManager* const memory) {
+  const int y_start = band * kSharpYUVBandRows;
+  const int y_end = std::min(y_start + kSharpYUVBandRows, H);
   if (W <= kMinDimensionIterativeConversion ||
       H <= kMinDimensionIterativeConversion) {
     const int uv_w = (W + 1) >> 1;
-    for (int y = 0; y < H; y += 2) {
-      const uint8_t* const rgb1 = rgb + y * stride;
+    for (int y = y_start; y < y_end; y += 2) {
+      const uint8_t* const rgb1 = rgb + (size_t)y * stride;
       const uint8_t* const rgb2 = (y < H - 1) ? rgb1 + stride : rgb1;
-      ConvertRowToY(rgb1, W, &y_plane[y * W]);
+      const int j = y - y_start;
+      ConvertRowToY(rgb1, W, &y_plane[j * W]);
       if (y < H - 1) {
-        ConvertRowToY(rgb2, W, &y_plane[(y + 1) * W]);
+        ConvertRowToY(rgb2, W, &y_plane[(j + 1) * W]);
       }
       ConvertRowToUV(rgb1, rgb2, W,
-                     &u_plane[(y >> 1) * uv_w],
-                     &v_plane[(y >> 1) * uv_w]);
+                     &u_plane[(j >> 1) * uv_w],
+                     &v_plane[(j >> 1) * uv_w]);
     }
+    return true;
+  }
+  InitGammaTablesF();
+  InitFunctionPointers();
+  const int top = std::max(y_start - kSharpBandMargin, 0);
+  const int bottom = std::min(y_end + kSharpBandMargin, H);
+  return PreprocessARGB(rgb + (size_t)top * stride, W, bottom - top, stride,
+                        y_start - top, y_end - top, memory,
+                        y_plane, u_plane, v_plane);
+}
+
+size_t sjpeg::SharpYUVConversionMemory(int W, int H) {
+  if (W <= kMinDimensionIterativeConversion ||
+      H <= kMinDimensionIterativeConversion) {
+    return 0;
+  }
+  return ScratchSize(W, std::min(kSharpYUVBandRows + 2 * kSharpBandMargin, H));
+}
+
+bool sjpeg::ApplySharpYUVConversion(const uint8_t* const rgb,
+                                    int W, int H, int stride,
+                                    uint8_t* y_plane,
+                                    uint8_t* u_plane, uint8_t* v_plane,
+                                    MemoryManager* const memory,
+                                    Executor* const executor) {
+  const int uv_w = (W + 1) >> 1;
+  const int nb_bands = (H + kSharpYUVBandRows - 1) / kSharpYUVBandRows;
+  LockedMemory locked_memory(memory);
+  vector<char> oks(nb_bands, false);
+  const std::function<void(int)> convert = [&](int band) {
+    const size_t y_start = (size_t)band * kSharpYUVBandRows;
+    oks[band] = ApplySharpYUVConversionBand(
+        rgb, W, H, stride, band, y_plane + y_start * W,
+        u_plane + (y_start >> 1) * uv_w, v_plane + (y_start >> 1) * uv_w,
+        &locked_memory);
+  };
+  if (executor != nullptr && nb_bands > 1) {
+    executor->ParallelFor(0, nb_bands, convert);
   } else {
-    PreprocessARGB(rgb, W, H, stride, y_plane, u_plane, v_plane);
+    for (int band = 0; band < nb_bands; ++band) convert(band);
   }
+  bool ok = true;
+  for (int band = 0; band < nb_bands; ++band) ok = ok && oks[band];
+  return ok;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -21,11 +21,19 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <functional>
+#include <memory>
 #include <string>
 #include <thread>  // NOLINT
 #include <vector>
 
 #include "sjpeg.h"
+#include "sjpegi.h"   // for the SIMD kernels
+
+namespace sjpeg {
+extern bool ForceSlowCImplementation;   // in enc.cc
+}
 
 namespace {
 
@@ -453,6 +461,79 @@ TEST(AllocationFailure) {
   }
 }
 
+// Remembers the largest allocation.
+class PeakMemory : public TrackingMemory {
+ public:
+  virtual ~PeakMemory() {}
+  virtual void* Alloc(size_t size) {
+    if (size > largest) largest = size;
+    return TrackingMemory::Alloc(size);
+  }
+  size_t largest = 0;
+};
+
+// Also counts the bytes in use, and their peak.
+class UsageMemory : public TrackingMemory {
+ public:
+  virtual ~UsageMemory() {}
+  virtual void* Alloc(size_t size) {
+    void* const ptr = TrackingMemory::Alloc(size);
+    if (ptr != nullptr) {
+      sizes.push_back(size);
+      used += size;
+      peak = std::max(peak, used);
+    }
+    return ptr;
+  }
+  virtual void Free(void* const ptr) {
+    for (size_t i = 0; i < live.size(); ++i) {
+      if (live[i] == ptr) {
+        used -= sizes[i];
+        sizes.erase(sizes.begin() + i);
+        break;
+      }
+    }
+    TrackingMemory::Free(ptr);
+  }
+  size_t used = 0, peak = 0;
+  std::vector<size_t> sizes;   // same order as 'live'
+};
+
+// The sharp conversion works on bands of rows. Their result mustn't depend
+// on the number of threads, and their scratch memory not grow with height.
+TEST(SharpYUVBands) {
+  const int kWidth = 64, kHeight = 600;
+  const std::vector<uint8_t> rgb = MakeRGB(kWidth, kHeight);
+  const std::shared_ptr<sjpeg::Executor> pool = sjpeg::MakeThreadPool(4);
+  std::string ref;
+  for (int threaded = 0; threaded <= 1; ++threaded) {
+    PeakMemory memory;
+    sjpeg::EncoderParam param(90.f);
+    param.yuv_mode = SJPEG_YUV_SHARP;
+    // same restart intervals (none), but a parallel conversion
+    param.executor = threaded ? pool.get() : nullptr;
+    param.memory = &memory;
+    std::string out;
+    CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &out));
+    CHECK(HasSize(out, kWidth, kHeight));
+    CHECK(memory.largest < 4u * kWidth * kHeight);
+    CHECK(memory.live.empty());
+    if (!threaded) ref = out;
+    CHECK(out == ref);
+  }
+  for (int num_ok = 0; num_ok < 6; ++num_ok) {
+    FailingMemory memory(num_ok);
+    sjpeg::EncoderParam param(90.f);
+    param.yuv_mode = SJPEG_YUV_SHARP;
+    param.num_threads = 2;
+    param.memory = &memory;
+    std::string out;
+    const bool ok = EncodeRGB(rgb, kWidth, kHeight, param, &out);
+    CHECK(ok == (memory.num_refused == 0));
+    CHECK(memory.live.empty());
+  }
+}
+
 TEST(Dimensions) {
   const int kWidth = 35, kHeight = 19;
   const std::vector<uint8_t> rgb = MakeRGB(kWidth, kHeight);
@@ -622,6 +703,762 @@ TEST(CompressionMethod) {
   CHECK(out[10] == out[9]);    //  9 -> 8
 }
 
+// Positions of the 'marker' (0xff, code) in the bitstream.
+std::vector<size_t> FindMarkers(const std::string& jpg, uint8_t code) {
+  std::vector<size_t> pos;
+  for (size_t i = 0; i + 1 < jpg.size(); ++i) {
+    if ((uint8_t)jpg[i] == 0xff && (uint8_t)jpg[i + 1] == code) pos.push_back(i);
+  }
+  return pos;
+}
+
+// With num_threads > 1, the scan is split into restart intervals that are
+// coded concurrently. The result must not depend on the scheduling.
+TEST(RestartIntervals) {
+  const int kWidth = 72, kHeight = 64;   // 4 MCU rows in 4:2:0
+  const std::vector<uint8_t> rgb = MakeRGB(kWidth, kHeight);
+  for (int tools = 0; tools < 8; ++tools) {
+    for (int passes = 1; passes <= 3; passes += 2) {
+      sjpeg::EncoderParam param(75.f);
+      param.yuv_mode = SJPEG_YUV_420;
+      param.Huffman_compress = (tools & 1) != 0;
+      param.adaptive_quantization = (tools & 2) != 0;
+      param.use_trellis = (tools & 4) != 0;
+      if (passes > 1) {
+        param.target_mode = sjpeg::EncoderParam::TARGET_SIZE;
+        param.target_value = 3000.f;
+        param.passes = passes;
+      }
+      std::string ref, single;
+      CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &ref));
+      param.num_threads = 1;
+      CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &single));
+      CHECK(single == ref);
+      CHECK(FindMarkers(ref, 0xdd).empty());   // no DRI
+
+      param.num_threads = 4;
+      std::string out[2];
+      for (int run = 0; run < 2; ++run) {
+        CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &out[run]));
+        CHECK(HasSize(out[run], kWidth, kHeight));
+      }
+      CHECK(out[0] == out[1]);
+      CHECK(FindMarkers(out[0], 0xdd).size() == 1);
+      for (int n = 0; n < 3; ++n) {
+        CHECK(FindMarkers(out[0], 0xd0 + n).size() == 1);
+      }
+      CHECK(FindMarkers(out[0], 0xd3).empty());
+    }
+  }
+  // the memory manager is still used for everything, and an allocation
+  // failure in a band is reported.
+  for (int num_ok = 0; num_ok < 12; ++num_ok) {
+    FailingMemory memory(num_ok);
+    sjpeg::EncoderParam param(80.f);
+    param.memory = &memory;
+    param.num_threads = 3;
+    std::string out;
+    const bool ok = EncodeRGB(rgb, kWidth, kHeight, param, &out);
+    CHECK(ok == (memory.num_refused == 0));
+    CHECK(memory.num_foreign_frees == 0);
+    CHECK(memory.live.empty());
+  }
+}
+
+// Runs everything on the calling thread, in reverse order, and records what
+// it was asked to do.
+class SerialExecutor : public sjpeg::Executor {
+ public:
+  void ParallelFor(int begin, int end,
+                   const std::function<void(int)>& fn) override {
+    ++num_calls;
+    for (int i = end - 1; i >= begin; --i) fn(i);
+  }
+  int num_calls = 0;
+};
+
+// With flush_rows, the final scan reaches the sink one MCU row at a time, and
+// the bitstream doesn't change.
+TEST(FlushRows) {
+  const int kWidth = 64, kHeight = 200;
+  const std::vector<uint8_t> rgb = MakeRGB(kWidth, kHeight);
+  const int kNumRows = (kHeight + 15) / 16;
+  for (int mode = 0; mode < 4; ++mode) {
+    sjpeg::EncoderParam param(75.f);
+    param.yuv_mode = SJPEG_YUV_420;
+    param.Huffman_compress = (mode & 1) != 0;
+    if (mode & 2) {
+      param.num_threads = 3;
+      param.pipelined = true;
+    }
+    std::string ref;
+    CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &ref));
+    std::string out;
+    int num_writes = 0;
+    const auto sink = sjpeg::MakeByteSink(
+        [&out, &num_writes](const uint8_t* data, size_t size) {
+          out.append(reinterpret_cast<const char*>(data), size);
+          ++num_writes;
+          return true;
+        });
+    param.flush_rows = true;
+    CHECK(sjpeg::Encode(rgb.data(), kWidth, kHeight, 3 * kWidth, param,
+                        sink.get()));
+    CHECK(out == ref);
+    CHECK(num_writes > kNumRows);
+  }
+  // a failing write aborts the encoding
+  int num_writes = 0;
+  const auto failing = sjpeg::MakeByteSink(
+      [&num_writes](const uint8_t*, size_t) { return (++num_writes < 3); });
+  sjpeg::EncoderParam param(75.f);
+  param.flush_rows = true;
+  CHECK(!sjpeg::Encode(rgb.data(), kWidth, kHeight, 3 * kWidth, param,
+                       failing.get()));
+  CHECK(num_writes == 3);
+}
+
+// A buffer of SjpegMaxOutputSize() bytes is always enough, and a smaller one
+// is never overrun.
+TEST(FixedBufferSink) {
+  const int kWidth = 97, kHeight = 61;
+  const std::vector<uint8_t> rgb = MakeRGB(kWidth, kHeight);
+  uint8_t flat[2][64];
+  memset(flat, 1, sizeof(flat));
+  const SjpegYUVMode kModes[] = { SJPEG_YUV_AUTO, SJPEG_YUV_420,
+                                  SJPEG_YUV_444, SJPEG_YUV_400 };
+  for (size_t m = 0; m < ARRAY_SIZE(kModes); ++m) {
+    for (int num_threads = 1; num_threads <= 3; num_threads += 2) {
+      sjpeg::EncoderParam param;
+      param.SetQuantization(flat);   // largest output
+      param.SetLimitQuantization(false);
+      param.yuv_mode = kModes[m];
+      param.num_threads = num_threads;
+      param.exif.assign(1000, 'e');
+      std::string ref;
+      CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &ref));
+
+      const size_t capacity = sjpeg::MaxOutputSize(kWidth, kHeight, param);
+      CHECK(capacity >= ref.size());
+      std::vector<uint8_t> buf(capacity + 16, 0xaa);
+      sjpeg::FixedBufferSink sink(buf.data(), capacity);
+      CHECK(sjpeg::Encode(rgb.data(), kWidth, kHeight, 3 * kWidth, param,
+                          &sink));
+      CHECK(sink.size() == ref.size());
+      CHECK(!memcmp(buf.data(), ref.data(), ref.size()));
+
+      const size_t small = ref.size() / 2;
+      std::fill(buf.begin(), buf.end(), 0xaa);
+      sjpeg::FixedBufferSink small_sink(buf.data(), small);
+      CHECK(!sjpeg::Encode(rgb.data(), kWidth, kHeight, 3 * kWidth, param,
+                           &small_sink));
+      CHECK(small_sink.size() == 0);
+      bool untouched = true;
+      for (size_t i = small; i < buf.size(); ++i) untouched &= (buf[i] == 0xaa);
+      CHECK(untouched);
+    }
+  }
+  CHECK(SjpegMaxOutputSize(0, 16, SJPEG_YUV_420, 0) == 0);
+  CHECK(SjpegMaxOutputSize(16, 16, SJPEG_YUV_420, 0) > 0);
+}
+
+// Reads a whole file back from the start.
+std::string ReadBack(FILE* const file) {
+  std::string data;
+  rewind(file);
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), file)) > 0) data.append(buf, n);
+  return data;
+}
+
+TEST(FileSinks) {
+  const int kWidth = 300, kHeight = 211;
+  const std::vector<uint8_t> rgb = MakeRGB(kWidth, kHeight);
+  sjpeg::EncoderParam param(90.f);
+  std::string ref;
+  CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &ref));
+  for (int mmap = 0; mmap <= 1; ++mmap) {
+    for (int flush_rows = 0; flush_rows <= 1; ++flush_rows) {
+      FILE* const file = tmpfile();
+      if (!CHECK(file != nullptr)) return;
+      const auto sink = mmap ? sjpeg::MakeMmapFileSink(fileno(file))
+                             : sjpeg::MakeFdSink(fileno(file));
+      if (sink == nullptr) {   // not available on this system
+        fclose(file);
+        return;
+      }
+      param.flush_rows = (flush_rows != 0);
+      CHECK(sjpeg::Encode(rgb.data(), kWidth, kHeight, 3 * kWidth, param,
+                          sink.get()));
+      CHECK(ReadBack(file) == ref);
+      fclose(file);
+    }
+  }
+}
+
+// The run/levels of a large picture span several chunks of storage. All the
+// ways of reading them back must cross the chunk boundaries the same way.
+TEST(RunLevelChunks) {
+  const int kWidth = 400, kHeight = 300;
+  const std::vector<uint8_t> rgb = MakeRGB(kWidth, kHeight);
+  const int kStride = 3 * kWidth;
+  for (int tools = 0; tools < 4; ++tools) {
+    sjpeg::EncoderParam param(97.f);
+    param.adaptive_quantization = (tools & 1) != 0;
+    param.use_trellis = (tools & 2) != 0;
+    std::string ref, out;
+    CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &ref));
+    param.num_threads = 5;
+    param.pipelined = true;   // the scan is stitched from 5 segments
+    CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &out));
+    CHECK(out == ref);
+  }
+  sjpeg::EncoderParam param(97.f);
+  param.yuv_mode = SJPEG_YUV_420;
+  param.adaptive_quantization = false;
+  std::string ref, out;
+  CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &ref));
+  const auto sink = sjpeg::MakeByteSink(&out);
+  sjpeg::StreamEncoder enc;
+  CHECK(enc.Begin(kWidth, kHeight, param, sink.get()));
+  CHECK(enc.PushRows(rgb.data(), kStride, kHeight));
+  CHECK(enc.Finish());
+  CHECK(out == ref);
+
+  param.target_mode = sjpeg::EncoderParam::TARGET_SIZE;
+  param.target_value = 40000.f;
+  param.passes = 3;
+  for (int num_ok = 0; num_ok < 40; ++num_ok) {
+    FailingMemory memory(num_ok);
+    param.memory = &memory;
+    param.num_threads = (num_ok & 1) ? 3 : 1;
+    const bool ok = EncodeRGB(rgb, kWidth, kHeight, param, &out);
+    CHECK(ok == (memory.num_refused == 0));
+    CHECK(memory.live.empty());
+  }
+
+  // The search passes recycle the chunks of the previous one, whatever the
+  // number of bands: at most one partial chunk per band is added.
+  param.memory = nullptr;
+  param.target_value = 100000.f;
+  const size_t kChunkBytes = sizeof(sjpeg::RunLevel) *
+                             (sjpeg::RunLevelStore::kChunkSize + 4);
+  for (int passes = 1; passes <= 9; passes += 4) {
+    sjpeg::SearchHook hook;   // one candidate per pass, even with threads
+    sjpeg::EncoderStats stats[2];
+    for (int t = 0; t < 2; ++t) {
+      param.passes = passes;
+      param.num_threads = t ? 4 : 1;
+      param.search_hook = &hook;
+      param.stats = &stats[t];
+      CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &out));
+    }
+    CHECK(stats[1].run_levels_bytes <=
+          stats[0].run_levels_bytes + 4 * kChunkBytes);
+  }
+}
+
+// The packed coefficients must give the same output, with less memory.
+TEST(CompactCoeffs) {
+  const int kWidth = 200, kHeight = 150;
+  const std::vector<uint8_t> rgb = MakeRGB(kWidth, kHeight);
+  const SjpegYUVMode kModes[] = { SJPEG_YUV_420, SJPEG_YUV_444, SJPEG_YUV_400 };
+  for (size_t m = 0; m < ARRAY_SIZE(kModes); ++m) {
+    for (int tools = 0; tools < 16; ++tools) {
+      sjpeg::EncoderParam param((tools & 8) ? 95.f : 50.f);
+      param.yuv_mode = kModes[m];
+      param.adaptive_quantization = (tools & 1) != 0;
+      param.use_trellis = (tools & 2) != 0;
+      if (tools & 4) {
+        param.target_mode = (tools & 8) ? sjpeg::EncoderParam::TARGET_PSNR
+                                        : sjpeg::EncoderParam::TARGET_SIZE;
+        param.target_value = (tools & 8) ? 38.f : 5000.f;
+        param.passes = 4;
+      }
+      param.num_threads = 1 + (tools % 3);
+      param.pipelined = (tools & 1) != 0;
+      std::string ref, out;
+      PeakMemory plain, compact;
+      param.memory = &plain;
+      CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &ref));
+      param.memory = &compact;
+      param.compact_coeffs = true;
+      CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &out));
+      CHECK(out == ref);
+      CHECK(compact.largest <= plain.largest);
+      CHECK(compact.live.empty());
+    }
+  }
+  for (int num_ok = 0; num_ok < 48; ++num_ok) {
+    FailingMemory memory(num_ok);
+    sjpeg::EncoderParam param(80.f);
+    param.compact_coeffs = true;
+    param.target_mode = sjpeg::EncoderParam::TARGET_SIZE;
+    param.target_value = 4000.f;
+    param.passes = 3;
+    param.num_threads = (num_ok & 1) ? 3 : 1;
+    param.memory = &memory;
+    std::string out;
+    const bool ok = EncodeRGB(rgb, kWidth, kHeight, param, &out);
+    CHECK(ok == (memory.num_refused == 0));
+    CHECK(memory.live.empty());
+  }
+}
+
+// A memory budget trades speed for memory, down to converting the sharp YUV
+// samples band by band. None of these changes the output here.
+TEST(MemoryBudget) {
+  const int kWidth = 200, kHeight = 1000;
+  const std::vector<uint8_t> rgb = MakeRGB(kWidth, kHeight);
+  const SjpegYUVMode kModes[] = { SJPEG_YUV_420, SJPEG_YUV_SHARP };
+  for (size_t m = 0; m < ARRAY_SIZE(kModes); ++m) {
+    for (int tools = 0; tools < 4; ++tools) {
+      sjpeg::EncoderParam param(90.f);
+      param.yuv_mode = kModes[m];
+      param.Huffman_compress = (tools & 1) != 0;
+      if (tools & 2) {
+        param.target_mode = sjpeg::EncoderParam::TARGET_SIZE;
+        param.target_value = 50000.f;
+        param.passes = 3;
+      }
+      // the sharp conversion then runs on the calling thread
+      param.num_threads = (kModes[m] == SJPEG_YUV_SHARP) ? 1 : 2;
+      UsageMemory unlimited;
+      param.memory = &unlimited;
+      std::string ref;
+      CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &ref));
+      size_t lowest = unlimited.peak;
+      for (int budget = 15; budget >= 1; --budget) {
+        UsageMemory memory;
+        param.memory = &memory;
+        param.max_memory_bytes = unlimited.peak * budget / 16;
+        std::string out;
+        if (EncodeRGB(rgb, kWidth, kHeight, param, &out)) {
+          CHECK(out == ref);
+          CHECK(memory.peak <= lowest);
+          lowest = memory.peak;
+        } else {
+          CHECK(out.empty());
+        }
+        CHECK(memory.live.empty());
+      }
+      // the search can only pack the coefficients
+      CHECK(lowest < unlimited.peak * ((tools & 2) ? 7 : 4) / 8);
+      param.max_memory_bytes = 1000;   // not even the output fits
+      param.memory = nullptr;
+      std::string out;
+      CHECK(!EncodeRGB(rgb, kWidth, kHeight, param, &out));
+    }
+  }
+}
+
+TEST(EncoderStats) {
+  const int kWidth = 256, kHeight = 200;
+  const std::vector<uint8_t> rgb = MakeRGB(kWidth, kHeight);
+  const size_t kNumBlocks = (kWidth / 16) * ((kHeight + 15) / 16) * 6;
+  const SjpegYUVMode kModes[] = { SJPEG_YUV_420, SJPEG_YUV_SHARP };
+  for (size_t m = 0; m < ARRAY_SIZE(kModes); ++m) {
+    for (int tools = 0; tools < 8; ++tools) {
+      sjpeg::EncoderParam param(80.f);
+      param.yuv_mode = kModes[m];
+      param.compact_coeffs = (tools & 1) != 0;
+      param.num_threads = (tools & 2) ? 3 : 1;
+      if (tools & 4) {
+        param.target_mode = sjpeg::EncoderParam::TARGET_SIZE;
+        param.target_value = 8000.f;
+        param.passes = 3;
+      }
+      std::string ref;
+      CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &ref));
+      UsageMemory memory;
+      sjpeg::EncoderStats stats;
+      param.memory = &memory;
+      param.stats = &stats;
+      std::string out;
+      CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &out));
+      CHECK(out == ref);
+      // the counts are the memory manager's
+      CHECK(stats.peak_bytes == memory.peak);
+      CHECK(stats.num_allocs == static_cast<size_t>(memory.num_allocs));
+      CHECK(memory.live.empty());
+      // method 4: coefficients and run/levels are kept for the last scan
+      const size_t coeffs_bytes = kNumBlocks * 64 * sizeof(int16_t);
+      if (!param.compact_coeffs) {
+        CHECK(stats.coeffs_bytes == coeffs_bytes);
+      } else if (param.num_threads == 1) {
+        // (with threads, each band keeps its own unpacked rows)
+        CHECK(stats.coeffs_bytes < coeffs_bytes);
+      }
+      CHECK(stats.dct_coeffs_bytes > 0);
+      CHECK(stats.dct_coeffs_bytes < stats.coeffs_bytes);
+      CHECK(stats.run_levels_bytes > 0);
+      CHECK(stats.coeffs_bytes + stats.run_levels_bytes < stats.peak_bytes);
+      if (kModes[m] == SJPEG_YUV_SHARP) {
+        CHECK(stats.samples_bytes == kWidth * kHeight * 3 / 2);
+      } else {
+        CHECK(stats.samples_bytes == 0);
+      }
+      // the bands of the bitstream grow as they are coded
+      CHECK((stats.copied_bytes > 0) == (param.num_threads > 1));
+    }
+  }
+}
+
+// Pushing the rows in any grouping must give the same bitstream as Encode(),
+// with the single-pass tools.
+TEST(StreamEncoder) {
+  const int kWidth = 45, kHeight = 37;
+  const std::vector<uint8_t> rgb = MakeRGB(kWidth, kHeight);
+  const int kStride = 3 * kWidth;
+  const SjpegYUVMode kModes[] = { SJPEG_YUV_420, SJPEG_YUV_444, SJPEG_YUV_400 };
+  const int kChunks[] = { 1, 5, 16, 17, kHeight };
+  for (size_t m = 0; m < ARRAY_SIZE(kModes); ++m) {
+    for (int tools = 0; tools < 4; ++tools) {
+      sjpeg::EncoderParam param((tools & 2) ? 92.f : 50.f);
+      param.yuv_mode = kModes[m];
+      param.Huffman_compress = (tools & 1) != 0;
+      param.adaptive_quantization = false;
+      std::string ref;
+      CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &ref));
+      for (size_t c = 0; c < ARRAY_SIZE(kChunks); ++c) {
+        std::string out;
+        const auto sink = sjpeg::MakeByteSink(&out);
+        sjpeg::StreamEncoder enc;
+        bool ok = enc.Begin(kWidth, kHeight, param, sink.get());
+        for (int y = 0; y < kHeight; y += kChunks[c]) {
+          const int n = std::min(kChunks[c], kHeight - y);
+          ok = ok && enc.PushRows(&rgb[y * kStride], kStride, n);
+        }
+        CHECK(ok && enc.Finish());
+        CHECK(out == ref);
+      }
+    }
+  }
+
+  sjpeg::EncoderParam param(80.f);
+  std::string out;
+  const auto holder = sjpeg::MakeByteSink(&out);
+  sjpeg::ByteSink* const sink = holder.get();
+  sjpeg::StreamEncoder enc;
+  CHECK(!enc.PushRows(rgb.data(), kStride, 1));   // not started
+  CHECK(!enc.Finish());
+  CHECK(enc.Begin(kWidth, kHeight, param, sink));
+  CHECK(enc.PushRows(rgb.data(), kStride, kHeight - 1));
+  CHECK(!enc.Finish());                            // one row missing
+  CHECK(enc.Begin(kWidth, kHeight, param, sink));
+  CHECK(!enc.PushRows(rgb.data(), kStride, kHeight + 1));   // too many
+  CHECK(!enc.PushRows(rgb.data(), kStride, 1));   // still failing
+  CHECK(enc.Begin(kWidth, kHeight, param, sink));
+  CHECK(!enc.PushRows(rgb.data(), kStride - 1, 1));
+  CHECK(!enc.Begin(0, kHeight, param, sink));
+
+  for (int num_ok = 0; num_ok < 8; ++num_ok) {
+    FailingMemory memory(num_ok);
+    param.memory = &memory;
+    {
+      sjpeg::StreamEncoder failing;
+      const bool ok = failing.Begin(kWidth, kHeight, param, sink) &&
+                      failing.PushRows(rgb.data(), kStride, kHeight) &&
+                      failing.Finish();
+      CHECK(ok == (memory.num_refused == 0));
+    }
+    CHECK(memory.live.empty());
+  }
+}
+
+TEST(EncoderContext) {
+  const struct { int width, height; float quality; int tools; } kCalls[] = {
+    { 64, 48, 80.f, 0 }, { 64, 48, 80.f, 0 }, { 45, 37, 80.f, 1 },
+    { 300, 200, 60.f, 2 }, { 64, 48, 80.f, 0 }, { 17, 9, 95.f, 3 },
+    { 64, 48, 95.f, 4 }, { 300, 200, 60.f, 0 }, { 45, 37, 80.f, 1 },
+  };
+  const SjpegYUVMode kModes[] = { SJPEG_YUV_420, SJPEG_YUV_444, SJPEG_YUV_400,
+                                  SJPEG_YUV_SHARP, SJPEG_YUV_AUTO };
+  TrackingMemory memory;
+  {
+    sjpeg::EncoderContext context(&memory);
+    for (size_t i = 0; i < ARRAY_SIZE(kCalls); ++i) {
+      const int W = kCalls[i].width, H = kCalls[i].height;
+      const std::vector<uint8_t> rgb = MakeRGB(W, H);
+      sjpeg::EncoderParam param(kCalls[i].quality);
+      param.yuv_mode = kModes[i % ARRAY_SIZE(kModes)];
+      param.Huffman_compress = (kCalls[i].tools & 1) != 0;
+      param.adaptive_quantization = (kCalls[i].tools & 2) != 0;
+      if (kCalls[i].tools & 4) param.passes = 3;
+      std::string ref, out;
+      CHECK(sjpeg::Encode(rgb.data(), W, H, 3 * W, param, &ref));
+      CHECK(context.Encode(rgb.data(), W, H, 3 * W, param, &out));
+      CHECK(out == ref);
+    }
+    CHECK(!context.Encode(nullptr, 64, 48, 3 * 64, sjpeg::EncoderParam(),
+                          static_cast<std::string*>(nullptr)));
+
+    // Once the buffers are kept, the same encoding allocates nothing more.
+    const std::vector<uint8_t> rgb = MakeRGB(64, 48);
+    const sjpeg::EncoderParam param(80.f);
+    std::string out;
+    CHECK(context.Encode(rgb.data(), 64, 48, 3 * 64, param, &out));
+    const int num_allocs = memory.num_allocs;
+    for (int i = 0; i < 3; ++i) {
+      CHECK(context.Encode(rgb.data(), 64, 48, 3 * 64, param, &out));
+    }
+    CHECK(memory.num_allocs == num_allocs);
+    CHECK(!memory.live.empty());
+    context.Clear();
+    CHECK(memory.live.empty());
+    CHECK(context.Encode(rgb.data(), 64, 48, 3 * 64, param, &out));
+  }
+  CHECK(memory.live.empty());
+  CHECK(memory.num_foreign_frees == 0);
+}
+
+TEST(ArenaMemory) {
+  const int kWidth = 300, kHeight = 200;
+  const std::vector<uint8_t> rgb = MakeRGB(kWidth, kHeight);
+  TrackingMemory base;
+  {
+    sjpeg::ArenaMemoryManager arena(0, &base);
+    for (int i = 0; i < 6; ++i) {
+      sjpeg::EncoderParam param(70.f);
+      param.yuv_mode = (i & 1) ? SJPEG_YUV_SHARP : SJPEG_YUV_420;
+      param.Huffman_compress = (i >= 2);   // grows the run/levels
+      if (i >= 4) param.num_threads = 3;
+      std::string ref, out;
+      CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &ref));
+      param.memory = &arena;
+      CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &out));
+      CHECK(out == ref);
+      CHECK(arena.HighWaterMark() <= arena.Capacity());
+      arena.Reset();
+    }
+    // After Reset(), the chunks are merged: the same encoding is then served
+    // by a single one.
+    sjpeg::EncoderParam param(70.f);
+    param.Huffman_compress = true;
+    param.memory = &arena;
+    std::string out;
+    CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &out));
+    arena.Reset();
+    const int num_allocs = base.num_allocs;
+    CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &out));
+    CHECK(base.num_allocs == num_allocs);
+    CHECK(base.live.size() == 1);
+
+    // Only the last allocation is taken back by Free().
+    arena.Reset();
+    void* const a = arena.Alloc(100);
+    void* const b = arena.Alloc(100);
+    CHECK(a != nullptr && b != nullptr && a != b);
+    arena.Free(a);
+    CHECK(arena.Alloc(10) != a);
+    void* const c = arena.Alloc(10);
+    arena.Free(c);
+    CHECK(arena.Alloc(10) == c);
+    memset(c, 0x5a, 10);
+    uint8_t* const d = static_cast<uint8_t*>(arena.Realloc(c, 10, 1000));
+    CHECK(d == c && d[9] == 0x5a);   // grown in place
+    CHECK(arena.Alloc(arena.Capacity()) != nullptr);   // new chunk
+  }
+  CHECK(base.live.empty());
+  CHECK(base.num_foreign_frees == 0);
+}
+
+// The parallel stages must go through the user-supplied executor, and the
+// result must only depend on num_threads.
+TEST(Executor) {
+  const int kWidth = 80, kHeight = 72;
+  const std::vector<uint8_t> rgb = MakeRGB(kWidth, kHeight);
+  sjpeg::EncoderParam param(75.f);
+  param.yuv_mode = SJPEG_YUV_420;
+  param.num_threads = 3;
+  std::string ref;
+  CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &ref));
+
+  SerialExecutor serial;
+  param.executor = &serial;
+  std::string out;
+  CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &out));
+  CHECK(out == ref);
+  CHECK(serial.num_calls > 0);
+
+  const std::shared_ptr<sjpeg::Executor> pool = sjpeg::MakeThreadPool(4);
+  CHECK(pool != nullptr);
+  param.executor = pool.get();
+  // several encoders sharing the pool at once
+  std::vector<std::string> outs(4);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < outs.size(); ++t) {
+    threads.push_back(std::thread([&, t]() {
+      EncodeRGB(rgb, kWidth, kHeight, param, &outs[t]);
+    }));
+  }
+  for (size_t t = 0; t < threads.size(); ++t) threads[t].join();
+  for (size_t t = 0; t < outs.size(); ++t) CHECK(outs[t] == ref);
+
+  // nested calls, from inside the pool, must not deadlock
+  std::vector<int> hits(8 * 8, 0);
+  pool->ParallelFor(0, 8, [&](int i) {
+    pool->ParallelFor(0, 8, [&](int j) { ++hits[i * 8 + j]; });
+  });
+  for (size_t i = 0; i < hits.size(); ++i) CHECK(hits[i] == 1);
+}
+
+// In pipelined mode, the bitstream is the single-threaded one. This includes
+// the final scan's segments, stitched at any bit position.
+TEST(Pipelined) {
+  const int kWidth = 72, kHeight = 64;
+  const std::vector<uint8_t> rgb = MakeRGB(kWidth, kHeight);
+  const SjpegYUVMode kModes[] = { SJPEG_YUV_420, SJPEG_YUV_444 };
+  for (size_t m = 0; m < ARRAY_SIZE(kModes); ++m) {
+    for (int tools = 0; tools < 16; ++tools) {
+      sjpeg::EncoderParam param((tools & 8) ? 95.f : 40.f);
+      param.yuv_mode = kModes[m];
+      param.Huffman_compress = (tools & 1) != 0;
+      param.adaptive_quantization = (tools & 2) != 0;
+      param.use_trellis = (tools & 4) != 0;
+      std::string ref, out;
+      CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &ref));
+      param.pipelined = true;
+      for (int num_threads = 2; num_threads <= 7; num_threads += 5) {
+        param.num_threads = num_threads;
+        CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &out));
+        CHECK(out == ref);
+      }
+    }
+  }
+  for (int num_ok = 0; num_ok < 12; ++num_ok) {
+    FailingMemory memory(num_ok);
+    sjpeg::EncoderParam param(80.f);
+    param.Huffman_compress = false;
+    param.memory = &memory;
+    param.num_threads = 3;
+    param.pipelined = true;
+    std::string out;
+    const bool ok = EncodeRGB(rgb, kWidth, kHeight, param, &out);
+    CHECK(ok == (memory.num_refused == 0));
+    CHECK(memory.live.empty());
+  }
+}
+
+// Adaptive quantization must pick the same matrices whatever the number of
+// threads the histograms are collected with.
+TEST(ParallelHistograms) {
+  const int kWidth = 97, kHeight = 83;
+  const std::vector<uint8_t> rgb = MakeRGB(kWidth, kHeight);
+  uint8_t ref[2][64];
+  for (int num_threads = 1; num_threads <= 7; num_threads += 3) {
+    for (int trellis = 0; trellis <= 1; ++trellis) {
+      sjpeg::EncoderParam param(65.f);
+      param.adaptive_quantization = true;
+      param.use_trellis = (trellis != 0);
+      param.num_threads = num_threads;
+      std::string out;
+      CHECK(EncodeRGB(rgb, kWidth, kHeight, param, &out));
+      uint8_t quant[2][64];
+      CHECK(SjpegFindQuantizer(out, quant) == 2);
+      if (num_threads == 1 && !trellis) memcpy(ref, quant, sizeof(ref));
+      CHECK(memcmp(quant, ref, sizeof(ref)) == 0);
+    }
+  }
+}
+
+// A search evaluating several candidates per pass must reach the target as
+// well as the serial one, in fewer passes, and with a deterministic result.
+TEST(ConcurrentSearch) {
+  const int W = 96, H = 64;
+  const std::vector<uint8_t> rgb = MakeRGB(W, H);
+  sjpeg::EncoderParam param(60.f);
+  std::string out;
+  CHECK(EncodeRGB(rgb, W, H, param, &out));
+  const double target = out.size();
+  param.target_mode = sjpeg::EncoderParam::TARGET_SIZE;
+  param.target_value = static_cast<float>(target);
+  param.tolerance = 1.f;
+  param.passes = 12;
+
+  sjpeg::SearchHook serial_hook;
+  param.search_hook = &serial_hook;
+  CHECK(EncodeRGB(rgb, W, H, param, &out));
+  std::string ref;
+  for (int run = 0; run < 2; ++run) {
+    sjpeg::SearchHook hook;
+    hook.num_candidates = 4;
+    param.search_hook = &hook;
+    param.num_threads = 4;
+    CHECK(EncodeRGB(rgb, W, H, param, &out));
+    CHECK(fabs(out.size() - target) < 0.03 * target);
+    CHECK(hook.pass <= serial_hook.pass);
+    if (run == 0) ref = out;
+    CHECK(out == ref);
+  }
+}
+
+// Each job of a batch must come out as if encoded alone, the large ones
+// being split into as many bands as there are threads.
+TEST(EncodeBatch) {
+  const struct { int width, height; sjpeg::EncodeJob::Format format; } kPics[]
+      = { { 64, 64, sjpeg::EncodeJob::RGB },
+          { 1100, 1000, sjpeg::EncodeJob::RGB },
+          { 40, 30, sjpeg::EncodeJob::BGRA },
+          { 33, 17, sjpeg::EncodeJob::GRAY },
+          { 65, 47, sjpeg::EncodeJob::RGBA } };
+  const int kNumPics = ARRAY_SIZE(kPics), kNumThreads = 3;
+  std::vector<std::vector<uint8_t>> pixels(kNumPics);
+  std::vector<std::string> outputs(kNumPics + 1);
+  std::vector<std::shared_ptr<sjpeg::ByteSink>> sinks;
+  std::vector<sjpeg::EncodeJob> jobs(kNumPics + 1);
+  for (int i = 0; i < kNumPics; ++i) {
+    const int bpp = (kPics[i].format == sjpeg::EncodeJob::RGB) ? 3
+                  : (kPics[i].format == sjpeg::EncodeJob::GRAY) ? 1 : 4;
+    pixels[i] = MakeRGB(kPics[i].width * bpp, kPics[i].height);
+    jobs[i].pixels = pixels[i].data();
+    jobs[i].width = kPics[i].width;
+    jobs[i].height = kPics[i].height;
+    jobs[i].stride = 3 * bpp * kPics[i].width;   // padded rows
+    jobs[i].format = kPics[i].format;
+    jobs[i].param.SetQuality(60.f + 5.f * i);
+  }
+  jobs[kNumPics] = jobs[0];
+  jobs[kNumPics].pixels = nullptr;   // invalid job
+  for (int i = 0; i <= kNumPics; ++i) {
+    sinks.push_back(sjpeg::MakeByteSink(&outputs[i]));
+    jobs[i].sink = sinks.back().get();
+  }
+  std::vector<bool> results;
+  CHECK(!sjpeg::EncodeBatch(jobs, kNumThreads, nullptr, &results));
+  CHECK(results.size() == jobs.size());
+  CHECK(!results[kNumPics]);
+
+  for (int i = 0; i < kNumPics; ++i) {
+    CHECK(results[i]);
+    CHECK(HasSize(outputs[i], kPics[i].width, kPics[i].height));
+    sjpeg::EncoderParam param = jobs[i].param;
+    if (kPics[i].width * kPics[i].height > (1 << 20)) {
+      param.num_threads = kNumThreads;
+    }
+    std::string ref;
+    const uint8_t* const data = jobs[i].pixels;
+    const int W = jobs[i].width, H = jobs[i].height, stride = jobs[i].stride;
+    switch (jobs[i].format) {
+      case sjpeg::EncodeJob::RGB:
+        CHECK(sjpeg::Encode(data, W, H, stride, param, &ref));
+        break;
+      case sjpeg::EncodeJob::BGRA:
+        CHECK(sjpeg::EncodeBGRA(data, W, H, stride, param, &ref));
+        break;
+      case sjpeg::EncodeJob::RGBA:
+        CHECK(sjpeg::EncodeRGBA(data, W, H, stride, param, &ref));
+        break;
+      case sjpeg::EncodeJob::GRAY:
+        CHECK(sjpeg::EncodeGray(data, W, H, stride, param, &ref));
+        break;
+    }
+    CHECK(outputs[i] == ref);
+  }
+  CHECK(sjpeg::EncodeBatch(std::vector<sjpeg::EncodeJob>(), kNumThreads));
+}
+
 TEST(QuantMatrix) {
   for (int quality = 0; quality <= 100; quality += 5) {
     for (int chroma = 0; chroma <= 1; ++chroma) {
@@ -645,6 +1482,235 @@ TEST(QuantMatrix) {
   CHECK(memcmp(quant[1], param.GetQuantMatrix(1), 64) == 0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// SIMD kernels must match the plain-C ones, bit-wise.
+
+// Returns the plain-C and the fastest implementations from 'get'.
+template<class Func> void GetKernels(Func (*get)(), Func* ref, Func* fast) {
+  sjpeg::ForceSlowCImplementation = true;
+  *ref = get();
+  sjpeg::ForceSlowCImplementation = false;
+  *fast = get();
+}
+
+TEST(FdctSIMD) {
+  sjpeg::FdctFunc ref_fdct, fdct;
+  GetKernels(&sjpeg::GetFdct, &ref_fdct, &fdct);
+  g_seed = kSeed;
+  // odd and even number of blocks, random and extreme samples
+  for (int num_blocks = 1; num_blocks <= 7; ++num_blocks) {
+    for (int pattern = 0; pattern < 4; ++pattern) {
+      alignas(32) int16_t ref[7 * 64], out[7 * 64];
+      for (int i = 0; i < num_blocks * 64; ++i) {
+        const int v = Random8b() - 128;
+        ref[i] = (pattern == 0) ? v :
+                 (pattern == 1) ? -128 :
+                 (pattern == 2) ? 127 :
+                 ((i ^ (i >> 3)) & 1) ? 127 : -128;
+      }
+      memcpy(out, ref, num_blocks * 64 * sizeof(*ref));
+      ref_fdct(ref, num_blocks);
+      fdct(out, num_blocks);
+      CHECK(memcmp(ref, out, num_blocks * 64 * sizeof(*ref)) == 0);
+    }
+  }
+}
+
+// Real fDCT output for the quantization kernels, by groups of 'num_blocks':
+// noise (dense), gradients (sparse), flat blocks (no AC) and extreme
+// samples (large coeffs).
+std::vector<int16_t> MakeDctBlocks(int num_blocks) {
+  const sjpeg::FdctFunc fdct = sjpeg::GetFdct();
+  std::vector<int16_t> blocks(4 * num_blocks * 64);
+  g_seed = kSeed;
+  for (int b = 0; b < 4 * num_blocks; ++b) {
+    int16_t* const block = &blocks[b * 64];
+    const int pattern = b / num_blocks;
+    const int level = Random8b() - 128;
+    for (int i = 0; i < 64; ++i) {
+      const int x = i & 7, y = i >> 3;
+      block[i] = (pattern == 0) ? Random8b() - 128 :
+                 (pattern == 1) ? (level + (x + 2 * y) * (b & 7)) / 2 :
+                 (pattern == 2) ? level :
+                 ((x ^ y ^ b) & 1) ? 127 : -128;
+    }
+    fdct(block, 1);
+  }
+  return blocks;
+}
+
+// Random matrices, including quant = 1, finalized with a random bias.
+void MakeQuantizer(int pattern, sjpeg::Quantizer* const q) {
+  for (int i = 0; i < 64; ++i) {
+    const uint8_t v = Random8b();
+    q->quant_[i] = (pattern == 0) ? 1 :
+                   (pattern == 1) ? 1 + (v & 3) :
+                   (v < 16) ? 1 : v;
+    q->min_quant_[i] = 1;
+  }
+  q->codes_ = nullptr;
+  sjpeg::Encoder::FinalizeQuantMatrix(q, (pattern == 0) ? sjpeg::kDefaultBias
+                                                        : Random8b());
+}
+
+// Returns the fastest kernel from 'get', along with the SSE2 one 'sse2' if
+// it isn't the same: GetKernels() never returns the tiers in between.
+template<class Func> std::vector<Func> GetSIMDKernels(Func (*get)(),
+                                                      Func sse2, Func* ref) {
+  Func fast;
+  GetKernels(get, ref, &fast);
+  std::vector<Func> funcs;
+  if (fast != *ref) funcs.push_back(fast);
+  if (sse2 != nullptr && sse2 != fast) funcs.push_back(sse2);
+  return funcs;
+}
+
+#if defined(SJPEG_USE_SSE2)
+#define SSE2_KERNEL(func) (sjpeg::SupportsSSE2() ? (func) : nullptr)
+#else
+#define SSE2_KERNEL(func) nullptr
+#endif
+
+// The plain-C StoreHisto() doesn't fill the last bin: the SIMD versions are
+// compared to it on the other bins, and to each other on all of them.
+TEST(StoreHistoSIMD) {
+  sjpeg::Encoder::StoreHistoFunc ref_func;
+  const std::vector<sjpeg::Encoder::StoreHistoFunc> funcs =
+      GetSIMDKernels(&sjpeg::Encoder::GetStoreHistoFunc,
+                     SSE2_KERNEL(sjpeg::StoreHistoSSE2), &ref_func);
+  const int kNumBlocks = 5;
+  const std::vector<int16_t> blocks = MakeDctBlocks(kNumBlocks);
+  std::vector<sjpeg::Histo> histos(1 + funcs.size());
+  memset(&histos[0], 0, histos.size() * sizeof(histos[0]));
+  for (int pattern = 0; pattern < 4; ++pattern) {
+    const int16_t* const in = &blocks[pattern * kNumBlocks * 64];
+    ref_func(in, &histos[0], kNumBlocks);
+    for (size_t k = 0; k < funcs.size(); ++k) {
+      funcs[k](in, &histos[1 + k], kNumBlocks);
+      for (int i = 0; i < 64; ++i) {
+        CHECK(memcmp(histos[0].counts_[i], histos[1 + k].counts_[i],
+                     sjpeg::MAX_HISTO_DCT_COEFF * sizeof(int)) == 0);
+      }
+      CHECK(memcmp(&histos[1], &histos[1 + k], sizeof(histos[1])) == 0);
+    }
+  }
+}
+
+TEST(QuantizeErrorSIMD) {
+  sjpeg::Encoder::QuantizeErrorFunc ref_func;
+  const std::vector<sjpeg::Encoder::QuantizeErrorFunc> funcs =
+      GetSIMDKernels(&sjpeg::Encoder::GetQuantizeErrorFunc,
+                     SSE2_KERNEL(sjpeg::QuantizeErrorSSE2), &ref_func);
+  const int kNumBlocks = 5;
+  const std::vector<int16_t> blocks = MakeDctBlocks(kNumBlocks);
+  for (int pattern = 0; pattern < 3; ++pattern) {
+    for (int n = 0; n < 4; ++n) {
+      sjpeg::Quantizer q;
+      MakeQuantizer(pattern, &q);
+      for (size_t b = 0; b < blocks.size(); b += 64) {
+        const uint32_t ref = ref_func(&blocks[b], &q);
+        for (size_t k = 0; k < funcs.size(); ++k) {
+          CHECK(funcs[k](&blocks[b], &q) == ref);
+        }
+      }
+    }
+  }
+}
+
+TEST(QuantizeSIMD) {
+  sjpeg::Encoder::QuantizeBlockFunc ref_func;
+  const std::vector<sjpeg::Encoder::QuantizeBlockFunc> funcs =
+      GetSIMDKernels(&sjpeg::Encoder::GetQuantizeBlockFunc,
+                     SSE2_KERNEL(sjpeg::QuantizeBlockSSE2), &ref_func);
+  const int kNumBlocks = 5;
+  const std::vector<int16_t> blocks = MakeDctBlocks(kNumBlocks);
+  for (int pattern = 0; pattern < 3; ++pattern) {
+    for (int n = 0; n < 4; ++n) {
+      sjpeg::Quantizer q;
+      MakeQuantizer(pattern, &q);
+      for (size_t b = 0; b < blocks.size(); b += 64) {
+        const int idx = n & 1;
+        sjpeg::DCTCoeffs ref;
+        sjpeg::RunLevel ref_rl[64];
+        memset(&ref, 0, sizeof(ref));
+        const int ref_dc = ref_func(&blocks[b], idx, &q, &ref, ref_rl);
+        for (size_t k = 0; k < funcs.size(); ++k) {
+          sjpeg::DCTCoeffs out;
+          sjpeg::RunLevel out_rl[64];
+          memset(&out, 0, sizeof(out));
+          CHECK(funcs[k](&blocks[b], idx, &q, &out, out_rl) == ref_dc);
+          CHECK(memcmp(&ref, &out, sizeof(ref)) == 0);
+          if (ref.nb_coeffs_ != out.nb_coeffs_) continue;
+          for (int i = 0; i < ref.nb_coeffs_; ++i) {
+            CHECK(ref_rl[i].run_ == out_rl[i].run_);
+            CHECK(ref_rl[i].level_ == out_rl[i].level_);
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST(BlockFuncSIMD) {
+  const SjpegYUVMode kModes[] = { SJPEG_YUV_420, SJPEG_YUV_444, SJPEG_YUV_400 };
+  const sjpeg::PixelFormat kFormats[] = {
+    sjpeg::kRGBInput, sjpeg::kBGRAInput, sjpeg::kRGBAInput
+  };
+  const int kStride = 16 * 4 + 5;
+  std::vector<uint8_t> src(16 * kStride);
+  g_seed = kSeed;
+  for (int pattern = 0; pattern < 3; ++pattern) {
+    for (size_t i = 0; i < src.size(); ++i) {
+      src[i] = (pattern == 0) ? Random8b() : (pattern == 1) ? 0 : 255;
+    }
+    for (size_t m = 0; m < ARRAY_SIZE(kModes); ++m) {
+      for (size_t f = 0; f < ARRAY_SIZE(kFormats); ++f) {
+        sjpeg::ForceSlowCImplementation = true;
+        const sjpeg::RGBToYUVBlockFunc ref_func =
+            sjpeg::GetBlockFunc(kModes[m], kFormats[f]);
+        sjpeg::ForceSlowCImplementation = false;
+        const sjpeg::RGBToYUVBlockFunc func =
+            sjpeg::GetBlockFunc(kModes[m], kFormats[f]);
+        int16_t ref[6 * 64], out[6 * 64];
+        memset(ref, 0, sizeof(ref));
+        memset(out, 0, sizeof(out));
+        ref_func(src.data(), kStride, ref);
+        func(src.data(), kStride, out);
+        CHECK(memcmp(ref, out, sizeof(ref)) == 0);
+#if defined(SJPEG_USE_SSSE3)
+        // with AVX2, GetBlockFunc() never returns the SSSE3 tier
+        if (kFormats[f] == sjpeg::kRGBInput && sjpeg::SupportsSSSE3()) {
+          memset(out, 0, sizeof(out));
+          sjpeg::GetBlockFuncSSSE3(kModes[m])(src.data(), kStride, out);
+          CHECK(memcmp(ref, out, sizeof(ref)) == 0);
+        }
+#endif
+      }
+    }
+  }
+}
+
+TEST(RowFuncSIMD) {
+  sjpeg::RGBToIndexRowFunc ref_func, func;
+  GetKernels(&sjpeg::GetRowFunc, &ref_func, &func);
+  const int kMaxWidth = 37;
+  std::vector<uint8_t> src(3 * kMaxWidth);
+  g_seed = kSeed;
+  for (int pattern = 0; pattern < 3; ++pattern) {
+    for (size_t i = 0; i < src.size(); ++i) {
+      src[i] = (pattern == 0) ? Random8b() : (pattern == 1) ? 0 : 255;
+    }
+    // widths that are not a multiple of 8 end with a partial group
+    for (int width = 1; width <= kMaxWidth; ++width) {
+      uint16_t ref[kMaxWidth + 1], out[kMaxWidth + 1];
+      ref[width] = out[width] = 0xbeef;
+      ref_func(src.data(), width, ref);
+      func(src.data(), width, out);
+      CHECK(memcmp(ref, out, (width + 1) * sizeof(*ref)) == 0);
+    }
+  }
+}
+
 }  // namespace
 
 int main(int argc, char* argv[]) {